@@ -297,6 +297,144 @@ DHGenerateKey(MDH *dh) {
     return 1;
 }
 
+#ifndef _WIN32
+/*
+ * Keypairs generated ahead of the handshakes on a background thread, each
+ * one is handed out once. A handshake finding the pool empty generates its
+ * own as before.
+ */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    MDH **keys;
+    int depth;
+    /* keypairs to keep ready */
+    int count;
+    int running;
+    int exited;
+    /* the thread gave up on its own and waits to be joined */
+} dhPool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static void *
+DHPoolThread(void *arg) {
+    MDH *dh;
+
+    (void) arg;
+    pthread_mutex_lock(&dhPool.lock);
+    while (dhPool.running) {
+        if (dhPool.count >= dhPool.depth) {
+            pthread_cond_wait(&dhPool.cond, &dhPool.lock);
+            continue;
+        }
+        pthread_mutex_unlock(&dhPool.lock);
+
+        dh = DHInit(1024);
+        if (dh && !DHGenerateKey(dh)) {
+            MDH_free(dh);
+            dh = NULL;
+        }
+
+        pthread_mutex_lock(&dhPool.lock);
+        if (!dh) {
+            RTMP_Log(RTMP_LOGERROR, "%s: Couldn't generate Diffie-Hellmann keys, pool stopped",
+                    __FUNCTION__);
+            dhPool.exited = TRUE;
+            break;
+        }
+        if (dhPool.running && dhPool.count < dhPool.depth)
+            dhPool.keys[dhPool.count++] = dh;
+        else {
+            MDH_free(dh);
+        }
+    }
+    pthread_mutex_unlock(&dhPool.lock);
+    return NULL;
+}
+
+static int
+DHPoolStart(int depth) {
+    MDH **keys;
+    int ret = TRUE;
+
+    if (depth <= 0)
+        return FALSE;
+    pthread_mutex_lock(&dhPool.lock);
+    if (depth > dhPool.depth) {
+        keys = realloc(dhPool.keys, depth * sizeof(MDH *));
+        if (!keys) {
+            pthread_mutex_unlock(&dhPool.lock);
+            return FALSE;
+        }
+        dhPool.keys = keys;
+    }
+    /* a smaller depth drops nothing, takes shrink the pool down to it */
+    dhPool.depth = depth;
+    /* it no longer takes the lock once exited, joined here to start anew */
+    if (dhPool.exited) {
+        pthread_join(dhPool.thread, NULL);
+        dhPool.exited = FALSE;
+        dhPool.running = FALSE;
+    }
+    if (!dhPool.running) {
+        dhPool.running = TRUE;
+        if (pthread_create(&dhPool.thread, NULL, DHPoolThread, NULL)) {
+            dhPool.running = FALSE;
+            ret = FALSE;
+        }
+    }
+    else
+        pthread_cond_signal(&dhPool.cond);
+    pthread_mutex_unlock(&dhPool.lock);
+    return ret;
+}
+
+static void
+DHPoolStop(void) {
+    MDH *dh;
+
+    pthread_mutex_lock(&dhPool.lock);
+    if (!dhPool.running) {
+        pthread_mutex_unlock(&dhPool.lock);
+        return;
+    }
+    dhPool.running = FALSE;
+    pthread_cond_signal(&dhPool.cond);
+    pthread_mutex_unlock(&dhPool.lock);
+    pthread_join(dhPool.thread, NULL);
+    dhPool.exited = FALSE;
+
+    /* MDH_free names its argument more than once */
+    while (dhPool.count > 0) {
+        dh = dhPool.keys[--dhPool.count];
+        MDH_free(dh);
+    }
+    free(dhPool.keys);
+    dhPool.keys = NULL;
+    dhPool.depth = 0;
+}
+
+/*
+ * @brief a generated keypair, NULL if the pool is empty, never waits for one
+ */
+static MDH *
+DHPoolTake(void) {
+    MDH *dh = NULL;
+
+    pthread_mutex_lock(&dhPool.lock);
+    if (dhPool.count > 0) {
+        dh = dhPool.keys[--dhPool.count];
+        pthread_cond_signal(&dhPool.cond);
+    }
+    pthread_mutex_unlock(&dhPool.lock);
+    return dh;
+}
+#else
+#define DHPoolStart(depth)    FALSE
+#define DHPoolStop()
+#define DHPoolTake()    NULL
+#endif
+
 /* fill pubkey with the public key in BIG ENDIAN order
  * 00 00 00 00 00 x1 x2 x3 .....
  */
@@ -770,23 +770,26 @@ static int HandShake(RTMP *r, int FP9HandShake) {
     /* set handshake digest */
     if (FP9HandShake) {
         if (encrypted) {
-            /* generate Diffie-Hellmann parameters */
-            r->Link.dh = DHInit(1024);
+            /* generate Diffie-Hellmann parameters, unless the pool has them ready */
+            r->Link.dh = DHPoolTake();
             if (!r->Link.dh) {
-                RTMP_Log(RTMP_LOGERROR, "%s: Couldn't initialize Diffie-Hellmann!",
-                        __FUNCTION__);
-                return FALSE;
+                r->Link.dh = DHInit(1024);
+                if (!r->Link.dh) {
+                    RTMP_Log(RTMP_LOGERROR, "%s: Couldn't initialize Diffie-Hellmann!",
+                            __FUNCTION__);
+                    return FALSE;
+                }
+
+                if (!DHGenerateKey(r->Link.dh)) {
+                    RTMP_Log(RTMP_LOGERROR, "%s: Couldn't generate Diffie-Hellmann public key!",
+                            __FUNCTION__);
+                    return FALSE;
+                }
             }
 
             dhposClient = getdh(clientsig, RTMP_SIG_SIZE);
             RTMP_Log(RTMP_LOGDEBUG, "%s: DH pubkey position: %d", __FUNCTION__, dhposClient);
 
-            if (!DHGenerateKey(r->Link.dh)) {
-                RTMP_Log(RTMP_LOGERROR, "%s: Couldn't generate Diffie-Hellmann public key!",
-                        __FUNCTION__);
-                return FALSE;
-            }
-
             if (!DHGetPublicKey(r->Link.dh, &clientsig[dhposClient], 128)) {
                 RTMP_Log(RTMP_LOGERROR, "%s: Couldn't write public key!", __FUNCTION__);
                 return FALSE;
@@ -1159,23 +1162,26 @@ static int SHandShake(RTMP * r) {
     /* set handshake digest */
     if (FP9HandShake) {
         if (encrypted) {
-            /* generate Diffie-Hellmann parameters */
-            r->Link.dh = DHInit(1024);
+            /* generate Diffie-Hellmann parameters, unless the pool has them ready */
+            r->Link.dh = DHPoolTake();
             if (!r->Link.dh) {
-                RTMP_Log(RTMP_LOGERROR, "%s: Couldn't initialize Diffie-Hellmann!",
-                        __FUNCTION__);
-                return FALSE;
+                r->Link.dh = DHInit(1024);
+                if (!r->Link.dh) {
+                    RTMP_Log(RTMP_LOGERROR, "%s: Couldn't initialize Diffie-Hellmann!",
+                            __FUNCTION__);
+                    return FALSE;
+                }
+
+                if (!DHGenerateKey(r->Link.dh)) {
+                    RTMP_Log(RTMP_LOGERROR, "%s: Couldn't generate Diffie-Hellmann public key!",
+                            __FUNCTION__);
+                    return FALSE;
+                }
             }
 
             dhposServer = getdh(serversig, RTMP_SIG_SIZE);
             RTMP_Log(RTMP_LOGDEBUG, "%s: DH pubkey position: %d", __FUNCTION__, dhposServer);
 
-            if (!DHGenerateKey(r->Link.dh)) {
-                RTMP_Log(RTMP_LOGERROR, "%s: Couldn't generate Diffie-Hellmann public key!",
-                        __FUNCTION__);
-                return FALSE;
-            }
-
             if (!DHGetPublicKey
                     (r->Link.dh, (uint8_t *) &serversig[dhposServer], 128)) {
                 RTMP_Log(RTMP_LOGERROR, "%s: Couldn't write public key!", __FUNCTION__);
@@ -90,6 +90,7 @@ HTTP_get(struct HTTP_ctx *http, const char *url, HTTP_read_callback *cb) {
     HTTPResult ret = HTTPRES_OK;
     struct sockaddr_in sa;
     RTMPSockBuf sb = {0};
+    char req[RTMP_BUFFER_CACHE_SIZE];
 
     http->status = -1;
 
@@ -139,12 +140,12 @@ HTTP_get(struct HTTP_ctx *http, const char *url, HTTP_read_callback *cb) {
     if (sb.sb_socket == -1)
         return HTTPRES_LOST_CONNECTION;
     i =
-            sprintf(sb.sb_buf,
+            sprintf(req,
                     "GET %s HTTP/1.0\r\nUser-Agent: %s\r\nHost: %s\r\nReferer: %.*s\r\n",
                     path, AGENT, host, (int) (path - url + 1), url);
     if (http->date[0])
-        i += sprintf(sb.sb_buf + i, "If-Modified-Since: %s\r\n", http->date);
-    i += sprintf(sb.sb_buf + i, "\r\n");
+        i += sprintf(req + i, "If-Modified-Since: %s\r\n", http->date);
+    i += sprintf(req + i, "\r\n");
 
     if (connect
             (sb.sb_socket, (struct sockaddr *) &sa, sizeof(struct sockaddr)) < 0) {
@@ -168,7 +169,7 @@ HTTP_get(struct HTTP_ctx *http, const char *url, HTTP_read_callback *cb) {
 #endif
     }
 #endif
-    RTMPSockBuf_Send(&sb, sb.sb_buf, i);
+    RTMPSockBuf_Send(&sb, req, i);
 
     /* set timeout */
 #define HTTP_TIMEOUT    5
@@ -187,12 +188,16 @@ HTTP_get(struct HTTP_ctx *http, const char *url, HTTP_read_callback *cb) {
         ret = HTTPRES_LOST_CONNECTION;
         goto leave;
     }
-    if (strncmp(sb.sb_buf, "HTTP/1", 6)) {
+    if (sb.sb_size < 6 || strncmp(sb.sb_start, "HTTP/1", 6)) {
         ret = HTTPRES_BAD_REQUEST;
         goto leave;
     }
 
-    p1 = strchr(sb.sb_buf, ' ');
+    p1 = memchr(sb.sb_start, ' ', sb.sb_size);
+    if (!p1) {
+        ret = HTTPRES_BAD_REQUEST;
+        goto leave;
+    }
     rc = atoi(p1 + 1);
     http->status = rc;
 
@@ -211,13 +216,13 @@ HTTP_get(struct HTTP_ctx *http, const char *url, HTTP_read_callback *cb) {
             ret = HTTPRES_REDIRECTED;
     }
 
-    p1 = memchr(sb.sb_buf, '\n', sb.sb_size);
+    p1 = memchr(sb.sb_start, '\n', sb.sb_size);
     if (!p1) {
         ret = HTTPRES_BAD_REQUEST;
         goto leave;
     }
+    sb.sb_size -= p1 + 1 - sb.sb_start;
     sb.sb_start = p1 + 1;
-    sb.sb_size -= sb.sb_start - sb.sb_buf;
 
     while ((p2 = memchr(sb.sb_start, '\r', sb.sb_size))) {
         if (*sb.sb_start == '\r') {
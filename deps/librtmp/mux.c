@@ -0,0 +1,356 @@
+/*
+ *  This file is part of librtmp.
+ *
+ *  librtmp is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation; either version 2.1,
+ *  or (at your option) any later version.
+ *
+ *  librtmp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with librtmp see the file COPYING.  If not, write to
+ *  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *  http://www.gnu.org/copyleft/lgpl.html
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "rtmp_sys.h"
+#include "log.h"
+#include "mux.h"
+
+/* video body bytes a turn sends, at least a chunk, before audio and
+ * commands waiting go out */
+#define RTMP_MUX_SLICE  4096
+/* unsent bytes the socket holds before a send blocks, what the kernel
+ * holds goes out in the order it was sent, whatever waits behind it */
+#define RTMP_MUX_LOWAT  (4 * RTMP_MUX_SLICE)
+
+/* MuxStream slots */
+#define MUX_SOURCE      0   /* audio, data and commands */
+#define MUX_VIDEO       1
+
+/* a chunk stream of a stream, one message at a time */
+typedef struct MuxSlot {
+    int channel;
+    RTMPPacket *packet;
+    /* waiting to go out or partly out, NULL when there is none */
+    int sent;
+    /* how the last packet went */
+} MuxSlot;
+
+struct RTMP_MuxStream {
+    RTMP_Mux *mux;
+    int id;
+    /* message stream id */
+    MuxSlot slots[2];
+    struct RTMP_MuxStream *next;
+};
+
+struct RTMP_Mux {
+    RTMP *r;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* a packet went out or the connection is free again */
+    int busy;
+    /* a thread is sending, adding or removing a stream */
+    int failed;
+    RTMP_MuxStream *streams;
+    RTMP_MuxStream *turn;
+    /* the stream looked at first for a packet */
+    pthread_t flusher;
+    int flushing;
+    /* the flusher was started, r holds writes back */
+    int stop;
+    /* RTMP_MuxFree is stopping the flusher */
+};
+
+static void *MuxFlusher(void *arg);
+
+RTMP_Mux *RTMP_MuxNew(RTMP *r) {
+    RTMP_Mux *m;
+
+    if (!RTMP_IsConnected(r) || !(r->Link.protocol & RTMP_FEATURE_WRITE))
+        return NULL;
+    if (!(m = calloc(1, sizeof(RTMP_Mux))))
+        return NULL;
+    m->r = r;
+#ifdef TCP_NOTSENT_LOWAT
+    {
+        int lowat = RTMP_MUX_LOWAT;
+        setsockopt(r->m_sb.sb_socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (char *) &lowat,
+                sizeof(lowat));
+    }
+#endif
+    pthread_mutex_init(&m->lock, NULL);
+    pthread_cond_init(&m->cond, NULL);
+
+    /* without coalescing or aggregating every write goes out at once */
+    m->flushing = r->m_sb.sb_coalesceMS > 0 || (r->m_aggregate && r->m_aggregateMS > 0);
+    if (m->flushing && pthread_create(&m->flusher, NULL, MuxFlusher, m)) {
+        pthread_cond_destroy(&m->cond);
+        pthread_mutex_destroy(&m->lock);
+        free(m);
+        return NULL;
+    }
+    return m;
+}
+
+void RTMP_MuxFree(RTMP_Mux *m) {
+    if (!m)
+        return;
+    pthread_mutex_lock(&m->lock);
+    m->stop = TRUE;
+    pthread_cond_broadcast(&m->cond);
+    pthread_mutex_unlock(&m->lock);
+    if (m->flushing)
+        pthread_join(m->flusher, NULL);
+    while (m->streams)
+        RTMP_MuxClose(m->streams);
+    pthread_cond_destroy(&m->cond);
+    pthread_mutex_destroy(&m->lock);
+    free(m);
+}
+
+/*
+ * @brief wait for the connection to be free and take it, with the lock held
+ */
+static void MuxAcquire(RTMP_Mux *m) {
+    while (m->busy)
+        pthread_cond_wait(&m->cond, &m->lock);
+    m->busy = TRUE;
+}
+
+static void MuxRelease(RTMP_Mux *m) {
+    m->busy = FALSE;
+    pthread_cond_broadcast(&m->cond);
+}
+
+/*
+ * @brief send what r holds back once it is due
+ *
+ * The senders may all be waiting for their next packet meanwhile, held
+ * writes would sit until one comes.
+ */
+static void *MuxFlusher(void *arg) {
+    RTMP_Mux *m = arg;
+    struct timespec ts;
+    int left, ok;
+
+    pthread_mutex_lock(&m->lock);
+    while (!m->stop) {
+        /* r is only looked at while no one sends on it */
+        if (m->busy || m->failed || (left = RTMP_FlushDeadline(m->r)) < 0) {
+            pthread_cond_wait(&m->cond, &m->lock);
+            continue;
+        }
+        if (left > 0) {
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += left / 1000;
+            ts.tv_nsec += (left % 1000) * 1000000L;
+            if (ts.tv_nsec >= 1000000000L) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&m->cond, &m->lock, &ts);
+            continue;
+        }
+        m->busy = TRUE;
+        pthread_mutex_unlock(&m->lock);
+        ok = RTMP_Flush(m->r) && RTMP_IsConnected(m->r);
+        pthread_mutex_lock(&m->lock);
+        if (!ok)
+            m->failed = TRUE;
+        MuxRelease(m);
+    }
+    pthread_mutex_unlock(&m->lock);
+    return NULL;
+}
+
+/*
+ * @brief add a stream to r, with the lock held and the connection taken
+ *
+ * The connection is given back while the server replies, the other
+ * streams send meanwhile.
+ * @return message stream id / -1 on failure
+ */
+static int MuxAddStream(RTMP_Mux *m, const AVal *playpath) {
+    struct pollfd pfd;
+    int txn, id;
+
+    pthread_mutex_unlock(&m->lock);
+    txn = RTMP_AddStreamStart(m->r, playpath);
+    pthread_mutex_lock(&m->lock);
+    if (txn < 0)
+        return -1;
+
+    while (TRUE) {
+        /* the rest of a reply already read is stepped through right away */
+        if (m->r->m_sb.sb_size <= 0) {
+            MuxRelease(m);
+            pthread_mutex_unlock(&m->lock);
+            pfd.fd = m->r->m_sb.sb_socket;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            poll(&pfd, 1, m->r->Link.timeout * 1000);
+            pthread_mutex_lock(&m->lock);
+            MuxAcquire(m);
+        }
+        /* after a failed send RTMP_Close drops the stream */
+        if (m->failed)
+            return -1;
+        pthread_mutex_unlock(&m->lock);
+        id = RTMP_AddStreamStep(m->r, txn);
+        pthread_mutex_lock(&m->lock);
+        if (id)
+            return id;
+    }
+}
+
+RTMP_MuxStream *RTMP_MuxOpen(RTMP_Mux *m, const AVal *playpath) {
+    RTMP_MuxStream *s, **tail;
+    int id = -1;
+
+    if (!(s = calloc(1, sizeof(RTMP_MuxStream))))
+        return NULL;
+
+    pthread_mutex_lock(&m->lock);
+    MuxAcquire(m);
+    if (!m->failed)
+        id = playpath ? MuxAddStream(m, playpath) : m->r->m_stream_id;
+    if (!RTMP_IsConnected(m->r))
+        m->failed = TRUE;
+
+    /* a stream is opened once, its chunk streams carry one message at a time */
+    for (tail = &m->streams; *tail; tail = &(*tail)->next) {
+        if ((*tail)->id == id)
+            id = -1;
+    }
+    if (id > 0 && !m->failed) {
+        s->mux = m;
+        s->id = id;
+        s->slots[MUX_SOURCE].channel = RTMP_StreamChannel(m->r, id, RTMP_PACKET_TYPE_AUDIO);
+        s->slots[MUX_VIDEO].channel = RTMP_StreamChannel(m->r, id, RTMP_PACKET_TYPE_VIDEO);
+        *tail = s;
+    }
+    else {
+        free(s);
+        s = NULL;
+    }
+    MuxRelease(m);
+    pthread_mutex_unlock(&m->lock);
+    return s;
+}
+
+void RTMP_MuxClose(RTMP_MuxStream *s) {
+    RTMP_Mux *m = s->mux;
+    RTMP_MuxStream **p;
+
+    pthread_mutex_lock(&m->lock);
+    MuxAcquire(m);
+    for (p = &m->streams; *p != s; p = &(*p)->next)
+        ;
+    *p = s->next;
+    if (m->turn == s)
+        m->turn = s->next;
+    if (!m->failed && s->id != m->r->m_stream_id) {
+        pthread_mutex_unlock(&m->lock);
+        RTMP_RemoveStream(m->r, s->id);
+        pthread_mutex_lock(&m->lock);
+    }
+    MuxRelease(m);
+    pthread_mutex_unlock(&m->lock);
+    free(s);
+}
+
+/*
+ * @brief the slot of the first stream from turn with a packet of kind
+ */
+static MuxSlot *MuxNext(RTMP_Mux *m, int kind) {
+    RTMP_MuxStream *s = m->turn ? m->turn : m->streams, *start = s;
+
+    do {
+        if (s->slots[kind].packet) {
+            if (kind == MUX_VIDEO)
+                m->turn = s->next;
+            return &s->slots[kind];
+        }
+        s = s->next ? s->next : m->streams;
+    } while (s != start);
+    return NULL;
+}
+
+/*
+ * @brief send the next packet waiting or a slice of it, with the lock held
+ *
+ * Audio and commands go out whole, ahead of video. Video goes out a slice
+ * at a time, so what else comes meanwhile waits for a chunk or so rather
+ * than for the rest of a keyframe, and the video of streams sending at
+ * once take turns.
+ */
+static void MuxTurn(RTMP_Mux *m) {
+    RTMP_MuxStream *o;
+    MuxSlot *slot;
+    int ret;
+
+    if (!(slot = MuxNext(m, MUX_SOURCE)) && !(slot = MuxNext(m, MUX_VIDEO)))
+        return;
+
+    pthread_mutex_unlock(&m->lock);
+    ret = RTMP_SendPacketPart(m->r, slot->packet,
+            slot->packet->m_packetType == RTMP_PACKET_TYPE_VIDEO ? RTMP_MUX_SLICE : INT_MAX);
+    pthread_mutex_lock(&m->lock);
+
+    if (ret < 0) {
+        RTMP_Log(RTMP_LOGERROR, "%s, sending on chunk stream %d failed", __FUNCTION__,
+                slot->channel);
+        m->failed = TRUE;
+        for (o = m->streams; o; o = o->next) {
+            o->slots[MUX_SOURCE].packet = o->slots[MUX_VIDEO].packet = NULL;
+            o->slots[MUX_SOURCE].sent = o->slots[MUX_VIDEO].sent = FALSE;
+        }
+        pthread_cond_broadcast(&m->cond);
+    }
+    else if (ret) {
+        slot->packet = NULL;
+        slot->sent = TRUE;
+        pthread_cond_broadcast(&m->cond);
+    }
+}
+
+int RTMP_MuxSend(RTMP_MuxStream *s, RTMPPacket *packet) {
+    RTMP_Mux *m = s->mux;
+    MuxSlot *slot = &s->slots[packet->m_packetType == RTMP_PACKET_TYPE_VIDEO
+            ? MUX_VIDEO : MUX_SOURCE];
+    int sent;
+
+    packet->m_nChannel = slot->channel;
+    packet->m_nInfoField2 = s->id;
+
+    pthread_mutex_lock(&m->lock);
+    slot->packet = m->failed ? NULL : packet;
+    slot->sent = FALSE;
+    while (slot->packet) {
+        if (m->busy) {
+            pthread_cond_wait(&m->cond, &m->lock);
+            continue;
+        }
+        /* the connection is free, send for everyone until ours is out */
+        m->busy = TRUE;
+        while (slot->packet)
+            MuxTurn(m);
+        MuxRelease(m);
+    }
+    sent = slot->sent;
+    pthread_mutex_unlock(&m->lock);
+    return sent;
+}
@@ -0,0 +1,83 @@
+#ifndef __RTMP_MUX_H__
+#define __RTMP_MUX_H__
+/*
+ *  This file is part of librtmp.
+ *
+ *  librtmp is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation; either version 2.1,
+ *  or (at your option) any later version.
+ *
+ *  librtmp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with librtmp see the file COPYING.  If not, write to
+ *  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *  http://www.gnu.org/copyleft/lgpl.html
+ */
+
+#include "rtmp.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Several streams published over one RTMP connection, sent from threads of
+ * their own. Audio and commands go out between the chunks of video, and
+ * the video of streams sending at once takes turns, so a large keyframe
+ * does not hold up the audio of its own stream or of the others.
+ */
+typedef struct RTMP_Mux RTMP_Mux;
+typedef struct RTMP_MuxStream RTMP_MuxStream;
+
+/*
+ * @brief share r, connected and publishing, between streams
+ *
+ * Until RTMP_MuxFree r is used through the mux only. When r coalesces or
+ * aggregates writes, a thread of the mux sends what r holds back once
+ * RTMP_FlushDeadline comes due. Set those options before.
+ */
+RTMP_Mux *RTMP_MuxNew(RTMP *r);
+
+/*
+ * @brief remove the streams left and free the mux, r stays connected
+ */
+void RTMP_MuxFree(RTMP_Mux *m);
+
+/*
+ * @brief a stream to publish on, NULL playpath for the one r was
+ * connected with
+ *
+ * Adding a stream waits for the server to start it, the other streams
+ * send meanwhile.
+ * @return NULL if the stream was refused or the connection failed
+ */
+RTMP_MuxStream *RTMP_MuxOpen(RTMP_Mux *m, const AVal *playpath);
+
+/*
+ * @brief unpublish a stream and free it, the one r was connected with is
+ * only unpublished by RTMP_Close
+ */
+void RTMP_MuxClose(RTMP_MuxStream *s);
+
+/*
+ * @brief send a packet on the stream, blocks until it is out
+ *
+ * m_nChannel and m_nInfoField2 are set for the stream. Send video from
+ * one thread per stream and audio and data from another, or from the same.
+ * Whichever thread finds the connection free sends for all packets
+ * waiting, in turns, until its own is out.
+ * @return TRUE / FALSE once the connection failed
+ */
+int RTMP_MuxSend(RTMP_MuxStream *s, RTMPPacket *packet);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
@@ -0,0 +1,865 @@
+/*
+ *  This file is part of librtmp.
+ *
+ *  librtmp is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation; either version 2.1,
+ *  or (at your option) any later version.
+ *
+ *  librtmp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with librtmp see the file COPYING.  If not, write to
+ *  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *  http://www.gnu.org/copyleft/lgpl.html
+ */
+
+#ifdef __linux__
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if defined(__NR_io_uring_setup) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define RTMP_URING
+#endif
+#endif
+
+#include "rtmp_sys.h"
+#include "log.h"
+#include "reactor.h"
+
+/* events taken from epoll per wait */
+#define RTMP_REACTOR_EVENTS     256
+/* how often connections still setting up are checked for their timeout */
+#define RTMP_REACTOR_SCAN_MS    1000
+
+/* io_uring submission queue entries, completions get twice as many */
+#define RTMP_URING_ENTRIES      4096
+/* most connections served from registered receive buffers */
+#define RTMP_URING_SLOTS_MAX    1024
+/* receive size, a chunk must fit sb_buf anyway */
+#define RTMP_URING_RECV_SIZE    RTMP_BUFFER_CACHE_SIZE
+
+/* operation kept in the low bits of an io_uring user_data */
+#define RTMP_URING_OP_TIMEOUT   0
+#define RTMP_URING_OP_POLL      1
+#define RTMP_URING_OP_RECV      2
+#define RTMP_URING_OP_SEND      3
+#define RTMP_URING_OP_CANCEL    4
+#define RTMP_URING_OP_MASK      7
+
+struct RTMP_ReactorConn {
+    RTMP *r;
+    /* NULL once removed, freed at the end of the current run */
+    RTMP_ReactorCallback *cb;
+    void *arg;
+    int fd;
+    int events;
+    /* epoll events registered, io_uring: the poll for connect is in flight */
+    int state;
+    /* last RTMP_NB_* seen */
+    int holding;
+    /* r holds writes back until RTMP_FlushDeadline, counted in the reactor */
+    struct RTMP_ReactorConn *prev, *next;
+
+    /* io_uring backend */
+    int inflight;
+    /* operations submitted and not completed, the conn outlives them */
+    int slot;
+    /* registered receive buffer, -1 for recvBuf */
+    char *recvBuf;
+    int recvSize;
+    /* recvBuf follows the size of sb_buf */
+    int recvLen;
+    /* bytes asked for by the receive in flight */
+    char *sendBuf;
+    /* sb_out taken over while the kernel sends from it */
+    int sendSize;
+    int sendOff;
+    int sendLen;
+    int dirty;
+    struct RTMP_ReactorConn *nextDirty;
+};
+
+struct RTMP_Reactor {
+    int backend;
+    int epfd;
+    RTMP_ReactorConn *conns;
+    RTMP_ReactorConn *removed;
+    /* removed during a run, an event or operation may still be pending */
+    uint32_t lastScan;
+    int holding;
+    /* connections holding writes back, looked at for deadlines while any are */
+
+#ifdef RTMP_URING
+    int ringfd;
+    void *sqRing, *cqRing;
+    size_t sqRingSize, cqRingSize;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray, sqEntries;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned toSubmit;
+    int timeoutArmed;
+    struct __kernel_timespec timeout;
+    char *arena;
+    /* registered receive buffers, one slot per connection */
+    int *freeSlots;
+    int nFree;
+    RTMP_ReactorConn *dirty;
+    /* connections with queued sends to submit */
+#endif
+};
+
+static RTMP_Reactor *ReactorAlloc(void) {
+    RTMP_Reactor *re = calloc(1, sizeof(RTMP_Reactor));
+
+    if (!re)
+        return NULL;
+    re->backend = RTMP_REACTOR_EPOLL;
+    re->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (re->epfd < 0) {
+        RTMP_Log(RTMP_LOGERROR, "%s, epoll_create1 failed: %d (%s)", __FUNCTION__,
+                errno, strerror(errno));
+        free(re);
+        return NULL;
+    }
+    re->lastScan = RTMP_GetTime();
+    return re;
+}
+
+RTMP_Reactor *RTMP_ReactorNew(void) {
+    return ReactorAlloc();
+}
+
+int RTMP_ReactorBackend(RTMP_Reactor *re) {
+    return re->backend;
+}
+
+static void ReactorClose(RTMP_Reactor *re, RTMP_ReactorConn *c);
+
+static void ReactorStep(RTMP_Reactor *re, RTMP_ReactorConn *c, int events);
+
+#ifdef RTMP_URING
+/*
+ * @brief set up the rings and register the receive buffers, without
+ * registration receives go to a buffer of each connection
+ */
+static int UringInit(RTMP_Reactor *re, int slots) {
+    struct io_uring_params p;
+    struct iovec *iov;
+    int i;
+
+    memset(&p, 0, sizeof(p));
+    re->ringfd = syscall(__NR_io_uring_setup, RTMP_URING_ENTRIES, &p);
+    if (re->ringfd < 0) {
+        RTMP_Log(RTMP_LOGWARNING, "%s, io_uring unavailable: %d (%s), using epoll",
+                __FUNCTION__, errno, strerror(errno));
+        return FALSE;
+    }
+
+    re->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    re->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (re->cqRingSize > re->sqRingSize)
+            re->sqRingSize = re->cqRingSize;
+        re->cqRingSize = re->sqRingSize;
+    }
+    re->sqRing = mmap(NULL, re->sqRingSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, re->ringfd, IORING_OFF_SQ_RING);
+    if (re->sqRing == MAP_FAILED)
+        goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        re->cqRing = re->sqRing;
+    } else {
+        re->cqRing = mmap(NULL, re->cqRingSize, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, re->ringfd, IORING_OFF_CQ_RING);
+        if (re->cqRing == MAP_FAILED)
+            goto fail;
+    }
+    re->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, re->ringfd, IORING_OFF_SQES);
+    if (re->sqes == MAP_FAILED)
+        goto fail;
+
+    re->sqHead = (unsigned *) ((char *) re->sqRing + p.sq_off.head);
+    re->sqTail = (unsigned *) ((char *) re->sqRing + p.sq_off.tail);
+    re->sqMask = (unsigned *) ((char *) re->sqRing + p.sq_off.ring_mask);
+    re->sqArray = (unsigned *) ((char *) re->sqRing + p.sq_off.array);
+    re->sqEntries = p.sq_entries;
+    re->cqHead = (unsigned *) ((char *) re->cqRing + p.cq_off.head);
+    re->cqTail = (unsigned *) ((char *) re->cqRing + p.cq_off.tail);
+    re->cqMask = (unsigned *) ((char *) re->cqRing + p.cq_off.ring_mask);
+    re->cqes = (struct io_uring_cqe *) ((char *) re->cqRing + p.cq_off.cqes);
+
+    if (slots > RTMP_URING_SLOTS_MAX)
+        slots = RTMP_URING_SLOTS_MAX;
+    if (slots > 0) {
+        iov = calloc(slots, sizeof(struct iovec));
+        re->freeSlots = calloc(slots, sizeof(int));
+        if (iov && re->freeSlots
+                && !posix_memalign((void **) &re->arena, 4096, (size_t) slots * RTMP_URING_RECV_SIZE)) {
+            for (i = 0; i < slots; i++) {
+                iov[i].iov_base = re->arena + (size_t) i * RTMP_URING_RECV_SIZE;
+                iov[i].iov_len = RTMP_URING_RECV_SIZE;
+                re->freeSlots[i] = slots - 1 - i;
+            }
+            if (syscall(__NR_io_uring_register, re->ringfd, IORING_REGISTER_BUFFERS, iov, slots) == 0) {
+                re->nFree = slots;
+            } else {
+                RTMP_Log(RTMP_LOGWARNING, "%s, registering buffers failed: %d (%s)",
+                        __FUNCTION__, errno, strerror(errno));
+            }
+        }
+        free(iov);
+        if (!re->nFree) {
+            free(re->arena);
+            re->arena = NULL;
+        }
+    }
+    return TRUE;
+
+fail:
+    RTMP_Log(RTMP_LOGWARNING, "%s, mapping the io_uring rings failed: %d (%s), using epoll",
+            __FUNCTION__, errno, strerror(errno));
+    if (re->sqes && re->sqes != MAP_FAILED)
+        munmap(re->sqes, re->sqEntries * sizeof(struct io_uring_sqe));
+    if (re->cqRing && re->cqRing != MAP_FAILED && re->cqRing != re->sqRing)
+        munmap(re->cqRing, re->cqRingSize);
+    if (re->sqRing && re->sqRing != MAP_FAILED)
+        munmap(re->sqRing, re->sqRingSize);
+    close(re->ringfd);
+    return FALSE;
+}
+
+static void UringFree(RTMP_Reactor *re) {
+    munmap(re->sqes, re->sqEntries * sizeof(struct io_uring_sqe));
+    if (re->cqRing != re->sqRing)
+        munmap(re->cqRing, re->cqRingSize);
+    munmap(re->sqRing, re->sqRingSize);
+    close(re->ringfd);
+    free(re->arena);
+    free(re->freeSlots);
+}
+
+/*
+ * @brief submit what is queued, waiting for minComplete completions
+ */
+static int UringEnter(RTMP_Reactor *re, unsigned minComplete) {
+    int rc = syscall(__NR_io_uring_enter, re->ringfd, re->toSubmit, minComplete,
+            minComplete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+    if (rc < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+            return 0;
+        RTMP_Log(RTMP_LOGERROR, "%s, io_uring_enter failed: %d (%s)", __FUNCTION__,
+                errno, strerror(errno));
+        return -1;
+    }
+    re->toSubmit -= rc;
+    return rc;
+}
+
+/*
+ * @brief next free submission entry, filled in by the caller before the
+ * next UringEnter
+ */
+static struct io_uring_sqe *UringSqe(RTMP_Reactor *re, RTMP_ReactorConn *c, int op) {
+    unsigned tail = *re->sqTail, index;
+    struct io_uring_sqe *sqe;
+
+    if (tail - __atomic_load_n(re->sqHead, __ATOMIC_ACQUIRE) >= re->sqEntries) {
+        UringEnter(re, 0);
+        if (tail - __atomic_load_n(re->sqHead, __ATOMIC_ACQUIRE) >= re->sqEntries)
+            return NULL;
+    }
+    index = tail & *re->sqMask;
+    sqe = &re->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uint64_t) (uintptr_t) c | op;
+    re->sqArray[index] = index;
+    __atomic_store_n(re->sqTail, tail + 1, __ATOMIC_RELEASE);
+    re->toSubmit++;
+    if (c)
+        c->inflight++;
+    return sqe;
+}
+
+static void UringDirty(RTMP_Reactor *re, RTMP_ReactorConn *c) {
+    if (!c->dirty) {
+        c->dirty = TRUE;
+        c->nextDirty = re->dirty;
+        re->dirty = c;
+    }
+}
+
+/*
+ * @brief keep a receive in flight and queue what the connection has to send
+ */
+static int UringArm(RTMP_Reactor *re, RTMP_ReactorConn *c) {
+    RTMPSockBuf *sb = &c->r->m_sb;
+    struct io_uring_sqe *sqe;
+
+    if (c->state == RTMP_NB_TCP) {
+        if (!c->events) {
+            if (!(sqe = UringSqe(re, c, RTMP_URING_OP_POLL)))
+                return FALSE;
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = c->fd;
+            sqe->poll_events = POLLOUT;
+            c->events = TRUE;
+        }
+        return TRUE;
+    }
+
+    if (!c->recvLen) {
+        int room;
+
+        if (sb->sb_buf && sb->sb_start != sb->sb_buf + RTMP_MAX_HEADER_SIZE) {
+            if (sb->sb_size)
+                memmove(sb->sb_buf + RTMP_MAX_HEADER_SIZE, sb->sb_start, sb->sb_size);
+            sb->sb_start = sb->sb_buf + RTMP_MAX_HEADER_SIZE;
+        }
+        if ((room = RTMPSockBuf_Reserve(sb, 1)) <= 0) {
+            RTMP_Log(RTMP_LOGERROR, "%s, chunk does not fit the receive buffer", __FUNCTION__);
+            return FALSE;
+        }
+        if (room > RTMP_URING_RECV_SIZE)
+            room = RTMP_URING_RECV_SIZE;
+        if (c->slot < 0 && c->recvSize < sb->sb_bufSize) {
+            char *buf = realloc(c->recvBuf, sb->sb_bufSize);
+
+            if (!buf)
+                return FALSE;
+            c->recvBuf = buf;
+            c->recvSize = sb->sb_bufSize;
+        }
+
+        if (!(sqe = UringSqe(re, c, RTMP_URING_OP_RECV)))
+            return FALSE;
+        sqe->fd = c->fd;
+        sqe->len = room;
+        if (c->slot >= 0) {
+            sqe->opcode = IORING_OP_READ_FIXED;
+            sqe->addr = (uint64_t) (uintptr_t) (re->arena + (size_t) c->slot * RTMP_URING_RECV_SIZE);
+            sqe->buf_index = c->slot;
+        } else {
+            sqe->opcode = IORING_OP_RECV;
+            sqe->addr = (uint64_t) (uintptr_t) c->recvBuf;
+        }
+        c->recvLen = room;
+    }
+
+    if (sb->sb_outLen)
+        UringDirty(re, c);
+    return TRUE;
+}
+
+/*
+ * @brief hand the queued bytes of every dirty connection to the kernel,
+ * the send buffer is taken over so RTMP_SendPacket can queue more meanwhile
+ */
+static void UringFlush(RTMP_Reactor *re) {
+    while (re->dirty) {
+        RTMP_ReactorConn *c = re->dirty;
+        RTMPSockBuf *sb;
+        struct io_uring_sqe *sqe;
+
+        re->dirty = c->nextDirty;
+        c->dirty = FALSE;
+        if (!c->r || c->sendLen || !c->r->m_sb.sb_outLen)
+            continue;
+
+        sb = &c->r->m_sb;
+        if (!(sqe = UringSqe(re, c, RTMP_URING_OP_SEND))) {
+            UringDirty(re, c);
+            return;
+        }
+        c->sendBuf = sb->sb_out;
+        c->sendSize = sb->sb_outSize;
+        c->sendOff = sb->sb_outOff;
+        c->sendLen = sb->sb_outLen;
+        sb->sb_out = NULL;
+        sb->sb_outSize = 0;
+        sb->sb_outOff = 0;
+        sb->sb_outLen = 0;
+
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = c->fd;
+        sqe->addr = (uint64_t) (uintptr_t) (c->sendBuf + c->sendOff);
+        sqe->len = c->sendLen;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sb->sb_sends++;
+    }
+}
+
+/*
+ * @brief give the drained send buffer back for reuse
+ */
+static void UringSendDone(RTMP_ReactorConn *c) {
+    RTMPSockBuf *sb = c->r ? &c->r->m_sb : NULL;
+
+    if (sb && !sb->sb_out) {
+        sb->sb_out = c->sendBuf;
+        sb->sb_outSize = c->sendSize;
+    } else {
+        free(c->sendBuf);
+    }
+    c->sendBuf = NULL;
+    c->sendLen = 0;
+}
+
+static void UringComplete(RTMP_Reactor *re, uint64_t data, int res) {
+    RTMP_ReactorConn *c = (RTMP_ReactorConn *) (uintptr_t) (data & ~(uint64_t) RTMP_URING_OP_MASK);
+    int op = data & RTMP_URING_OP_MASK;
+    RTMPSockBuf *sb;
+    int asked;
+
+    if (op == RTMP_URING_OP_TIMEOUT) {
+        re->timeoutArmed = FALSE;
+        return;
+    }
+    c->inflight--;
+    if (op == RTMP_URING_OP_CANCEL)
+        return;
+
+    if (op == RTMP_URING_OP_SEND) {
+        if (res == -EAGAIN || res == -EINTR)
+            res = 0;
+        if (res < 0) {
+            UringSendDone(c);
+            if (c->r) {
+                RTMP_Log(RTMP_LOGERROR, "%s, RTMP send error %d", __FUNCTION__, -res);
+                ReactorClose(re, c);
+            }
+            return;
+        }
+        if (c->r)
+            c->r->m_sb.sb_bytesSent += res;
+        c->sendOff += res;
+        c->sendLen -= res;
+        if (c->sendLen > 0 && c->r) {
+            struct io_uring_sqe *sqe = UringSqe(re, c, RTMP_URING_OP_SEND);
+
+            if (sqe) {
+                sqe->opcode = IORING_OP_SEND;
+                sqe->fd = c->fd;
+                sqe->addr = (uint64_t) (uintptr_t) (c->sendBuf + c->sendOff);
+                sqe->len = c->sendLen;
+                sqe->msg_flags = MSG_NOSIGNAL;
+                return;
+            }
+            ReactorClose(re, c);
+        }
+        UringSendDone(c);
+        if (!c->r)
+            return;
+        if (c->r->m_sb.sb_outLen)
+            UringDirty(re, c);
+        else if (c->state == RTMP_NB_READY)
+            c->cb(c, c->r, RTMP_REACTOR_WRITABLE, c->arg);
+        return;
+    }
+
+    if (!c->r)
+        return;
+
+    if (op == RTMP_URING_OP_POLL) {
+        c->events = FALSE;
+        ReactorStep(re, c, RTMP_IO_WRITE);
+        return;
+    }
+
+    /* RTMP_URING_OP_RECV */
+    asked = c->recvLen;
+    c->recvLen = 0;
+    if (res == -EAGAIN || res == -EINTR) {
+        if (!UringArm(re, c))
+            ReactorClose(re, c);
+        return;
+    }
+    if (res <= 0) {
+        RTMP_Log(RTMP_LOGDEBUG, "%s, recv returned %d", __FUNCTION__, res);
+        ReactorClose(re, c);
+        return;
+    }
+    sb = &c->r->m_sb;
+    memcpy(sb->sb_start + sb->sb_size,
+            c->slot >= 0 ? re->arena + (size_t) c->slot * RTMP_URING_RECV_SIZE : c->recvBuf, res);
+    sb->sb_size += res;
+    RTMPSockBuf_Filled(sb, asked, res);
+    ReactorStep(re, c, RTMP_IO_FILLED);
+}
+
+static int UringRun(RTMP_Reactor *re, int timeoutMS) {
+    unsigned head, n = 0;
+
+    UringFlush(re);
+    if (timeoutMS > 0 && !re->timeoutArmed) {
+        struct io_uring_sqe *sqe = UringSqe(re, NULL, RTMP_URING_OP_TIMEOUT);
+
+        if (sqe) {
+            re->timeout.tv_sec = timeoutMS / 1000;
+            re->timeout.tv_nsec = (timeoutMS % 1000) * 1000000LL;
+            sqe->opcode = IORING_OP_TIMEOUT;
+            sqe->addr = (uint64_t) (uintptr_t) &re->timeout;
+            sqe->len = 1;
+            sqe->off = 1;
+            re->timeoutArmed = TRUE;
+        }
+    }
+    if (UringEnter(re, timeoutMS ? 1 : 0) < 0)
+        return -1;
+
+    head = *re->cqHead;
+    while (head != __atomic_load_n(re->cqTail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &re->cqes[head & *re->cqMask];
+        uint64_t data = cqe->user_data;
+        int res = cqe->res;
+
+        __atomic_store_n(re->cqHead, ++head, __ATOMIC_RELEASE);
+        UringComplete(re, data, res);
+        if (data & RTMP_URING_OP_MASK)
+            n++;
+    }
+    return n;
+}
+#endif
+
+RTMP_Reactor *RTMP_ReactorNewUring(int registered) {
+    RTMP_Reactor *re = ReactorAlloc();
+
+#ifdef RTMP_URING
+    if (re && UringInit(re, registered))
+        re->backend = RTMP_REACTOR_URING;
+#else
+    RTMP_Log(RTMP_LOGWARNING, "%s, built without io_uring, using epoll", __FUNCTION__);
+#endif
+    return re;
+}
+
+static void ReactorFreeRemoved(RTMP_Reactor *re) {
+    RTMP_ReactorConn **link = &re->removed;
+
+    while (*link) {
+        RTMP_ReactorConn *c = *link;
+        if (c->inflight) {
+            link = &c->next;
+            continue;
+        }
+        *link = c->next;
+#ifdef RTMP_URING
+        if (c->slot >= 0)
+            re->freeSlots[re->nFree++] = c->slot;
+#endif
+        free(c->recvBuf);
+        free(c->sendBuf);
+        free(c);
+    }
+}
+
+/*
+ * @brief count c in or out of the connections holding writes back
+ */
+static void ReactorHold(RTMP_Reactor *re, RTMP_ReactorConn *c) {
+    int holding = c->r && RTMP_FlushDeadline(c->r) >= 0;
+
+    re->holding += holding - c->holding;
+    c->holding = holding;
+}
+
+/*
+ * @brief register the readiness the connection waits for
+ */
+static int ReactorArm(RTMP_Reactor *re, RTMP_ReactorConn *c) {
+    struct epoll_event ev;
+    int wants;
+
+#ifdef RTMP_URING
+    if (re->backend == RTMP_REACTOR_URING)
+        return UringArm(re, c);
+#endif
+
+    wants = RTMP_WantsNB(c->r);
+    ev.events = ((wants & RTMP_IO_READ) ? EPOLLIN : 0) | ((wants & RTMP_IO_WRITE) ? EPOLLOUT : 0);
+    if (ev.events == (uint32_t) c->events)
+        return TRUE;
+    ev.data.ptr = c;
+    if (epoll_ctl(re->epfd, c->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+        RTMP_Log(RTMP_LOGERROR, "%s, epoll_ctl failed: %d (%s)", __FUNCTION__,
+                errno, strerror(errno));
+        return FALSE;
+    }
+    c->events = ev.events;
+    return TRUE;
+}
+
+void RTMP_ReactorRemove(RTMP_Reactor *re, RTMP_ReactorConn *c) {
+    if (!c->r)
+        return;
+#ifdef RTMP_URING
+    if (re->backend == RTMP_REACTOR_URING) {
+        struct io_uring_sqe *sqe;
+
+        if ((c->recvLen || c->events) && (sqe = UringSqe(re, c, RTMP_URING_OP_CANCEL))) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = (uint64_t) (uintptr_t) c
+                    | (c->recvLen ? RTMP_URING_OP_RECV : RTMP_URING_OP_POLL);
+        }
+        c->r->m_sb.sb_nonblock = RTMP_SB_NONBLOCK;
+    } else
+#endif
+    /* a socket closed underneath has left the epoll set already */
+    if (c->events && RTMP_Socket(c->r) == c->fd)
+        epoll_ctl(re->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        re->conns = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+
+    c->r = NULL;
+    ReactorHold(re, c);
+    c->prev = NULL;
+    c->next = re->removed;
+    re->removed = c;
+}
+
+/*
+ * @brief close a failed connection and tell its owner
+ */
+static void ReactorClose(RTMP_Reactor *re, RTMP_ReactorConn *c) {
+    RTMP *r = c->r;
+
+    /* operations in flight hold the socket, make them finish */
+    if (c->inflight && RTMP_IsConnected(r))
+        shutdown(c->fd, SHUT_RDWR);
+    RTMP_Close(r);
+    RTMP_ReactorRemove(re, c);
+    c->cb(c, r, RTMP_REACTOR_CLOSED, c->arg);
+}
+
+RTMP_ReactorConn *RTMP_ReactorAdd(RTMP_Reactor *re, RTMP *r,
+        RTMP_ReactorCallback *cb, void *arg) {
+    RTMP_ReactorConn *c = calloc(1, sizeof(RTMP_ReactorConn));
+
+    if (!c)
+        return NULL;
+    c->slot = -1;
+#ifdef RTMP_URING
+    if (re->backend == RTMP_REACTOR_URING) {
+        if (re->nFree)
+            c->slot = re->freeSlots[--re->nFree];
+    }
+#endif
+    if (!RTMP_ConnectNB(r))
+        goto fail;
+    if (re->backend == RTMP_REACTOR_URING)
+        r->m_sb.sb_nonblock = RTMP_SB_DEFERRED;
+    c->r = r;
+    c->cb = cb;
+    c->arg = arg;
+    c->fd = RTMP_Socket(r);
+    c->state = r->m_nbState;
+
+    c->next = re->conns;
+    if (re->conns)
+        re->conns->prev = c;
+    re->conns = c;
+
+    if (!ReactorArm(re, c)) {
+        RTMP_ReactorRemove(re, c);
+        RTMP_Close(r);
+        return NULL;
+    }
+    return c;
+
+fail:
+#ifdef RTMP_URING
+    if (c->slot >= 0)
+        re->freeSlots[re->nFree++] = c->slot;
+#endif
+    free(c->recvBuf);
+    free(c);
+    return NULL;
+}
+
+/*
+ * @brief advance a connection and report what changed
+ */
+static void ReactorStep(RTMP_Reactor *re, RTMP_ReactorConn *c, int events) {
+    int pending = c->r->m_sb.sb_outLen;
+    int state = RTMP_ProcessNB(c->r, events);
+
+    if (state == RTMP_NB_FAILED || !RTMP_IsConnected(c->r)) {
+        ReactorClose(re, c);
+        return;
+    }
+    if (state == RTMP_NB_READY && c->state != RTMP_NB_READY) {
+        c->state = state;
+        c->cb(c, c->r, RTMP_REACTOR_READY, c->arg);
+    } else if (state == RTMP_NB_READY && pending && !c->r->m_sb.sb_outLen) {
+        c->cb(c, c->r, RTMP_REACTOR_WRITABLE, c->arg);
+    }
+    c->state = state;
+
+    /* the callback may have removed or closed it */
+    if (c->r && !ReactorArm(re, c))
+        ReactorClose(re, c);
+}
+
+int RTMP_ReactorSendPacket(RTMP_Reactor *re, RTMP_ReactorConn *c, RTMPPacket *packet) {
+    int ok;
+
+    if (!c->r || c->state != RTMP_NB_READY)
+        return FALSE;
+    ok = RTMP_SendPacket(c->r, packet, FALSE) && RTMP_IsConnected(c->r);
+    ReactorHold(re, c);
+    if (!ok) {
+        c->state = RTMP_NB_FAILED;
+        return FALSE;
+    }
+    return ReactorArm(re, c);
+}
+
+/*
+ * @brief timeoutMS cut to the nearest deadline of held writes
+ */
+static int ReactorDeadline(RTMP_Reactor *re, int timeoutMS) {
+    RTMP_ReactorConn *c;
+    int left;
+
+    if (!re->holding)
+        return timeoutMS;
+    for (c = re->conns; c; c = c->next) {
+        if (c->holding && (left = RTMP_FlushDeadline(c->r)) >= 0
+                && (timeoutMS < 0 || left < timeoutMS))
+            timeoutMS = left;
+    }
+    return timeoutMS;
+}
+
+/*
+ * @brief send held writes that are due, nothing else would
+ */
+static void ReactorFlushDue(RTMP_Reactor *re) {
+    RTMP_ReactorConn *c, *next;
+
+    if (!re->holding)
+        return;
+    for (c = re->conns; c; c = next) {
+        next = c->next;
+        if (!c->holding || RTMP_FlushDeadline(c->r) != 0)
+            continue;
+        if (!RTMP_Flush(c->r) || !RTMP_IsConnected(c->r)) {
+            c->state = RTMP_NB_FAILED;
+            ReactorHold(re, c);
+            continue;
+        }
+        ReactorHold(re, c);
+        if (!ReactorArm(re, c))
+            c->state = RTMP_NB_FAILED;
+    }
+}
+
+int RTMP_ReactorPending(RTMP_ReactorConn *c) {
+    return c->r ? c->r->m_sb.sb_outLen + c->sendLen : 0;
+}
+
+int RTMP_ReactorRun(RTMP_Reactor *re, int timeoutMS) {
+    struct epoll_event ev[RTMP_REACTOR_EVENTS];
+    RTMP_ReactorConn *c, *next;
+    uint32_t now;
+    int i, n;
+
+    timeoutMS = ReactorDeadline(re, timeoutMS);
+
+#ifdef RTMP_URING
+    if (re->backend == RTMP_REACTOR_URING) {
+        n = UringRun(re, timeoutMS);
+        if (n < 0)
+            return -1;
+    } else
+#endif
+    {
+        n = epoll_wait(re->epfd, ev, RTMP_REACTOR_EVENTS, timeoutMS);
+        if (n < 0) {
+            if (errno != EINTR) {
+                RTMP_Log(RTMP_LOGERROR, "%s, epoll_wait failed: %d (%s)", __FUNCTION__,
+                        errno, strerror(errno));
+                return -1;
+            }
+            n = 0;
+        }
+
+        for (i = 0; i < n; i++) {
+            int events = 0;
+
+            c = ev[i].data.ptr;
+            if (!c->r)
+                continue;
+            if (ev[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                events |= RTMP_IO_READ;
+            if (ev[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+                events |= RTMP_IO_WRITE;
+            ReactorStep(re, c, events);
+        }
+    }
+
+    ReactorFlushDue(re);
+
+    /* time out connections stuck setting up, and those a send failed on */
+    now = RTMP_GetTime();
+    if (now - re->lastScan >= RTMP_REACTOR_SCAN_MS) {
+        re->lastScan = now;
+        for (c = re->conns; c; c = next) {
+            next = c->next;
+            if (c->r && c->state != RTMP_NB_READY)
+                ReactorStep(re, c, 0);
+        }
+    }
+
+    ReactorFreeRemoved(re);
+    return n;
+}
+
+void RTMP_ReactorFree(RTMP_Reactor *re) {
+    RTMP_ReactorConn *c;
+
+    if (!re)
+        return;
+    while (re->conns)
+        ReactorClose(re, re->conns);
+#ifdef RTMP_URING
+    if (re->backend == RTMP_REACTOR_URING) {
+        uint32_t start = RTMP_GetTime();
+
+        /* the kernel may still write to the receive buffers */
+        while (re->removed && RTMP_GetTime() - start < RTMP_REACTOR_SCAN_MS) {
+            ReactorFreeRemoved(re);
+            if (re->removed && UringRun(re, 10) < 0)
+                break;
+        }
+        UringFree(re);
+        for (c = re->removed; c; c = c->next)
+            c->inflight = 0;
+    }
+#endif
+    ReactorFreeRemoved(re);
+    close(re->epfd);
+    free(re);
+}
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef __RTMP_REACTOR_H__
+#define __RTMP_REACTOR_H__
+/*
+ *  This file is part of librtmp.
+ *
+ *  librtmp is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation; either version 2.1,
+ *  or (at your option) any later version.
+ *
+ *  librtmp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with librtmp see the file COPYING.  If not, write to
+ *  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *  http://www.gnu.org/copyleft/lgpl.html
+ */
+
+#include "rtmp.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * An epoll reactor driving many RTMP_ConnectNB connections from one thread.
+ * A reactor and its connections belong to the thread calling
+ * RTMP_ReactorRun, run one reactor per thread to spread the load.
+ */
+typedef struct RTMP_Reactor RTMP_Reactor;
+typedef struct RTMP_ReactorConn RTMP_ReactorConn;
+
+/* callback events */
+#define RTMP_REACTOR_READY      1   /* the stream can be published to */
+#define RTMP_REACTOR_WRITABLE   2   /* queued sends have drained */
+#define RTMP_REACTOR_CLOSED     3   /* failed or closed, the connection is gone */
+
+typedef void RTMP_ReactorCallback(RTMP_ReactorConn *c, RTMP *r, int event, void *arg);
+
+/* backends */
+#define RTMP_REACTOR_EPOLL      1
+#define RTMP_REACTOR_URING      2
+
+RTMP_Reactor *RTMP_ReactorNew(void);
+
+/*
+ * @brief a reactor submitting sends and receives of all its connections
+ * through one io_uring, falls back to epoll where io_uring is unavailable
+ *
+ * Sends are handed to the kernel on the next RTMP_ReactorRun, batched
+ * with those of the other connections.
+ *
+ * @param[in] registered: connections receiving into registered buffers,
+ *            the rest receive into a buffer of their own
+ */
+RTMP_Reactor *RTMP_ReactorNewUring(int registered);
+
+int RTMP_ReactorBackend(RTMP_Reactor *re);
+
+/*
+ * @brief close every connection left and free the reactor
+ */
+void RTMP_ReactorFree(RTMP_Reactor *re);
+
+/*
+ * @brief start connecting r, set up with RTMP_SetupURL and RTMP_EnableWrite
+ * @return NULL if the connection could not be started
+ */
+RTMP_ReactorConn *RTMP_ReactorAdd(RTMP_Reactor *re, RTMP *r,
+        RTMP_ReactorCallback *cb, void *arg);
+
+/*
+ * @brief stop driving a connection without closing it, no callback follows
+ *
+ * With io_uring a receive in flight is cancelled and what it got is lost,
+ * so remove a connection only to close it.
+ */
+void RTMP_ReactorRemove(RTMP_Reactor *re, RTMP_ReactorConn *c);
+
+/*
+ * @brief send a packet on a ready connection, never blocks
+ *
+ * What the socket does not take is queued, watch RTMP_ReactorPending to
+ * apply back pressure.
+ */
+int RTMP_ReactorSendPacket(RTMP_Reactor *re, RTMP_ReactorConn *c, RTMPPacket *packet);
+
+/*
+ * @brief bytes queued on a connection but not yet taken by the socket
+ */
+int RTMP_ReactorPending(RTMP_ReactorConn *c);
+
+/*
+ * @brief wait up to timeoutMS for socket events and handle them
+ * @return number of events handled / -1 on error
+ */
+int RTMP_ReactorRun(RTMP_Reactor *re, int timeoutMS);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
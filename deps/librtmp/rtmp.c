@@ -32,6 +32,20 @@
 #include "rtmp_sys.h"
 #include "log.h"
 
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <linux/errqueue.h>
+#include <sys/sendfile.h>
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define RTMP_ZEROCOPY
+#endif
+#endif
+
 #ifdef CRYPTO
 #ifdef USE_POLARSSL
 #include <polarssl/havege.h>
@@ -116,8 +130,20 @@ static int HandShake(RTMP *r, int FP9HandShake);
 
 static int SocksNegotiate(RTMP *r);
 
+static int NetConnect(RTMP *r, RTMPPacket *cp);
+
+static void SendStreamSetup(RTMP *r);
+
+static int SockBufDrain(RTMPSockBuf *sb);
+
 static int SendConnectPacket(RTMP *r, RTMPPacket *cp);
 
+static int SendReleaseStream(RTMP *r, const AVal *playpath);
+
+static int SendFCPublish(RTMP *r, const AVal *playpath);
+
+static int SendFCUnpublish(RTMP *r, const AVal *playpath);
+
 static int SendCheckBW(RTMP *r);
 
 static int SendCheckBWResult(RTMP *r, double txn);
@@ -136,7 +162,7 @@ static int SendUsherToken(RTMP *r, AVal *usherToken);
 static int SendBGHasStream(RTMP *r, double dId, AVal *playpath);
 #endif
 
-static int HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize);
+static int HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize, int streamId);
 
 static int HandleMetadata(RTMP *r, char *body, unsigned int len);
 
@@ -154,8 +180,14 @@ static void HandleClientBW(RTMP *r, const RTMPPacket *packet);
 
 static int ReadN(RTMP *r, char *buffer, int n);
 
+static int ChunkSize(RTMP *r, const uint8_t *p, int avail, int *hSize);
+
 static int WriteN(RTMP *r, const char *buffer, int n);
 
+#ifndef _WIN32
+static int WriteV(RTMP *r, struct iovec *iov, int iovcnt);
+#endif
+
 static void DecodeTEA(AVal *key, AVal *text);
 
 static int HTTP_Post(RTMP *r, RTMPTCmd cmd, const char *buf, int len);
@@ -208,22 +240,287 @@ RTMPPacket_Reset(RTMPPacket *p) {
     p->m_nBytesRead = 0;
 }
 
+/* a slab body, the header ahead of the body room */
+typedef struct RTMP_SlabBuf {
+    struct RTMP_SlabBuf *next;
+    uint32_t size;
+} RTMP_SlabBuf;
+
+#define SlabBufOf(body)   ((RTMP_SlabBuf *) ((body) - RTMP_MAX_HEADER_SIZE) - 1)
+
+/* free bodies a connection keeps per size class before bursts grow it, and
+ * by default bytes in all */
+#define RTMP_SLAB_KEEP      4
+#define RTMP_SLAB_CACHE     (2 * 1024 * 1024)
+
+/* channel packets carved from one slab block */
+#define RTMP_CHANNEL_SLAB   8
+
+typedef struct RTMP_ChannelSlab {
+    struct RTMP_ChannelSlab *next;
+    int used;
+    RTMPPacket packets[RTMP_CHANNEL_SLAB];
+} RTMP_ChannelSlab;
+
+/* a chunk stream in use */
+typedef struct RTMP_Channel {
+    int id;
+    uint32_t timestamp;
+    /* absolute timestamp of the last message in */
+    RTMPPacket *in;
+    RTMPPacket *out;
+    /* the last chunk each way carries on from, NULL before the first */
+    uint32_t outSent;
+    /* body bytes RTMP_SendPacketPart sent of the message going out, 0 if none */
+    uint32_t outDelta;
+    /* timestamp field its continuation chunks carry */
+} RTMP_Channel;
+
+/* a stream added with RTMP_AddStream */
+typedef struct RTMP_Stream {
+    int id;
+    /* message stream id, 0 until createStream returns */
+    int txn;
+    /* transaction of its createStream */
+    int channel;
+    /* chunk stream its publish, audio and data go on, video goes on the next */
+    int state;
+    AVal playpath;
+} RTMP_Stream;
+
+/* RTMP_Stream states */
+#define RTMP_STREAM_FAILED      (-1)
+#define RTMP_STREAM_CREATING    0   /* createStream sent */
+#define RTMP_STREAM_PUBLISHING  1   /* publish sent */
+#define RTMP_STREAM_LIVE        2   /* NetStream.Publish.Start received */
+
+/* chunk streams of added streams start here, clear of those librtmp uses */
+#define RTMP_STREAM_CHANNEL_BASE    0x10
+
+/* chunk streams of the stream RTMP_ConnectStream published */
+#define RTMP_CHANNEL_SOURCE     0x04    /* audio, data and commands */
+#define RTMP_CHANNEL_VIDEO      0x06
+
 int
 RTMPPacket_Alloc(RTMPPacket *p, int nSize) {
     char *ptr = calloc(1, nSize + RTMP_MAX_HEADER_SIZE);
     if (!ptr)
         return FALSE;
     p->m_body = ptr + RTMP_MAX_HEADER_SIZE;
+    p->m_bodyPool = RTMP_BODY_HEAP;
     p->m_nBytesRead = 0;
     return TRUE;
 }
 
 void
 RTMPPacket_Free(RTMPPacket *p) {
-    if (p->m_body) {
+    /* lent bodies belong to the connection */
+    if (p->m_body && p->m_bodyPool == RTMP_BODY_HEAP)
         free(p->m_body - RTMP_MAX_HEADER_SIZE);
+    else if (p->m_body && p->m_bodyPool == RTMP_BODY_SLAB)
+        free(SlabBufOf(p->m_body));
+    p->m_body = NULL;
+    p->m_bodyPool = RTMP_BODY_HEAP;
+}
+
+/*
+ * @brief the size class holding size bytes, RTMP_SLAB_CLASSES when it is
+ * too large to keep
+ */
+static int SlabClass(uint32_t size) {
+    int c = 0;
+
+    while (c < RTMP_SLAB_CLASSES && (uint32_t) RTMP_SLAB_MIN << c < size)
+        c++;
+    return c;
+}
+
+/*
+ * @brief a body of at least size bytes with RTMP_MAX_HEADER_SIZE of room
+ * in front, one the connection keeps if it has one of that class
+ */
+static char *SlabGet(RTMP *r, uint32_t size) {
+    int c = SlabClass(size);
+    RTMP_SlabBuf *b;
+
+    if (c < RTMP_SLAB_CLASSES && (b = r->m_slabFree[c])) {
+        r->m_slabFree[c] = b->next;
+        r->m_slabCount[c]--;
+        r->m_slabCached -= b->size;
+    }
+    else {
+        /* a burst wanted back what was let go, keep that many more */
+        if (c < RTMP_SLAB_CLASSES && r->m_slabShort[c]) {
+            int keep = r->m_slabKeep[c] + r->m_slabShort[c];
+
+            r->m_slabKeep[c] = keep < UINT16_MAX - RTMP_SLAB_KEEP ? keep : UINT16_MAX - RTMP_SLAB_KEEP;
+            r->m_slabShort[c] = 0;
+        }
+        if (c < RTMP_SLAB_CLASSES)
+            size = (uint32_t) RTMP_SLAB_MIN << c;
+        if (!(b = malloc(sizeof(RTMP_SlabBuf) + RTMP_MAX_HEADER_SIZE + size)))
+            return NULL;
+        b->size = size;
+    }
+    return (char *) (b + 1) + RTMP_MAX_HEADER_SIZE;
+}
+
+static void SlabPut(RTMP *r, char *body) {
+    RTMP_SlabBuf *b = SlabBufOf(body);
+    int c = SlabClass(b->size);
+
+    if (c < RTMP_SLAB_CLASSES
+            && r->m_slabCount[c] >= RTMP_SLAB_KEEP + r->m_slabKeep[c]
+            && r->m_slabShort[c] < UINT16_MAX)
+        r->m_slabShort[c]++;
+    if (c == RTMP_SLAB_CLASSES || r->m_slabCount[c] >= RTMP_SLAB_KEEP + r->m_slabKeep[c]
+            || r->m_slabLimit <= 0
+            || r->m_slabCached + b->size > (uint32_t) r->m_slabLimit) {
+        free(b);
+        return;
+    }
+    b->next = r->m_slabFree[c];
+    r->m_slabFree[c] = b;
+    r->m_slabCount[c]++;
+    r->m_slabCached += b->size;
+}
+
+/*
+ * @brief free what the slab keeps, bodies and channel packets
+ */
+static void SlabDrain(RTMP *r) {
+    RTMP_ChannelSlab *cs;
+    RTMP_SlabBuf *b;
+    int c;
+
+    for (c = 0; c < RTMP_SLAB_CLASSES; c++) {
+        while ((b = r->m_slabFree[c])) {
+            r->m_slabFree[c] = b->next;
+            free(b);
+        }
+        r->m_slabCount[c] = 0;
+        r->m_slabShort[c] = 0;
+    }
+    r->m_slabCached = 0;
+    while ((cs = r->m_channelSlab)) {
+        r->m_channelSlab = cs->next;
+        free(cs);
+    }
+}
+
+/*
+ * @brief a zeroed packet to keep the state of a channel in
+ */
+static RTMPPacket *ChannelPacket(RTMP *r) {
+    RTMP_ChannelSlab *cs = r->m_channelSlab;
+
+    if (!cs || cs->used == RTMP_CHANNEL_SLAB) {
+        if (!(cs = calloc(1, sizeof(RTMP_ChannelSlab))))
+            return NULL;
+        cs->next = r->m_channelSlab;
+        r->m_channelSlab = cs;
+    }
+    return &cs->packets[cs->used++];
+}
+
+/*
+ * @brief the state of chunk stream id, added if create is set
+ * @return NULL if it is not there / could not be added
+ */
+static RTMP_Channel *ChannelFind(RTMP *r, int id, int create) {
+    int lo = 0, hi = r->m_numChannels;
+    RTMP_Channel *ch;
+
+    /* a handful of streams is in use, search them rather than index by id */
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if (r->m_channels[mid].id < id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < r->m_numChannels && r->m_channels[lo].id == id)
+        return &r->m_channels[lo];
+    if (!create)
+        return NULL;
+
+    if (r->m_numChannels == r->m_channelsAllocated) {
+        int n = r->m_channelsAllocated ? r->m_channelsAllocated * 2 : 4;
+
+        if (!(ch = realloc(r->m_channels, sizeof(RTMP_Channel) * n)))
+            return NULL;
+        r->m_channels = ch;
+        r->m_channelsAllocated = n;
+    }
+    ch = &r->m_channels[lo];
+    memmove(ch + 1, ch, sizeof(RTMP_Channel) * (r->m_numChannels - lo));
+    memset(ch, 0, sizeof(RTMP_Channel));
+    ch->id = id;
+    r->m_numChannels++;
+    return ch;
+}
+
+/*
+ * @brief absolute timestamp of the last message in on chunk stream id
+ */
+static uint32_t ChannelStamp(RTMP *r, int id) {
+    RTMP_Channel *ch = ChannelFind(r, id, FALSE);
+
+    return ch ? ch->timestamp : 0;
+}
+
+/*
+ * @brief the added stream with message stream id, NULL if there is none
+ */
+static RTMP_Stream *StreamFind(RTMP *r, int id) {
+    int i;
+
+    for (i = 0; i < r->m_numStreams; i++)
+        if (r->m_streams[i].id == id && id > 0)
+            return &r->m_streams[i];
+    return NULL;
+}
+
+/*
+ * @brief the added stream waiting for the result of transaction txn
+ */
+static RTMP_Stream *StreamByTxn(RTMP *r, int txn) {
+    int i;
+
+    for (i = 0; i < r->m_numStreams; i++)
+        if (r->m_streams[i].state == RTMP_STREAM_CREATING && r->m_streams[i].txn == txn)
+            return &r->m_streams[i];
+    return NULL;
+}
+
+/*
+ * @brief forget added stream i, nothing is sent
+ */
+static void StreamDrop(RTMP *r, int i) {
+    free(r->m_streams[i].playpath.av_val);
+    memmove(&r->m_streams[i], &r->m_streams[i + 1],
+            sizeof(RTMP_Stream) * (r->m_numStreams - i - 1));
+    if (!--r->m_numStreams) {
+        free(r->m_streams);
+        r->m_streams = NULL;
+    }
+}
+
+int RTMP_AllocBody(RTMP *r, RTMPPacket *p, int nSize) {
+    if (!(p->m_body = SlabGet(r, nSize)))
+        return FALSE;
+    p->m_bodyPool = RTMP_BODY_SLAB;
+    p->m_nBytesRead = 0;
+    return TRUE;
+}
+
+void RTMP_FreeBody(RTMP *r, RTMPPacket *p) {
+    if (p->m_body && p->m_bodyPool == RTMP_BODY_SLAB) {
+        SlabPut(r, p->m_body);
         p->m_body = NULL;
     }
+    RTMPPacket_Free(p);
 }
 
 void
@@ -269,6 +566,122 @@ RTMP_TLS_Init() {
 #endif
 }
 
+#if defined(CRYPTO) && !defined(NO_SSL) && defined(TLS_SESSION)
+/* hosts whose last TLS session is kept for resumption */
+#define RTMP_TLS_CACHE_SIZE    16
+
+typedef struct TLSCacheEntry {
+    char *host;
+    unsigned short port;
+    TLS_SESSION session;
+    uint32_t used;
+} TLSCacheEntry;
+
+static TLSCacheEntry tlsCache[RTMP_TLS_CACHE_SIZE];
+static uint32_t tlsCacheClock;
+
+#ifdef _WIN32
+static SRWLOCK tlsCacheLock = SRWLOCK_INIT;
+#define TLSCacheLock()      AcquireSRWLockExclusive(&tlsCacheLock)
+#define TLSCacheUnlock()    ReleaseSRWLockExclusive(&tlsCacheLock)
+#else
+static pthread_mutex_t tlsCacheLock = PTHREAD_MUTEX_INITIALIZER;
+#define TLSCacheLock()      pthread_mutex_lock(&tlsCacheLock)
+#define TLSCacheUnlock()    pthread_mutex_unlock(&tlsCacheLock)
+#endif
+
+static TLSCacheEntry *TLSCacheFind(const AVal *host, unsigned short port) {
+    int i;
+
+    for (i = 0; i < RTMP_TLS_CACHE_SIZE; i++) {
+        TLSCacheEntry *e = &tlsCache[i];
+        if (e->host && e->port == port && strlen(e->host) == (size_t) host->av_len
+                && !memcmp(e->host, host->av_val, host->av_len))
+            return e;
+    }
+    return NULL;
+}
+
+/*
+ * @brief offer the session last used with the host for resumption,
+ * call before the TLS handshake
+ */
+static void TLSCacheResume(RTMP *r) {
+    TLSCacheEntry *e;
+
+    TLSCacheLock();
+    if ((e = TLSCacheFind(&r->Link.hostname, r->Link.port))) {
+        e->used = ++tlsCacheClock;
+        TLS_set_session(r->m_sb.sb_ssl, e->session);
+    }
+    TLSCacheUnlock();
+}
+
+/*
+ * @brief keep the session of a client connection for the next one to the
+ * same host, TLS 1.3 tickets come after the handshake so this runs on close
+ */
+static void TLSCacheSave(RTMP *r) {
+    TLS_SESSION session;
+    TLSCacheEntry *e;
+    int i;
+
+    if (!r->m_sb.sb_ssl || !r->Link.hostname.av_len)
+        return;
+    session = TLS_get_session(r->m_sb.sb_ssl);
+    if (!session)
+        return;
+    if (!TLS_session_resumable(session)) {
+        TLS_free_session(session);
+        return;
+    }
+
+    TLSCacheLock();
+    if (!(e = TLSCacheFind(&r->Link.hostname, r->Link.port))) {
+        /* a free slot, or the one resumed longest ago */
+        for (i = 0; i < RTMP_TLS_CACHE_SIZE; i++) {
+            if (!tlsCache[i].host) {
+                e = &tlsCache[i];
+                break;
+            }
+            if (!e || tlsCache[i].used < e->used)
+                e = &tlsCache[i];
+        }
+        free(e->host);
+        e->host = malloc(r->Link.hostname.av_len + 1);
+        if (!e->host) {
+            TLSCacheUnlock();
+            TLS_free_session(session);
+            return;
+        }
+        memcpy(e->host, r->Link.hostname.av_val, r->Link.hostname.av_len);
+        e->host[r->Link.hostname.av_len] = '\0';
+        e->port = r->Link.port;
+    }
+    if (e->session)
+        TLS_free_session(e->session);
+    e->session = session;
+    e->used = ++tlsCacheClock;
+    TLSCacheUnlock();
+}
+#endif
+
+int
+RTMP_DHPoolStart(int depth) {
+#ifdef CRYPTO
+    return DHPoolStart(depth);
+#else
+    return FALSE;
+#endif
+}
+
+void
+RTMP_DHPoolStop(void) {
+#ifdef CRYPTO
+    DHPoolStop();
+#endif
+}
+
 void *
 RTMP_TLS_AllocServerContext(const char *cert, const char *key) {
     void *ctx = NULL;
@@ -346,6 +759,8 @@ RTMP_Init(RTMP *r) {
     r->m_sb.sb_socket = -1;
     r->m_inChunkSize = RTMP_DEFAULT_CHUNKSIZE;
     r->m_outChunkSize = RTMP_DEFAULT_CHUNKSIZE;
+    r->m_chunkBudgetMS = RTMP_CHUNKBUDGET_DEFAULT;
+    r->m_slabLimit = RTMP_SLAB_CACHE;
     r->m_nBufferMS = 30000;
     r->m_nClientBW = 2500000;
     r->m_nClientBW2 = 2;
@@ -354,6 +769,7 @@ RTMP_Init(RTMP *r) {
     r->m_fVideoCodecs = 252.0;
     r->Link.timeout = 30;
     r->Link.swfAge = 30;
+    r->m_bwe.interval = RTMP_BWE_INTERVAL_DEFAULT;
 }
 
 void
@@ -577,6 +993,10 @@ static struct urlopt {
                 "Key for SecureToken response"},
         {AVC("swfVfy"), OFF(Link.lFlags), OPT_BOOL, RTMP_LF_SWFV,
                 "Perform SWF Verification"},
+        {AVC("fastStart"), OFF(Link.lFlags), OPT_BOOL, RTMP_LF_FAST,
+                "Send connect and the publish setup in one write, without waiting for replies"},
+        {AVC("ktls"), OFF(Link.lFlags), OPT_BOOL, RTMP_LF_KTLS,
+                "Hand TLS encryption of sends to the kernel when it supports it"},
         {AVC("swfAge"), OFF(Link.swfAge), OPT_INT, 0,
                 "Number of days to use cached SWF hash"},
         {AVC("start"), OFF(Link.seekTime), OPT_INT, 0,
@@ -591,6 +1011,18 @@ static struct urlopt {
                 "Publisher username"},
         {AVC("pubPasswd"), OFF(Link.pubPasswd), OPT_STR, 0,
                 "Publisher password"},
+        {AVC("bwInterval"), OFF(m_bwe.interval), OPT_INT, 0,
+                "Bandwidth estimate interval in milliseconds, 0 to disable"},
+        {AVC("coalesce"), OFF(m_sb.sb_coalesceMS), OPT_INT, 0,
+                "Hold small writes up to this many milliseconds, 0 to disable"},
+        {AVC("chunkBudget"), OFF(m_chunkBudgetMS), OPT_INT, 0,
+                "Max time in milliseconds one outbound chunk may take, 0 to keep the chunk size"},
+        {AVC("zeroCopy"), OFF(m_zcThreshold), OPT_INT, 0,
+                "Send video bodies of at least this many bytes with MSG_ZEROCOPY, 0 to disable"},
+        {AVC("slabCache"), OFF(m_slabLimit), OPT_INT, 0,
+                "Max bytes of finished packet bodies a connection keeps for reuse"},
+        {AVC("aggregate"), OFF(m_aggregateMS), OPT_INT, 0,
+                "Pack small tags into aggregate messages spanning or held up to this many milliseconds, 0 to disable"},
         {{NULL, 0}, 0, 0}
 };
 
@@ -848,110 +1280,580 @@ int RTMP_SetupURL(RTMP *r, char *url) {
     return TRUE;
 }
 
+/* resolved hosts kept for reconnects */
+#define RTMP_DNS_CACHE_SIZE    16
+#define RTMP_DNS_MAX_ADDRS     8
+#define RTMP_DNS_TTL           60
+
+/* head start of one connect attempt over the next (RFC 8305) */
+#define RTMP_RACE_DELAY        250
+
+typedef struct DNSCacheEntry {
+    char *host;
+    struct sockaddr_storage addrs[RTMP_DNS_MAX_ADDRS];
+    int naddrs;
+    uint32_t resolved;
+    /* RTMP_GetTime() of the lookup */
+    uint32_t used;
+    int resolving;
+    /* a lookup of host is in flight, others wait on dnsCacheCond for it */
+} DNSCacheEntry;
+
+static DNSCacheEntry dnsCache[RTMP_DNS_CACHE_SIZE];
+static uint32_t dnsCacheClock;
+static int dnsTTL = RTMP_DNS_TTL;
+
+#ifdef _WIN32
+static SRWLOCK dnsCacheLock = SRWLOCK_INIT;
+static CONDITION_VARIABLE dnsCacheCond = CONDITION_VARIABLE_INIT;
+#define DNSCacheLock()      AcquireSRWLockExclusive(&dnsCacheLock)
+#define DNSCacheUnlock()    ReleaseSRWLockExclusive(&dnsCacheLock)
+#define DNSCacheWait()      SleepConditionVariableSRW(&dnsCacheCond, &dnsCacheLock, INFINITE, 0)
+#define DNSCacheWake()      WakeAllConditionVariable(&dnsCacheCond)
+#else
+static pthread_mutex_t dnsCacheLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dnsCacheCond = PTHREAD_COND_INITIALIZER;
+#define DNSCacheLock()      pthread_mutex_lock(&dnsCacheLock)
+#define DNSCacheUnlock()    pthread_mutex_unlock(&dnsCacheLock)
+#define DNSCacheWait()      pthread_cond_wait(&dnsCacheCond, &dnsCacheLock)
+#define DNSCacheWake()      pthread_cond_broadcast(&dnsCacheCond)
+#endif
+
 /*
- * @brief set host ip address and port to socket struct
- * @param[out] service: socket ipv4 address struct
- * @param[in] host: hostname and length
- * @param[in] port: port number
- *
- * @return success: TRUE / FALSE
+ * @brief all A and AAAA records of host, in the order getaddrinfo prefers
+ * them but with the two families taking turns
+ * @return number of addresses, 0 if the lookup failed
  */
-static int add_addr_info(struct sockaddr_in *service, AVal *host, int port) {
-    char *hostname;
-    int ret = TRUE;
-    // get hostname
-    if (host->av_val[host->av_len]) {
-        // the value after hostname is non-zero
-        hostname = malloc(host->av_len + 1);
-        memcpy(hostname, host->av_val, host->av_len);
-        hostname[host->av_len] = '\0';
-    } else {
-        // the value after hostname is zero
-        hostname = host->av_val;
+static int DNSLookup(const char *host, struct sockaddr_storage *addrs, int max) {
+    struct addrinfo hints, *res, *ai;
+    struct sockaddr_storage v4[RTMP_DNS_MAX_ADDRS], v6[RTMP_DNS_MAX_ADDRS];
+    int n4 = 0, n6 = 0, i4 = 0, i6 = 0, n = 0, rc, six;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+    rc = getaddrinfo(host, NULL, &hints, &res);
+    if (rc) {
+        RTMP_Log(RTMP_LOGERROR, "Problem accessing the DNS. (addr: %s) %s", host,
+                gai_strerror(rc));
+        return 0;
     }
 
-    service->sin_addr.s_addr = inet_addr(hostname);
-    if (service->sin_addr.s_addr == INADDR_NONE) {
-        struct hostent *host = gethostbyname(hostname);
-        if (host == NULL || host->h_addr == NULL) {
-            RTMP_Log(RTMP_LOGERROR, "Problem accessing the DNS. (addr: %s)", hostname);
-            ret = FALSE;
-            goto finish;
-        }
-        service->sin_addr = *(struct in_addr *) host->h_addr;
+    for (ai = res; ai; ai = ai->ai_next) {
+        if (ai->ai_family == AF_INET && n4 < RTMP_DNS_MAX_ADDRS)
+            memcpy(&v4[n4++], ai->ai_addr, sizeof(struct sockaddr_in));
+        else if (ai->ai_family == AF_INET6 && n6 < RTMP_DNS_MAX_ADDRS)
+            memcpy(&v6[n6++], ai->ai_addr, sizeof(struct sockaddr_in6));
     }
+    six = res->ai_family == AF_INET6;
+    freeaddrinfo(res);
 
-    service->sin_port = htons(port);
-    finish:
-    if (hostname != host->av_val) {
-        free(hostname);
+    while (n < max && (i4 < n4 || i6 < n6)) {
+        if ((six && i6 < n6) || i4 == n4)
+            addrs[n++] = v6[i6++];
+        else
+            addrs[n++] = v4[i4++];
+        six = !six;
     }
-    return ret;
+    return n;
+}
+
+static DNSCacheEntry *DNSCacheFind(const char *host) {
+    int i;
+
+    for (i = 0; i < RTMP_DNS_CACHE_SIZE; i++) {
+        if (dnsCache[i].host && !strcmp(dnsCache[i].host, host))
+            return &dnsCache[i];
+    }
+    return NULL;
 }
 
 /*
- * @brief create socket connection, r creates a socket connection to service's network adress
- * set socket receive data timeout, and socket receive and send buffer size
+ * @brief whether e was looked up recently enough to skip the DNS
  */
-int RTMP_Connect0(RTMP *r, struct sockaddr *service) {
-    int on = 1;
-    r->m_sb.sb_timedout = FALSE;
-    r->m_pausing = 0;
-    r->m_fDuration = 0.0;
+static int DNSCacheFresh(const DNSCacheEntry *e) {
+    return e->naddrs && dnsTTL > 0
+        && RTMP_GetTime() - e->resolved < (uint32_t) dnsTTL * 1000;
+}
 
-    r->m_sb.sb_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (r->m_sb.sb_socket != -1) {
-        if (connect(r->m_sb.sb_socket, service, sizeof(struct sockaddr)) < 0) {
-            int err = GetSockError();
-            RTMP_Log(RTMP_LOGERROR, "%s, failed to connect socket. %d (%s)",
-                    __FUNCTION__, err, strerror(err));
-            RTMP_Close(r);
+/*
+ * @brief the entry of host, a new one in a free entry or else in the least
+ * recently used one not being resolved, called with the lock held
+ * @return the entry / NULL if there is none to take
+ */
+static DNSCacheEntry *DNSCacheTake(const char *host) {
+    DNSCacheEntry *e = DNSCacheFind(host);
+    int i;
+
+    if (e)
+        return e;
+    for (i = 0; i < RTMP_DNS_CACHE_SIZE; i++) {
+        if (!dnsCache[i].host) {
+            e = &dnsCache[i];
+            break;
+        }
+        if (!dnsCache[i].resolving && (!e || dnsCache[i].used < e->used))
+            e = &dnsCache[i];
+    }
+    if (!e)
+        return NULL;
+    free(e->host);
+    e->naddrs = 0;
+    if (!(e->host = strdup(host)))
+        return NULL;
+    e->used = ++dnsCacheClock;
+    return e;
+}
+
+/*
+ * @brief claim the lookup of host, or wait for the one in flight
+ * @param wait: wait for a lookup in flight rather than return at once
+ * @return TRUE: the caller looks host up and calls DNSCacheEnd / FALSE: a
+ * lookup by another thread is in flight or, with wait, has ended
+ */
+static int DNSCacheBegin(const char *host, int wait) {
+    DNSCacheEntry *e;
+    int waited = FALSE;
+
+    DNSCacheLock();
+    while ((e = DNSCacheFind(host)) != NULL && e->resolving) {
+        if (!wait) {
+            DNSCacheUnlock();
             return FALSE;
         }
+        DNSCacheWait();
+        waited = TRUE;
+    }
+    if (!waited && (e = DNSCacheTake(host)) != NULL)
+        e->resolving = TRUE;
+    DNSCacheUnlock();
+    return !waited;
+}
 
-        if (r->Link.socksport) {
-            // connect via socks
-            RTMP_Log(RTMP_LOGDEBUG, "%s ... SOCKS negotiation", __FUNCTION__);
-            if (!SocksNegotiate(r)) {
-                RTMP_Log(RTMP_LOGERROR, "%s, SOCKS negotiation failed.", __FUNCTION__);
-                RTMP_Close(r);
-                return FALSE;
-            }
+/*
+ * @brief store what the lookup of host found, the addresses from before
+ * are kept when it found none, and wake those waiting for it
+ */
+static void DNSCacheEnd(const char *host, const struct sockaddr_storage *addrs, int n) {
+    DNSCacheEntry *e;
+
+    DNSCacheLock();
+    e = n ? DNSCacheTake(host) : DNSCacheFind(host);
+    if (e) {
+        if (n) {
+            memcpy(e->addrs, addrs, n * sizeof(*addrs));
+            e->naddrs = n;
+            e->resolved = RTMP_GetTime();
+            e->used = ++dnsCacheClock;
         }
-    } else {
-        RTMP_Log(RTMP_LOGERROR, "%s, failed to create socket. Error: %d", __FUNCTION__,
-                GetSockError());
-        return FALSE;
+        e->resolving = FALSE;
     }
+    DNSCacheWake();
+    DNSCacheUnlock();
+}
 
-    /* set timeout */
-    SET_RCVTIMEO(tv, r->Link.timeout);
-    if (setsockopt
-            (r->m_sb.sb_socket, SOL_SOCKET, SO_RCVTIMEO, (char *) &tv, sizeof(tv))) {
-        RTMP_Log(RTMP_LOGERROR, "%s, Setting socket timeout to %ds failed!",
-                __FUNCTION__, r->Link.timeout);
+/*
+ * @brief copy what is cached for host, fresh or not
+ * @return number of addresses / -1 if host is not cached
+ */
+static int DNSCacheGet(const char *host, struct sockaddr_storage *addrs, int max, int fresh) {
+    DNSCacheEntry *e;
+    int n = -1;
+
+    DNSCacheLock();
+    if ((e = DNSCacheFind(host)) != NULL) {
+        n = 0;
+        if (!fresh || DNSCacheFresh(e)) {
+            n = e->naddrs < max ? e->naddrs : max;
+            memcpy(addrs, e->addrs, n * sizeof(*addrs));
+            e->used = ++dnsCacheClock;
+        }
     }
+    DNSCacheUnlock();
+    return n;
+}
 
-    setsockopt(r->m_sb.sb_socket, IPPROTO_TCP, TCP_NODELAY, (char *) &on, sizeof(on));
+/*
+ * @brief addresses to connect to host on port, from the cache while they
+ * are fresh, else from the DNS
+ *
+ * A lookup of host already in flight, as RTMP_ResolveAhead starts, is
+ * waited for rather than made twice. If the DNS fails what was cached last
+ * is used, however old.
+ * @return number of addresses, 0 if host could not be resolved
+ */
+static int ResolveHost(const AVal *host, int port, struct sockaddr_storage *addrs, int max) {
+    char *hostname;
+    int i, n;
 
-    return TRUE;
+    hostname = malloc(host->av_len + 1);
+    if (!hostname)
+        return 0;
+    memcpy(hostname, host->av_val, host->av_len);
+    hostname[host->av_len] = '\0';
+
+    n = DNSCacheGet(hostname, addrs, max, TRUE);
+    if (n <= 0) {
+        /* one lookup per host at a time, the others take what it found */
+        if (DNSCacheBegin(hostname, TRUE)) {
+            n = DNSLookup(hostname, addrs, max);
+            DNSCacheEnd(hostname, addrs, n);
+        }
+        else {
+            n = DNSCacheGet(hostname, addrs, max, TRUE);
+        }
+        if (n <= 0 && (n = DNSCacheGet(hostname, addrs, max, FALSE)) > 0) {
+            RTMP_Log(RTMP_LOGWARNING, "%s, using the expired addresses of %s",
+                    __FUNCTION__, hostname);
+        }
+        else if (n < 0) {
+            n = 0;
+        }
+    }
+    free(hostname);
+
+    for (i = 0; i < n; i++) {
+        if (addrs[i].ss_family == AF_INET6)
+            ((struct sockaddr_in6 *) &addrs[i])->sin6_port = htons(port);
+        else
+            ((struct sockaddr_in *) &addrs[i])->sin_port = htons(port);
+    }
+    return n;
 }
 
-int
-RTMP_TLS_Accept(RTMP *r, void *ctx) {
-#if defined(CRYPTO) && !defined(NO_SSL)
-    TLS_server(ctx, r->m_sb.sb_ssl);
-    TLS_setfd(r->m_sb.sb_ssl, r->m_sb.sb_socket);
-    if (TLS_accept(r->m_sb.sb_ssl) < 0) {
-        RTMP_Log(RTMP_LOGERROR, "%s, TLS_Connect failed", __FUNCTION__);
+#ifndef _WIN32
+static void *ResolveThread(void *arg) {
+    struct sockaddr_storage addrs[RTMP_DNS_MAX_ADDRS];
+    char *host = arg;
+    int n;
+
+    n = DNSLookup(host, addrs, RTMP_DNS_MAX_ADDRS);
+    DNSCacheEnd(host, addrs, n);
+    free(host);
+    return NULL;
+}
+#endif
+
+int RTMP_ResolveAhead(RTMP *r) {
+#ifndef _WIN32
+    AVal *host = r->Link.socksport ? &r->Link.sockshost : &r->Link.hostname;
+    struct sockaddr_storage addr;
+    pthread_t thread;
+    char *hostname;
+
+    if (!host->av_len || !(hostname = malloc(host->av_len + 1)))
+        return FALSE;
+    memcpy(hostname, host->av_val, host->av_len);
+    hostname[host->av_len] = '\0';
+
+    /* fresh or already being looked up */
+    if (DNSCacheGet(hostname, &addr, 1, TRUE) > 0 || !DNSCacheBegin(hostname, FALSE)) {
+        free(hostname);
+        return TRUE;
+    }
+    if (pthread_create(&thread, NULL, ResolveThread, hostname)) {
+        DNSCacheEnd(hostname, NULL, 0);
+        free(hostname);
         return FALSE;
     }
+    pthread_detach(thread);
     return TRUE;
 #else
-  return FALSE;
+    return FALSE;
+#endif
+}
+
+void RTMP_SetDNSTTL(int seconds) {
+    DNSCacheLock();
+    dnsTTL = seconds;
+    DNSCacheUnlock();
+}
+
+static socklen_t AddrLen(const struct sockaddr_storage *addr) {
+    return addr->ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+static void SockSetNonBlock(int fd, int on) {
+#ifdef _WIN32
+    u_long mode = on;
+    ioctlsocket(fd, FIONBIO, &mode);
+#else
+    int flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, on ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
 #endif
 }
 
+/*
+ * @brief start a non-blocking connect to addr
+ * @return 1 connected, 0 in progress / -1 failed
+ */
+static int ConnectStart(const struct sockaddr_storage *addr, int *fd) {
+    int err;
+
+    *fd = socket(addr->ss_family, SOCK_STREAM, IPPROTO_TCP);
+    if (*fd == -1) {
+        RTMP_Log(RTMP_LOGDEBUG, "%s, failed to create socket. Error: %d", __FUNCTION__,
+                GetSockError());
+        return -1;
+    }
+    SockSetNonBlock(*fd, TRUE);
+    if (connect(*fd, (const struct sockaddr *) addr, AddrLen(addr)) == 0)
+        return 1;
+
+    err = GetSockError();
+#ifdef _WIN32
+    if (err == WSAEWOULDBLOCK)
+#else
+    if (err == EINPROGRESS)
+#endif
+        return 0;
+    RTMP_Log(RTMP_LOGDEBUG, "%s, failed to connect socket. %d (%s)",
+            __FUNCTION__, err, strerror(err));
+    closesocket(*fd);
+    *fd = -1;
+    return -1;
+}
+
+/*
+ * @brief connect to whichever of addrs answers first, happy eyeballs style
+ *
+ * A new attempt starts every RTMP_RACE_DELAY ms, or as soon as one fails,
+ * while the earlier ones keep going. The first to complete wins, the rest
+ * are dropped. All of it is bounded by Link.timeout.
+ * @return connected blocking socket / -1
+ */
+static int ConnectRace(RTMP *r, const struct sockaddr_storage *addrs, int n) {
+    int fds[RTMP_DNS_MAX_ADDRS], slot[RTMP_DNS_MAX_ADDRS];
+    struct pollfd pfd[RTMP_DNS_MAX_ADDRS];
+    int i, j, npfd, next = 0, active = 0, kick = FALSE, winner = -1;
+    uint32_t start = RTMP_GetTime(), lastStart = start;
+    uint32_t limit = (r->Link.timeout > 0 ? r->Link.timeout : 30) * 1000;
+
+    for (i = 0; i < n; i++)
+        fds[i] = -1;
+
+    while (winner < 0) {
+        uint32_t now = RTMP_GetTime(), wait;
+
+        if (next < n && (!active || kick || now - lastStart >= RTMP_RACE_DELAY)) {
+            int rc = ConnectStart(&addrs[next], &fds[next]);
+            if (rc > 0)
+                winner = next;
+            else if (!rc)
+                active++;
+            kick = rc < 0;
+            lastStart = now;
+            next++;
+            continue;
+        }
+        if (!active)
+            break;
+        if (now - start >= limit) {
+            RTMP_Log(RTMP_LOGERROR, "%s, timed out connecting", __FUNCTION__);
+            break;
+        }
+
+        wait = limit - (now - start);
+        if (next < n && RTMP_RACE_DELAY - (now - lastStart) < wait)
+            wait = RTMP_RACE_DELAY - (now - lastStart);
+
+        /* poll, not select, the fds of a process with many connections go
+         * past FD_SETSIZE */
+        for (i = npfd = 0; i < next; i++) {
+            if (fds[i] < 0)
+                continue;
+            pfd[npfd].fd = fds[i];
+            pfd[npfd].events = POLLOUT;
+            pfd[npfd].revents = 0;
+            slot[npfd++] = i;
+        }
+        if (poll(pfd, npfd, wait) < 0 && GetSockError() != EINTR)
+            break;
+
+        for (j = 0; j < npfd; j++) {
+            int err = 0;
+            socklen_t len = sizeof(err);
+
+            i = slot[j];
+            if (!(pfd[j].revents & (POLLOUT | POLLERR | POLLHUP)))
+                continue;
+            if (getsockopt(fds[i], SOL_SOCKET, SO_ERROR, (char *) &err, &len) == 0 && !err
+                    && !(pfd[j].revents & (POLLERR | POLLHUP))) {
+                winner = i;
+                break;
+            }
+            RTMP_Log(RTMP_LOGDEBUG, "%s, address %d of %d failed. %d (%s)",
+                    __FUNCTION__, i + 1, n, err, strerror(err));
+            closesocket(fds[i]);
+            fds[i] = -1;
+            active--;
+            kick = TRUE;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        if (i != winner && fds[i] >= 0)
+            closesocket(fds[i]);
+    }
+    if (winner < 0) {
+        RTMP_Log(RTMP_LOGERROR, "%s, failed to connect to any of %d addresses",
+                __FUNCTION__, n);
+        return -1;
+    }
+    SockSetNonBlock(fds[winner], FALSE);
+    return fds[winner];
+}
+
+/*
+ * @brief create socket connection, r creates a socket connection to service's network adress
+ * set socket receive data timeout, and socket receive and send buffer size
+ */
+static void ConnectReset(RTMP *r) {
+    r->m_sb.sb_timedout = FALSE;
+    r->m_sb.sb_bytesSent = 0;
+    r->m_pausing = 0;
+    r->m_fDuration = 0.0;
+    memset(&r->m_bwe.stats, 0, sizeof(r->m_bwe.stats));
+    r->m_bwe.lastSample = RTMP_GetTime();
+    r->m_bwe.lastDrained = 0;
+}
+
+/*
+ * @brief set up the freshly connected socket: SOCKS, receive timeout, TCP_NODELAY
+ */
+static int ConnectSetup(RTMP *r) {
+    int on = 1;
+
+    if (r->Link.socksport) {
+        // connect via socks
+        RTMP_Log(RTMP_LOGDEBUG, "%s ... SOCKS negotiation", __FUNCTION__);
+        if (!SocksNegotiate(r)) {
+            RTMP_Log(RTMP_LOGERROR, "%s, SOCKS negotiation failed.", __FUNCTION__);
+            RTMP_Close(r);
+            return FALSE;
+        }
+    }
+
+    /* set timeout */
+    SET_RCVTIMEO(tv, r->Link.timeout);
+    if (setsockopt
+            (r->m_sb.sb_socket, SOL_SOCKET, SO_RCVTIMEO, (char *) &tv, sizeof(tv))) {
+        RTMP_Log(RTMP_LOGERROR, "%s, Setting socket timeout to %ds failed!",
+                __FUNCTION__, r->Link.timeout);
+    }
+
+    setsockopt(r->m_sb.sb_socket, IPPROTO_TCP, TCP_NODELAY, (char *) &on, sizeof(on));
+
+    return TRUE;
+}
+
+int RTMP_Connect0(RTMP *r, struct sockaddr *service) {
+    ConnectReset(r);
+
+    r->m_sb.sb_socket = socket(service->sa_family, SOCK_STREAM, IPPROTO_TCP);
+    if (r->m_sb.sb_socket == -1) {
+        RTMP_Log(RTMP_LOGERROR, "%s, failed to create socket. Error: %d", __FUNCTION__,
+                GetSockError());
+        return FALSE;
+    }
+    if (connect(r->m_sb.sb_socket, service,
+            AddrLen((struct sockaddr_storage *) service)) < 0) {
+        int err = GetSockError();
+        RTMP_Log(RTMP_LOGERROR, "%s, failed to connect socket. %d (%s)",
+                __FUNCTION__, err, strerror(err));
+        RTMP_Close(r);
+        return FALSE;
+    }
+
+    return ConnectSetup(r);
+}
+
+#if defined(CRYPTO) && !defined(NO_SSL)
+/*
+ * @brief after the handshake, see whether the TLS library handed the send
+ * keys to the kernel (SO_ULP "tls", TLS_TX)
+ *
+ * From then on the kernel frames and encrypts records, sends skip TLS_write
+ * and take the vectored and sendfile paths of a plain socket.
+ */
+static void SockBufKTLS(RTMP *r) {
+    if (!(r->Link.lFlags & RTMP_LF_KTLS))
+        return;
+    r->m_sb.sb_ktls = TLS_ktls_send(r->m_sb.sb_ssl) ? TRUE : FALSE;
+    RTMP_Log(RTMP_LOGDEBUG, "%s, kernel TLS sends %s", __FUNCTION__,
+            r->m_sb.sb_ktls ? "on" : "unavailable");
+}
+#endif
+
+int
+RTMP_TLS_Accept(RTMP *r, void *ctx) {
+#if defined(CRYPTO) && !defined(NO_SSL)
+    TLS_server(ctx, r->m_sb.sb_ssl);
+    TLS_setfd(r->m_sb.sb_ssl, r->m_sb.sb_socket);
+    if (r->Link.lFlags & RTMP_LF_KTLS)
+        TLS_ktls_enable(r->m_sb.sb_ssl);
+    if (TLS_accept(r->m_sb.sb_ssl) < 0) {
+        RTMP_Log(RTMP_LOGERROR, "%s, TLS_Connect failed", __FUNCTION__);
+        return FALSE;
+    }
+    SockBufKTLS(r);
+    return TRUE;
+#else
+  return FALSE;
+#endif
+}
+
+/*
+ * @brief whether the publish setup goes out right behind connect
+ *
+ * Servers handle commands in order, so releaseStream, FCPublish and
+ * createStream need not wait for the connect result. Not for standbys,
+ * which hold the stream back, nor RTMPT, which posts every write.
+ */
+static int FastStart(RTMP *r) {
+    return (r->Link.lFlags & RTMP_LF_FAST) && (r->Link.protocol & RTMP_FEATURE_WRITE)
+            && !(r->Link.protocol & RTMP_FEATURE_HTTP) && !r->m_standby;
+}
+
+/*
+ * @brief send connect command after the handshake
+ *
+ * With fastStart the stream setup follows in the same write, its results
+ * are matched to the calls queued in m_methodCalls in whatever order
+ * they come and publish is sent once createStream returns the stream id.
+ */
+static int NetConnect(RTMP *r, RTMPPacket *cp) {
+    int fast = FastStart(r);
+
+    r->m_sb.sb_cork = fast;
+    if (!SendConnectPacket(r, cp)) {
+        r->m_sb.sb_cork = FALSE;
+        RTMP_Log(RTMP_LOGERROR, "%s, RTMP connect failed.", __FUNCTION__);
+        return FALSE;
+    }
+
+    /* 128 byte chunks cost a header every 128 bytes of video */
+    if ((r->Link.protocol & RTMP_FEATURE_WRITE) && r->m_chunkBudgetMS > 0
+            && r->m_outChunkSize < RTMP_CHUNKSIZE_INITIAL) {
+        if (!RTMP_SendChunkSize(r, RTMP_CHUNKSIZE_INITIAL)) {
+            r->m_sb.sb_cork = FALSE;
+            RTMP_Log(RTMP_LOGERROR, "%s, RTMP set chunk size failed.", __FUNCTION__);
+            return FALSE;
+        }
+    }
+
+    if (fast) {
+        SendStreamSetup(r);
+        r->m_sb.sb_cork = FALSE;
+        if (!RTMP_IsConnected(r) || !RTMP_Flush(r)) {
+            RTMP_Log(RTMP_LOGERROR, "%s, RTMP fast start failed.", __FUNCTION__);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
 /*
  * @brief create RTMP conection, handshake begin
  * 1) HandShake() finished handshake
@@ -962,11 +1864,21 @@ int RTMP_Connect1(RTMP *r, RTMPPacket *cp) {
 #if defined(CRYPTO) && !defined(NO_SSL)
         TLS_client(RTMP_TLS_ctx, r->m_sb.sb_ssl);
         TLS_setfd(r->m_sb.sb_ssl, r->m_sb.sb_socket);
+        if (r->Link.lFlags & RTMP_LF_KTLS)
+            TLS_ktls_enable(r->m_sb.sb_ssl);
+#ifdef TLS_SESSION
+        TLSCacheResume(r);
+#endif
         if (TLS_connect(r->m_sb.sb_ssl) < 0) {
             RTMP_Log(RTMP_LOGERROR, "%s, TLS_Connect failed", __FUNCTION__);
             RTMP_Close(r);
             return FALSE;
         }
+#ifdef TLS_SESSION
+        if (TLS_session_reused(r->m_sb.sb_ssl))
+            RTMP_Log(RTMP_LOGDEBUG, "%s, TLS session resumed", __FUNCTION__);
+#endif
+        SockBufKTLS(r);
 #else
       RTMP_Log(RTMP_LOGERROR, "%s, no SSL/TLS support", __FUNCTION__);
       RTMP_Close(r);
@@ -995,8 +1907,7 @@ int RTMP_Connect1(RTMP *r, RTMPPacket *cp) {
     }
     RTMP_Log(RTMP_LOGDEBUG, "%s, handshaked", __FUNCTION__);
 
-    if (!SendConnectPacket(r, cp)) {
-        RTMP_Log(RTMP_LOGERROR, "%s, RTMP connect failed.", __FUNCTION__);
+    if (!NetConnect(r, cp)) {
         RTMP_Close(r);
         return FALSE;
     }
@@ -1005,34 +1916,35 @@ int RTMP_Connect1(RTMP *r, RTMPPacket *cp) {
 
 /*
  * @brief create RTMP NetConnection
- * a) create and set target socket, include ip address and port
- * b) create socket connection, set socket timeout and receive, send buffer size
+ * a) resolve the host, from the cache if it was looked up lately
+ * b) race socket connections to its addresses, keep the first to connect,
+ *    set socket timeout and receive, send buffer size
  * c) handshake operation
  * d) send datagram include connect command, used to create RTMP connection
  */
 int RTMP_Connect(RTMP *r, RTMPPacket *cp) {
-    struct sockaddr_in service;
+    struct sockaddr_storage addrs[RTMP_DNS_MAX_ADDRS];
+    int n;
+
     if (!r->Link.hostname.av_len) {
         return FALSE;
     }
 
-    memset(&service, 0, sizeof(struct sockaddr_in));
-    service.sin_family = AF_INET;
-
     if (r->Link.socksport) {
         /* Connect via SOCKS */
-        if (!add_addr_info(&service, &r->Link.sockshost, r->Link.socksport)) {
-            return FALSE;
-        }
+        n = ResolveHost(&r->Link.sockshost, r->Link.socksport, addrs, RTMP_DNS_MAX_ADDRS);
     } else {
         /* Connect directly */
-        if (!add_addr_info(&service, &r->Link.hostname, r->Link.port)) {
-            return FALSE;
-        }
+        n = ResolveHost(&r->Link.hostname, r->Link.port, addrs, RTMP_DNS_MAX_ADDRS);
+    }
+    if (!n) {
+        return FALSE;
     }
 
     // the 0th connection, mainly used to create socket connection, didn't start true RTMP connection
-    if (!RTMP_Connect0(r, (struct sockaddr *) &service)) {
+    ConnectReset(r);
+    r->m_sb.sb_socket = ConnectRace(r, addrs, n);
+    if (r->m_sb.sb_socket == -1 || !ConnectSetup(r)) {
         return FALSE;
     }
 
@@ -1042,14 +1954,265 @@ int RTMP_Connect(RTMP *r, RTMPPacket *cp) {
     return RTMP_Connect1(r, cp);
 }
 
+#ifndef _WIN32
+/*
+ * @brief send C0 C1 of the plain handshake, S0 S1 S2 are read by ParseNB
+ */
+static int HandShakeNB(RTMP *r) {
+    char clientbuf[RTMP_SIG_SIZE + 1], *clientsig = clientbuf + 1;
+    uint32_t uptime;
+    int i;
+
+    clientbuf[0] = 0x03;        /* not encrypted */
+
+    uptime = htonl(RTMP_GetTime());
+    memcpy(clientsig, &uptime, 4);
+    memset(&clientsig[4], 0, 4);
+    for (i = 8; i < RTMP_SIG_SIZE; i++)
+        clientsig[i] = (char) (rand() % 256);
+
+    r->m_nbState = RTMP_NB_HANDSHAKE;
+    return WriteN(r, clientbuf, RTMP_SIG_SIZE + 1);
+}
+
+int RTMP_ConnectNB(RTMP *r) {
+    struct sockaddr_storage service;
+    int on = 1;
+
+    if (!r->Link.hostname.av_len) {
+        return FALSE;
+    }
+    if ((r->Link.protocol & (RTMP_FEATURE_HTTP | RTMP_FEATURE_SSL | RTMP_FEATURE_ENC))
+#ifdef CRYPTO
+            || r->Link.SWFSize
+#endif
+            || r->Link.socksport) {
+        RTMP_Log(RTMP_LOGERROR, "%s, only plain rtmp:// connects without blocking",
+                __FUNCTION__);
+        return FALSE;
+    }
+
+    /* only the preferred address, RTMP_ResolveAhead keeps the lookup off the caller */
+    if (!ResolveHost(&r->Link.hostname, r->Link.port, &service, 1)) {
+        return FALSE;
+    }
+
+    ConnectReset(r);
+    r->m_sb.sb_socket = socket(service.ss_family, SOCK_STREAM, IPPROTO_TCP);
+    if (r->m_sb.sb_socket == -1) {
+        RTMP_Log(RTMP_LOGERROR, "%s, failed to create socket. Error: %d", __FUNCTION__,
+                GetSockError());
+        return FALSE;
+    }
+    SockSetNonBlock(r->m_sb.sb_socket, TRUE);
+    setsockopt(r->m_sb.sb_socket, IPPROTO_TCP, TCP_NODELAY, (char *) &on, sizeof(on));
+    r->m_sb.sb_nonblock = RTMP_SB_NONBLOCK;
+    r->m_bSendCounter = TRUE;
+    r->m_nbStamp = RTMP_GetTime();
+
+    if (connect(r->m_sb.sb_socket, (struct sockaddr *) &service, AddrLen(&service)) < 0) {
+        int err = GetSockError();
+        if (err != EINPROGRESS) {
+            RTMP_Log(RTMP_LOGERROR, "%s, failed to connect socket. %d (%s)",
+                    __FUNCTION__, err, strerror(err));
+            RTMP_Close(r);
+            return FALSE;
+        }
+        r->m_nbState = RTMP_NB_TCP;
+        return TRUE;
+    }
+
+    if (!HandShakeNB(r)) {
+        RTMP_Close(r);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * @brief read what the socket has, compacting the receive buffer first
+ * @return bytes read, 0 if it would block / -1 on error or end of stream
+ */
+static int FillNB(RTMPSockBuf *sb) {
+    int nBytes, room;
+
+    if (sb->sb_buf && sb->sb_start != sb->sb_buf + RTMP_MAX_HEADER_SIZE) {
+        if (sb->sb_size)
+            memmove(sb->sb_buf + RTMP_MAX_HEADER_SIZE, sb->sb_start, sb->sb_size);
+        sb->sb_start = sb->sb_buf + RTMP_MAX_HEADER_SIZE;
+    }
+
+    /* full with a partial chunk, grow it */
+    if ((room = RTMPSockBuf_Reserve(sb, 1)) <= 0) {
+        RTMP_Log(RTMP_LOGERROR, "%s, chunk does not fit the receive buffer", __FUNCTION__);
+        return -1;
+    }
+
+    do {
+        nBytes = recv(sb->sb_socket, sb->sb_start + sb->sb_size, room, 0);
+    } while (nBytes < 0 && GetSockError() == EINTR);
+
+    if (nBytes < 0) {
+        int sockerr = GetSockError();
+        if (sockerr == EAGAIN || sockerr == EWOULDBLOCK)
+            return 0;
+        RTMP_Log(RTMP_LOGDEBUG, "%s, recv returned %d. GetSockError(): %d (%s)",
+                __FUNCTION__, nBytes, sockerr, strerror(sockerr));
+        return -1;
+    }
+    if (nBytes == 0) {
+        RTMP_Log(RTMP_LOGDEBUG, "%s, RTMP socket closed by peer", __FUNCTION__);
+        return -1;
+    }
+    sb->sb_size += nBytes;
+    RTMPSockBuf_Filled(sb, room, nBytes);
+    return nBytes;
+}
+
+/*
+ * @brief whether the receive buffer holds a whole chunk, so that
+ * RTMP_ReadPacket returns without touching the socket
+ */
+static int ChunkBuffered(RTMP *r) {
+    return ChunkSize(r, (const uint8_t *) r->m_sb.sb_start, r->m_sb.sb_size, NULL)
+            <= r->m_sb.sb_size;
+}
+
+/*
+ * @brief consume whatever the receive buffer holds for the current stage
+ */
+static int ParseNB(RTMP *r) {
+    char serversig[RTMP_SIG_SIZE];
+
+    while (RTMP_IsConnected(r)) {
+        RTMPPacket packet = {0};
+
+        switch (r->m_nbState) {
+            case RTMP_NB_HANDSHAKE:
+                if (r->m_sb.sb_size < RTMP_SIG_SIZE + 1)
+                    return TRUE;
+                ReadN(r, serversig, 1);
+                if (serversig[0] != 0x03)
+                    RTMP_Log(RTMP_LOGWARNING, "%s: Type mismatch: client sent 3, server answered %d",
+                            __FUNCTION__, serversig[0]);
+                ReadN(r, serversig, RTMP_SIG_SIZE);
+                RTMP_Log(RTMP_LOGDEBUG, "%s: FMS Version   : %d.%d.%d.%d", __FUNCTION__,
+                        serversig[4], serversig[5], serversig[6], serversig[7]);
+                r->m_nbState = RTMP_NB_HANDSHAKE2;
+                if (!WriteN(r, serversig, RTMP_SIG_SIZE))
+                    return FALSE;
+                break;
+
+            case RTMP_NB_HANDSHAKE2:
+                /* the echo of C1 is not checked, HandShake only warns about it */
+                if (r->m_sb.sb_size < RTMP_SIG_SIZE)
+                    return TRUE;
+                ReadN(r, serversig, RTMP_SIG_SIZE);
+                RTMP_Log(RTMP_LOGDEBUG, "%s, handshaked", __FUNCTION__);
+                r->m_nbState = RTMP_NB_NETCONNECT;
+                if (!NetConnect(r, NULL))
+                    return FALSE;
+                break;
+
+            case RTMP_NB_NETCONNECT:
+            case RTMP_NB_READY:
+                if (!ChunkBuffered(r))
+                    return TRUE;
+                if (!RTMP_ReadPacketRef(r, &packet))
+                    return FALSE;
+                if (RTMPPacket_IsReady(&packet) && packet.m_nBodySize) {
+                    RTMP_ClientPacket(r, &packet);
+                    RTMPPacket_Free(&packet);
+                }
+                if (r->m_nbState == RTMP_NB_NETCONNECT && r->m_bPlaying) {
+                    RTMP_Log(RTMP_LOGDEBUG, "%s, stream ready after %ums", __FUNCTION__,
+                            RTMP_GetTime() - r->m_nbStamp);
+                    r->m_nbState = RTMP_NB_READY;
+                }
+                break;
+
+            default:
+                return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+int RTMP_ProcessNB(RTMP *r, int events) {
+    int state = r->m_nbState;
+
+    if (state <= RTMP_NB_IDLE)
+        return state;
+
+    if (state == RTMP_NB_TCP) {
+        if (events & RTMP_IO_WRITE) {
+            int err = 0;
+            socklen_t len = sizeof(err);
+
+            getsockopt(r->m_sb.sb_socket, SOL_SOCKET, SO_ERROR, (char *) &err, &len);
+            if (err) {
+                RTMP_Log(RTMP_LOGERROR, "%s, failed to connect socket. %d (%s)",
+                        __FUNCTION__, err, strerror(err));
+                goto fail;
+            }
+            RTMP_Log(RTMP_LOGDEBUG, "%s, ... connected, handshaking", __FUNCTION__);
+            if (!HandShakeNB(r))
+                goto fail;
+        }
+    } else {
+        if ((events & RTMP_IO_WRITE) && SockBufDrain(&r->m_sb) < 0) {
+            RTMP_Log(RTMP_LOGERROR, "%s, RTMP send error %d", __FUNCTION__, GetSockError());
+            goto fail;
+        }
+        if (events & RTMP_IO_READ) {
+            int nBytes;
+
+            do {
+                nBytes = FillNB(&r->m_sb);
+                if (nBytes < 0 || !ParseNB(r))
+                    goto fail;
+            } while (nBytes > 0);
+        }
+        if ((events & RTMP_IO_FILLED) && !ParseNB(r))
+            goto fail;
+    }
+
+    if (r->m_nbState < RTMP_NB_READY && r->Link.timeout > 0
+            && RTMP_GetTime() - r->m_nbStamp > (uint32_t) r->Link.timeout * 1000) {
+        RTMP_Log(RTMP_LOGERROR, "%s, timed out in stage %d", __FUNCTION__, r->m_nbState);
+        goto fail;
+    }
+    return r->m_nbState;
+
+fail:
+    r->m_nbState = RTMP_NB_FAILED;
+    return RTMP_NB_FAILED;
+}
+
+int RTMP_WantsNB(RTMP *r) {
+    if (r->m_nbState == RTMP_NB_TCP)
+        return RTMP_IO_WRITE;
+    if (r->m_nbState <= RTMP_NB_IDLE)
+        return 0;
+    return RTMP_IO_READ | (r->m_sb.sb_outLen ? RTMP_IO_WRITE : 0);
+}
+#endif
+
 static int
 SocksNegotiate(RTMP *r) {
     unsigned long addr;
-    struct sockaddr_in service;
-    memset(&service, 0, sizeof(struct sockaddr_in));
+    struct sockaddr_storage addrs[RTMP_DNS_MAX_ADDRS];
+    int i, n;
 
-    add_addr_info(&service, &r->Link.hostname, r->Link.port);
-    addr = htonl(service.sin_addr.s_addr);
+    n = ResolveHost(&r->Link.hostname, r->Link.port, addrs, RTMP_DNS_MAX_ADDRS);
+    /* SOCKS 4 only takes IPv4 */
+    for (i = 0; i < n && addrs[i].ss_family != AF_INET; i++);
+    if (i == n) {
+        RTMP_Log(RTMP_LOGERROR, "%s, no IPv4 address for the SOCKS proxy to connect to",
+                __FUNCTION__);
+        return FALSE;
+    }
+    addr = htonl(((struct sockaddr_in *) &addrs[i])->sin_addr.s_addr);
 
     {
         char packet[] = {
@@ -1076,6 +2239,82 @@ SocksNegotiate(RTMP *r) {
     }
 }
 
+/*
+ * @brief once connected, set up the stream, the replies lead on to publish or play
+ */
+static void SendStreamSetup(RTMP *r) {
+    if (r->Link.protocol & RTMP_FEATURE_WRITE) {
+        SendReleaseStream(r, &r->Link.playpath);
+        SendFCPublish(r, &r->Link.playpath);
+    }
+    else {
+        RTMP_SendServerBW(r);
+        RTMP_SendCtrl(r, 3, 0, 300);
+    }
+    RTMP_SendCreateStream(r);
+
+    if (!(r->Link.protocol & RTMP_FEATURE_WRITE)) {
+        /* Authenticate on Justin.tv legacy servers before sending FCSubscribe */
+        if (r->Link.usherToken.av_len)
+            SendUsherToken(r, &r->Link.usherToken);
+        /* Send the FCSubscribe if live stream or if subscribepath is set */
+        if (r->Link.subscribepath.av_len)
+            SendFCSubscribe(r, &r->Link.subscribepath);
+        else if (r->Link.lFlags & RTMP_LF_LIVE)
+            SendFCSubscribe(r, &r->Link.playpath);
+    }
+}
+
+int RTMP_ConnectStandby(RTMP *r) {
+    RTMPPacket packet = {0};
+
+    r->m_standby = RTMP_STANDBY_WAIT;
+    if (!RTMP_Connect(r, NULL))
+        return FALSE;
+
+    while (r->m_standby == RTMP_STANDBY_WAIT && RTMP_IsConnected(r)
+            && RTMP_ReadPacketRef(r, &packet)) {
+        if (RTMPPacket_IsReady(&packet)) {
+            if (!packet.m_nBodySize)
+                continue;
+            RTMP_ClientPacket(r, &packet);
+            RTMPPacket_Free(&packet);
+        }
+    }
+
+    if (r->m_standby != RTMP_STANDBY_READY) {
+        RTMP_Log(RTMP_LOGERROR, "%s, no result for connect", __FUNCTION__);
+        RTMP_Close(r);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+int RTMP_ServiceStandby(RTMP *r) {
+    RTMPPacket packet = {0};
+    struct pollfd pfd;
+
+    while (RTMP_IsConnected(r)) {
+        if (r->m_sb.sb_size <= 0) {
+            /* a hangup or error is readable too, the read below finds it */
+            pfd.fd = r->m_sb.sb_socket;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            if (poll(&pfd, 1, 0) <= 0)
+                break;
+        }
+        /* the rest of a half arrived packet is waited for */
+        if (!RTMP_ReadPacketRef(r, &packet))
+            break;
+        if (RTMPPacket_IsReady(&packet) && packet.m_nBodySize) {
+            RTMP_ClientPacket(r, &packet);
+            RTMPPacket_Free(&packet);
+        }
+    }
+    RTMPPacket_Free(&packet);
+    return RTMP_IsConnected(r);
+}
+
 /*
  * @brief After server received "createStream", send "_result" message to notify the status
  * of the client stream
@@ -1084,6 +2323,12 @@ SocksNegotiate(RTMP *r) {
 int RTMP_ConnectStream(RTMP *r, int seekTime) {
     RTMPPacket packet = {0};
 
+    /* a standby takes over */
+    if (r->m_standby == RTMP_STANDBY_READY) {
+        r->m_standby = 0;
+        SendStreamSetup(r);
+    }
+
     /* seekTime was already set by SetupStream / SetupURL.
    * This is only needed by ReconnectStream.
    */
@@ -1158,6 +2403,125 @@ RTMP_DeleteStream(RTMP *r) {
     r->m_stream_id = -1;
 }
 
+int RTMP_AddStreamStart(RTMP *r, const AVal *playpath) {
+    RTMP_Stream *st;
+    int i, channel = RTMP_STREAM_CHANNEL_BASE;
+
+    if (!RTMP_IsConnected(r) || !(r->Link.protocol & RTMP_FEATURE_WRITE)
+            || r->m_standby || !playpath->av_len)
+        return -1;
+
+    /* the lowest pair of chunk streams no other added stream has */
+    for (i = 0; i < r->m_numStreams; i++) {
+        if (r->m_streams[i].channel == channel) {
+            channel += 2;
+            i = -1;
+        }
+    }
+    if (!(st = realloc(r->m_streams, sizeof(RTMP_Stream) * (r->m_numStreams + 1))))
+        return -1;
+    r->m_streams = st;
+    i = r->m_numStreams;
+    st = &r->m_streams[i];
+    memset(st, 0, sizeof(RTMP_Stream));
+    if (!(st->playpath.av_val = malloc(playpath->av_len)))
+        return -1;
+    memcpy(st->playpath.av_val, playpath->av_val, playpath->av_len);
+    st->playpath.av_len = playpath->av_len;
+    st->channel = channel;
+    r->m_numStreams++;
+
+    if (!SendReleaseStream(r, playpath) || !SendFCPublish(r, playpath)
+            || !RTMP_SendCreateStream(r)) {
+        if (i < r->m_numStreams)
+            StreamDrop(r, i);
+        return -1;
+    }
+    st->txn = r->m_numInvokes;
+    return st->txn;
+}
+
+/*
+ * @brief index of the stream RTMP_AddStreamStart returned txn for, -1 once
+ * it was dropped
+ */
+static int StreamAdded(RTMP *r, int txn) {
+    int i;
+
+    for (i = 0; i < r->m_numStreams; i++)
+        if (r->m_streams[i].txn == txn)
+            return i;
+    return -1;
+}
+
+int RTMP_AddStreamStep(RTMP *r, int txn) {
+    RTMPPacket packet = {0};
+    RTMP_Stream *st;
+    int i, id;
+
+    /* closing drops the streams, look the stream up after every read */
+    if ((i = StreamAdded(r, txn)) < 0)
+        return -1;
+    if (r->m_streams[i].state == RTMP_STREAM_LIVE)
+        return r->m_streams[i].id;
+
+    if (r->m_streams[i].state >= RTMP_STREAM_CREATING && RTMP_IsConnected(r)
+            && RTMP_ReadPacket(r, &packet)) {
+        if (RTMPPacket_IsReady(&packet) && packet.m_nBodySize
+                && packet.m_packetType != RTMP_PACKET_TYPE_AUDIO
+                && packet.m_packetType != RTMP_PACKET_TYPE_VIDEO
+                && packet.m_packetType != RTMP_PACKET_TYPE_INFO)
+            RTMP_ClientPacket(r, &packet);
+        RTMP_FreeBody(r, &packet);
+        if ((i = StreamAdded(r, txn)) < 0)
+            return -1;
+        if (r->m_streams[i].state == RTMP_STREAM_LIVE)
+            return r->m_streams[i].id;
+        if (r->m_streams[i].state >= RTMP_STREAM_CREATING && RTMP_IsConnected(r))
+            return 0;
+    }
+
+    st = &r->m_streams[i];
+    RTMP_Log(RTMP_LOGERROR, "%s, could not publish %.*s", __FUNCTION__,
+            st->playpath.av_len, st->playpath.av_val);
+    id = st->id;
+    if (id > 0 && RTMP_IsConnected(r))
+        SendDeleteStream(r, id);
+    StreamDrop(r, i);
+    return -1;
+}
+
+int RTMP_AddStream(RTMP *r, const AVal *playpath) {
+    int txn, id;
+
+    if ((txn = RTMP_AddStreamStart(r, playpath)) < 0)
+        return -1;
+    while (!(id = RTMP_AddStreamStep(r, txn)))
+        ;
+    return id;
+}
+
+void RTMP_RemoveStream(RTMP *r, int streamId) {
+    RTMP_Stream *st = StreamFind(r, streamId);
+
+    if (!st)
+        return;
+    if (RTMP_IsConnected(r)) {
+        SendFCUnpublish(r, &st->playpath);
+        SendDeleteStream(r, streamId);
+    }
+    StreamDrop(r, st - r->m_streams);
+}
+
+int RTMP_StreamChannel(RTMP *r, int streamId, int type) {
+    RTMP_Stream *st = StreamFind(r, streamId);
+    int video = type == RTMP_PACKET_TYPE_VIDEO;
+
+    if (st)
+        return st->channel + video;
+    return video ? RTMP_CHANNEL_VIDEO : RTMP_CHANNEL_SOURCE;
+}
+
 /*
  * @brief get next media packet(audio, video or metadata)
  */
@@ -1195,8 +2559,7 @@ int RTMP_GetNextMediaPacket(RTMP *r, RTMPPacket *packet) {
     if (bHasMediaPacket)
         r->m_bPlaying = TRUE;
     else if (r->m_sb.sb_timedout && !r->m_pausing)
-        r->m_pauseStamp = r->m_mediaChannel < r->m_channelsAllocatedIn ?
-                r->m_channelTimestamp[r->m_mediaChannel] : 0;
+        r->m_pauseStamp = ChannelStamp(r, r->m_mediaChannel);
 
     return bHasMediaPacket;
 }
@@ -1291,7 +2654,8 @@ int RTMP_ClientPacket(RTMP *r, RTMPPacket *packet) {
 	   obj.Dump();
 #endif
 
-            if (HandleInvoke(r, packet->m_body + 1, packet->m_nBodySize - 1) == 1)
+            if (HandleInvoke(r, packet->m_body + 1, packet->m_nBodySize - 1,
+                    packet->m_nInfoField2) == 1)
                 bHasMediaPacket = 2;
             break;
         }
@@ -1314,7 +2678,7 @@ int RTMP_ClientPacket(RTMP *r, RTMPPacket *packet) {
                     packet->m_nBodySize);
             /*RTMP_LogHex(packet.m_body, packet.m_nBodySize); */
 
-            if (HandleInvoke(r, packet->m_body, packet->m_nBodySize) == 1)
+            if (HandleInvoke(r, packet->m_body, packet->m_nBodySize, packet->m_nInfoField2) == 1)
                 bHasMediaPacket = 2;
             break;
 
@@ -1363,6 +2727,17 @@ extern FILE *netstackdump;
 extern FILE *netstackdump_read;
 #endif
 
+/*
+ * @brief count n bytes received, acknowledge them once the window asks for it
+ */
+static int BytesIn(RTMP *r, int n) {
+    r->m_nBytesIn += n;
+    if (r->m_bSendCounter
+            && r->m_nBytesIn > (r->m_nBytesInSent + r->m_nClientBW / 10))
+        return SendBytesReceived(r);
+    return TRUE;
+}
+
 /*
  * @brief Read n byte data from HTTP or socket, store in buffer.
  */
@@ -1428,9 +2803,7 @@ static int ReadN(RTMP *r, char *buffer, int n) {
             r->m_sb.sb_start += nRead;
             r->m_sb.sb_size -= nRead;
             nBytes = nRead;
-            r->m_nBytesIn += nRead;
-            if (r->m_bSendCounter
-                    && r->m_nBytesIn > (r->m_nBytesInSent + r->m_nClientBW / 10)) if (!SendBytesReceived(r))
+            if (!BytesIn(r, nRead))
                 return FALSE;
         }
         /*RTMP_Log(RTMP_LOGDEBUG, "%s: %d bytes\n", __FUNCTION__, nBytes); */
@@ -1470,22 +2843,7 @@ static int ReadN(RTMP *r, char *buffer, int n) {
  *
  * @return true: success / false: fail
  */
-static int WriteN(RTMP *r, const char *buffer, int n) {
-    const char *ptr = buffer;
-#ifdef CRYPTO
-    char *encrypted = 0;
-    char buf[RTMP_BUFFER_CACHE_SIZE];
-
-    if (r->Link.rc4keyOut) {
-        if (n > sizeof(buf))
-            encrypted = (char *) malloc(n);
-        else
-            encrypted = (char *) buf;
-        ptr = encrypted;
-        RC4_encrypt2(r->Link.rc4keyOut, n, buffer, ptr);
-    }
-#endif
-
+static int WriteRaw(RTMP *r, const char *ptr, int n) {
     while (n > 0) {
         int nBytes;
 
@@ -1515,14 +2873,122 @@ static int WriteN(RTMP *r, const char *buffer, int n) {
         ptr += nBytes;
     }
 
+    return n == 0;
+}
+
 #ifdef CRYPTO
-    if (encrypted && encrypted != buf)
-        free(encrypted);
+/*
+ * @brief encrypt data onto the end of slice, sending the slice each time it fills
+ *
+ * RC4 runs over the stream in order, so how it is sliced does not change
+ * what goes on the wire.
+ */
+static int EncryptSlice(RTMP *r, char *slice, int *len, const char *data, int n) {
+    while (n > 0) {
+        int take = RTMP_BUFFER_CACHE_SIZE - *len;
+
+        if (take > n)
+            take = n;
+        RC4_encrypt2(r->Link.rc4keyOut, take, data, slice + *len);
+        *len += take;
+        data += take;
+        n -= take;
+        if (*len == RTMP_BUFFER_CACHE_SIZE) {
+            if (!WriteRaw(r, slice, *len))
+                return FALSE;
+            *len = 0;
+        }
+    }
+    return TRUE;
+}
 #endif
 
-    return n == 0;
+/*
+ * @brief send data, on RTMPE connections encrypted on the way without
+ * allocating per call
+ */
+static int WriteN(RTMP *r, const char *buffer, int n) {
+#ifdef CRYPTO
+    if (r->Link.rc4keyOut) {
+        char slice[RTMP_BUFFER_CACHE_SIZE];
+        int len = 0;
+
+        /* an RTMPTE request goes out whole, through a buffer kept for it */
+        if ((r->Link.protocol & RTMP_FEATURE_HTTP) && n > RTMP_BUFFER_CACHE_SIZE) {
+            if (n > r->Link.rc4BufSize) {
+                char *buf = realloc(r->Link.rc4Buf, n);
+                if (!buf)
+                    return FALSE;
+                r->Link.rc4Buf = buf;
+                r->Link.rc4BufSize = n;
+            }
+            RC4_encrypt2(r->Link.rc4keyOut, n, buffer, r->Link.rc4Buf);
+            return WriteRaw(r, r->Link.rc4Buf, n);
+        }
+        return EncryptSlice(r, slice, &len, buffer, n) && (!len || WriteRaw(r, slice, len));
+    }
+#endif
+    return WriteRaw(r, buffer, n);
 }
 
+#ifndef _WIN32
+/*
+ * @brief send scattered data, call RTMPSockBuf_SendV until all is sent
+ *
+ * @param[in] r: a RTMP connection
+ * @param[in] iov: data to be sent, advanced past what was sent
+ * @param[in] iovcnt: number of entries in iov
+ *
+ * @return true: success / false: fail
+ */
+static int WriteV(RTMP *r, struct iovec *iov, int iovcnt) {
+#ifdef CRYPTO
+    /* RTMPE, the chunks are encrypted into one slice after another */
+    if (r->Link.rc4keyOut) {
+        char slice[RTMP_BUFFER_CACHE_SIZE];
+        int len = 0;
+
+        for (; iovcnt > 0; iov++, iovcnt--) {
+            if (!EncryptSlice(r, slice, &len, iov->iov_base, iov->iov_len))
+                return FALSE;
+        }
+        return !len || WriteRaw(r, slice, len);
+    }
+#endif
+    while (iovcnt > 0) {
+        int nBytes = RTMPSockBuf_SendV(&r->m_sb, iov, iovcnt);
+
+        if (nBytes < 0) {
+            int sockerr = GetSockError();
+            RTMP_Log(RTMP_LOGERROR, "%s, RTMP send error %d (%d iovecs)", __FUNCTION__,
+                    sockerr, iovcnt);
+
+            if (sockerr == EINTR && !RTMP_ctrlC)
+                continue;
+
+            RTMP_Close(r);
+            return FALSE;
+        }
+
+        if (nBytes == 0)
+            return FALSE;
+
+        /* skip what went out, a partial send leaves us inside an entry */
+        while (iovcnt > 0 && (size_t) nBytes >= iov->iov_len) {
+            nBytes -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + nBytes;
+            iov->iov_len -= nBytes;
+        }
+    }
+
+    return TRUE;
+}
+#endif
+
 #define SAVC(x)    static const AVal av_##x = AVC(#x)
 
 SAVC(app);
@@ -1539,6 +3005,7 @@ SAVC(videoFunction);
 SAVC(objectEncoding);
 SAVC(secureToken);
 SAVC(secureTokenResponse);
+SAVC(fmsVer);
 SAVC(type);
 SAVC(nonprivate);
 
@@ -1801,7 +3268,7 @@ SAVC(releaseStream);
 /*
  * @brief send release stream command
  */
-static int SendReleaseStream(RTMP *r) {
+static int SendReleaseStream(RTMP *r, const AVal *playpath) {
     RTMPPacket packet;
     char pbuf[1024], *pend = pbuf + sizeof(pbuf);
     char *enc;
@@ -1818,7 +3285,7 @@ static int SendReleaseStream(RTMP *r) {
     enc = AMF_EncodeString(enc, pend, &av_releaseStream);
     enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
     *enc++ = AMF_NULL;
-    enc = AMF_EncodeString(enc, pend, &r->Link.playpath);
+    enc = AMF_EncodeString(enc, pend, playpath);
     if (!enc)
         return FALSE;
 
@@ -1832,7 +3299,7 @@ SAVC(FCPublish);
 /*
  * @brief send FCPublish command
  */
-static int SendFCPublish(RTMP *r) {
+static int SendFCPublish(RTMP *r, const AVal *playpath) {
     RTMPPacket packet;
     char pbuf[1024], *pend = pbuf + sizeof(pbuf);
     char *enc;
@@ -1849,7 +3316,7 @@ static int SendFCPublish(RTMP *r) {
     enc = AMF_EncodeString(enc, pend, &av_FCPublish);
     enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
     *enc++ = AMF_NULL;
-    enc = AMF_EncodeString(enc, pend, &r->Link.playpath);
+    enc = AMF_EncodeString(enc, pend, playpath);
     if (!enc)
         return FALSE;
 
@@ -1863,7 +3330,7 @@ SAVC(FCUnpublish);
 /*
  * @brief send FCUnpublish command
  */
-static int SendFCUnpublish(RTMP *r) {
+static int SendFCUnpublish(RTMP *r, const AVal *playpath) {
     RTMPPacket packet;
     char pbuf[1024], *pend = pbuf + sizeof(pbuf);
     char *enc;
@@ -1880,7 +3347,7 @@ static int SendFCUnpublish(RTMP *r) {
     enc = AMF_EncodeString(enc, pend, &av_FCUnpublish);
     enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
     *enc++ = AMF_NULL;
-    enc = AMF_EncodeString(enc, pend, &r->Link.playpath);
+    enc = AMF_EncodeString(enc, pend, playpath);
     if (!enc)
         return FALSE;
 
@@ -1896,16 +3363,16 @@ SAVC(record);
 /*
  * @brief send Publish command
  */
-static int SendPublish(RTMP *r) {
+static int SendPublish(RTMP *r, const AVal *playpath, int streamId) {
     RTMPPacket packet;
     char pbuf[1024], *pend = pbuf + sizeof(pbuf);
     char *enc;
 
-    packet.m_nChannel = 0x04;    /* source channel (invoke) */
+    packet.m_nChannel = RTMP_StreamChannel(r, streamId, RTMP_PACKET_TYPE_INVOKE);    /* source channel (invoke) */
     packet.m_headerType = RTMP_PACKET_SIZE_LARGE;
     packet.m_packetType = RTMP_PACKET_TYPE_INVOKE;
     packet.m_nTimeStamp = 0;
-    packet.m_nInfoField2 = r->m_stream_id;
+    packet.m_nInfoField2 = streamId;
     packet.m_hasAbsTimestamp = 0;
     packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
 
@@ -1913,7 +3380,7 @@ static int SendPublish(RTMP *r) {
     enc = AMF_EncodeString(enc, pend, &av_publish);
     enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
     *enc++ = AMF_NULL;
-    enc = AMF_EncodeString(enc, pend, &r->Link.playpath);
+    enc = AMF_EncodeString(enc, pend, playpath);
     if (!enc)
         return FALSE;
 
@@ -1990,8 +3457,7 @@ int RTMP_SendPause(RTMP *r, int DoPause, int iTime) {
 
 int RTMP_Pause(RTMP *r, int DoPause) {
     if (DoPause)
-        r->m_pauseStamp = r->m_mediaChannel < r->m_channelsAllocatedIn ?
-                r->m_channelTimestamp[r->m_mediaChannel] : 0;
+        r->m_pauseStamp = ChannelStamp(r, r->m_mediaChannel);
     return RTMP_SendPause(r, DoPause, r->m_pauseStamp);
 }
 
@@ -2050,6 +3516,81 @@ int RTMP_SendServerBW(RTMP *r) {
     return RTMP_SendPacket(r, &packet, FALSE);
 }
 
+/*
+ * @brief send Set Chunk Size, the new size applies to every message after it
+ */
+int RTMP_SendChunkSize(RTMP *r, int size) {
+    RTMPPacket packet;
+    char pbuf[256], *pend = pbuf + sizeof(pbuf);
+
+    packet.m_nChannel = 0x02;    /* control channel (invoke) */
+    packet.m_headerType = RTMP_PACKET_SIZE_LARGE;
+    packet.m_packetType = RTMP_PACKET_TYPE_CHUNK_SIZE;
+    packet.m_nTimeStamp = 0;
+    packet.m_nInfoField2 = 0;
+    packet.m_hasAbsTimestamp = 0;
+    packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
+
+    packet.m_nBodySize = 4;
+
+    AMF_EncodeInt32(packet.m_body, pend, size & 0x7fffffff);
+    if (!RTMP_SendPacket(r, &packet, FALSE))
+        return FALSE;
+
+    RTMP_Log(RTMP_LOGDEBUG, "%s, chunk size change from %d to %d", __FUNCTION__,
+            r->m_outChunkSize, size);
+    r->m_outChunkSize = size;
+    r->m_chunkSizeStamp = RTMP_GetTime();
+    return TRUE;
+}
+
+/* min time between two adaptive chunk size changes */
+#define RTMP_CHUNKSIZE_INTERVAL    2000
+
+/*
+ * @brief pick an outbound chunk size for the media sent so far
+ *
+ * A typical video frame should fit in one chunk, but one chunk must not take
+ * longer than the chunk budget at the estimated bandwidth so audio is not
+ * held up behind it. Sizes are powers of two.
+ */
+static int ChooseChunkSize(RTMP *r) {
+    double limit = r->m_avgVideoSize;
+    double budget = r->m_bwe.stats.bandwidth * r->m_chunkBudgetMS / 1000;
+    int size = RTMP_DEFAULT_CHUNKSIZE;
+
+    if (budget > 0 && budget < limit)
+        limit = budget;
+    while (size * 2 <= limit && size < RTMP_CHUNKSIZE_MAX)
+        size *= 2;
+    return size;
+}
+
+/*
+ * @brief renegotiate the outbound chunk size before a media message when the
+ * best size moved by at least a factor of two
+ */
+static int AdaptChunkSize(RTMP *r, const RTMPPacket *packet) {
+    int size;
+
+    if (packet->m_packetType == RTMP_PACKET_TYPE_VIDEO) {
+        if (!r->m_avgVideoSize)
+            r->m_avgVideoSize = packet->m_nBodySize;
+        else
+            r->m_avgVideoSize += ((int) packet->m_nBodySize - r->m_avgVideoSize) / 8;
+    }
+
+    /* not while a message is half sent, it ends in the size it began with */
+    if (r->m_chunkBudgetMS <= 0 || !r->m_avgVideoSize || r->m_outInFlight
+            || RTMP_GetTime() - r->m_chunkSizeStamp < RTMP_CHUNKSIZE_INTERVAL)
+        return TRUE;
+
+    size = ChooseChunkSize(r);
+    if (size >= r->m_outChunkSize * 2 || size * 2 <= r->m_outChunkSize)
+        return RTMP_SendChunkSize(r, size);
+    return TRUE;
+}
+
 /*
  * @brief After client handled the BW message, send Window Acknowledgement Size message to server.
  * send ClientBW command (the other end bandwidth)
@@ -2878,6 +4419,7 @@ SAVC(_error);
 SAVC(close);
 SAVC(code);
 SAVC(level);
+SAVC(error);
 SAVC(description);
 SAVC(onStatus);
 SAVC(playlist_ready);
@@ -2900,6 +4442,23 @@ static const AVal av_NetStream_Publish_Start = AVC("NetStream.Publish.Start");
 static const AVal av_NetConnection_Connect_Rejected =
         AVC("NetConnection.Connect.Rejected");
 
+/*
+ * @brief whether the server unpacks aggregate messages
+ *
+ * There is no capability for it. FMS and the servers answering connect
+ * with an FMS version do, the rest get tags one by one.
+ */
+static int AggregateSupported(AMFObject *obj) {
+    AMFObjectProperty p;
+
+    if (RTMP_FindFirstMatchingProperty(obj, &av_fmsVer, &p) && p.p_type == AMF_STRING
+            && p.p_vu.p_aval.av_len >= 4 && !memcmp(p.p_vu.p_aval.av_val, "FMS/", 4))
+        return TRUE;
+    RTMP_Log(RTMP_LOGINFO, "%s, server may not take aggregate messages, sending tags alone",
+            __FUNCTION__);
+    return FALSE;
+}
+
 /* Returns 0 for OK/Failed/error, 1 for 'Stop or Complete' */
 /*
  * @brief handle server send AMF0 encode command
@@ -2907,7 +4466,7 @@ static const AVal av_NetConnection_Connect_Rejected =
  * 2) call AMFProp_GetString() to get true command string
  * 3) call AVMATCH() to compare string, different commands do different handles
  */
-static int HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize) {
+static int HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize, int streamId) {
     AMFObject obj;
     AVal method;
     double txn;
@@ -2932,6 +4491,7 @@ static int HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize) {
 
     if (AVMATCH(&method, &av__result)) {
         AVal methodInvoked = {0};
+        RTMP_Stream *st;
         int i;
 
         for (i = 0; i < r->m_numCalls; i++) {
@@ -2958,32 +4518,25 @@ static int HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize) {
                     SendSecureTokenResponse(r, &p.p_vu.p_aval);
                 }
             }
-            if (r->Link.protocol & RTMP_FEATURE_WRITE) {
-                SendReleaseStream(r);
-                SendFCPublish(r);
-            }
-            else {
-                RTMP_SendServerBW(r);
-                RTMP_SendCtrl(r, 3, 0, 300);
-            }
-            RTMP_SendCreateStream(r);
-
-            if (!(r->Link.protocol & RTMP_FEATURE_WRITE)) {
-                /* Authenticate on Justin.tv legacy servers before sending FCSubscribe */
-                if (r->Link.usherToken.av_len)
-                    SendUsherToken(r, &r->Link.usherToken);
-                /* Send the FCSubscribe if live stream or if subscribepath is set */
-                if (r->Link.subscribepath.av_len)
-                    SendFCSubscribe(r, &r->Link.subscribepath);
-                else if (r->Link.lFlags & RTMP_LF_LIVE)
-                    SendFCSubscribe(r, &r->Link.playpath);
-            }
+            if (r->m_aggregateMS > 0)
+                r->m_aggregate = AggregateSupported(&obj);
+            /* a standby holds the stream back until it takes over */
+            if (r->m_standby)
+                r->m_standby = RTMP_STANDBY_READY;
+            else if (!FastStart(r))
+                SendStreamSetup(r);
+        }
+        else if (AVMATCH(&methodInvoked, &av_createStream)
+                && (st = StreamByTxn(r, (int) txn))) {
+            st->id = (int) AMFProp_GetNumber(AMF_GetProp(&obj, NULL, 3));
+            st->state = SendPublish(r, &st->playpath, st->id)
+                    ? RTMP_STREAM_PUBLISHING : RTMP_STREAM_FAILED;
         }
         else if (AVMATCH(&methodInvoked, &av_createStream)) {
             r->m_stream_id = (int) AMFProp_GetNumber(AMF_GetProp(&obj, NULL, 3));
 
             if (r->Link.protocol & RTMP_FEATURE_WRITE) {
-                SendPublish(r);
+                SendPublish(r, &r->Link.playpath, r->m_stream_id);
             }
             else {
                 if (r->Link.lFlags & RTMP_LF_PLST)
@@ -3024,6 +4577,11 @@ static int HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize) {
             }
     }
     else if (AVMATCH(&method, &av__error)) {
+        RTMP_Stream *st = StreamByTxn(r, (int) txn);
+
+        /* an added stream failing leaves the rest alone */
+        if (st)
+            st->state = RTMP_STREAM_FAILED;
 #ifdef CRYPTO
         AVal methodInvoked = {0};
         int i;
@@ -3076,18 +4634,31 @@ static int HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize) {
     else if (AVMATCH(&method, &av_onStatus)) {
         AMFObject obj2;
         AVal code, level;
+        RTMP_Stream *st;
         AMFProp_GetObject(AMF_GetProp(&obj, NULL, 3), &obj2);
         AMFProp_GetString(AMF_GetProp(&obj2, &av_code, -1), &code);
         AMFProp_GetString(AMF_GetProp(&obj2, &av_level, -1), &level);
 
         RTMP_Log(RTMP_LOGDEBUG, "%s, onStatus: %s", __FUNCTION__, code.av_val);
-        if (AVMATCH(&code, &av_NetStream_Failed)
+        if ((st = StreamFind(r, streamId))) {
+            if (AVMATCH(&code, &av_NetStream_Publish_Start)) {
+                if (st->state == RTMP_STREAM_PUBLISHING)
+                    st->state = RTMP_STREAM_LIVE;
+            }
+            else if (AVMATCH(&level, &av_error)) {
+                RTMP_Log(RTMP_LOGERROR, "%s, stream %d: %s", __FUNCTION__, streamId,
+                        code.av_val);
+                if (st->state != RTMP_STREAM_LIVE)
+                    st->state = RTMP_STREAM_FAILED;
+            }
+        }
+        else if (AVMATCH(&code, &av_NetStream_Failed)
                 || AVMATCH(&code, &av_NetStream_Play_Failed)
                 || AVMATCH(&code, &av_NetStream_Play_StreamNotFound)
                 || AVMATCH(&code, &av_NetConnection_Connect_InvalidApp)) {
             r->m_stream_id = -1;
-            RTMP_Close(r);
             RTMP_Log(RTMP_LOGERROR, "Closing connection: %s", code.av_val);
+            RTMP_Close(r);
         }
 
         else if (AVMATCH(&code, &av_NetStream_Play_Start)
@@ -3390,8 +4961,7 @@ static void HandleCtrl(RTMP *r, const RTMPPacket *packet) {
                 if (!(r->Link.lFlags & RTMP_LF_BUFX))
                     break;
                 if (!r->m_pausing) {
-                    r->m_pauseStamp = r->m_mediaChannel < r->m_channelsAllocatedIn ?
-                            r->m_channelTimestamp[r->m_mediaChannel] : 0;
+                    r->m_pauseStamp = ChannelStamp(r, r->m_mediaChannel);
                     RTMP_SendPause(r, TRUE, r->m_pauseStamp);
                     r->m_pausing = 1;
                 }
@@ -3488,6 +5058,108 @@ static int EncodeInt32LE(char *output, int nVal) {
     return 4;
 }
 
+/*
+ * @brief size of the chunk at p, header and payload, once avail covers
+ * its header, else how much has to be there to tell
+ * @param[out] hSize: the header size, 0 while avail does not cover it
+ */
+static int ChunkSize(RTMP *r, const uint8_t *p, int avail, int *hSize) {
+    int fmt, channel, basic = 1, size, nToRead = 0;
+    uint32_t timestamp = 0;
+    const RTMPPacket *prev;
+    const RTMP_Channel *ch;
+
+    if (hSize)
+        *hSize = 0;
+    if (avail < 1)
+        return 1;
+    fmt = p[0] >> 6;
+    channel = p[0] & 0x3f;
+    if (channel == 0) {
+        if (avail < 2)
+            return 2;
+        channel = p[1] + 64;
+        basic = 2;
+    } else if (channel == 1) {
+        if (avail < 3)
+            return 3;
+        channel = (p[2] << 8) + p[1] + 64;
+        basic = 3;
+    }
+    size = basic + packetSize[fmt] - 1;
+    if (avail < size)
+        return size;
+
+    /* fmt 2 and 3 carry on from the last chunk on this channel */
+    ch = ChannelFind(r, channel, FALSE);
+    prev = ch ? ch->in : NULL;
+    if (prev && fmt > 0) {
+        timestamp = prev->m_nTimeStamp;
+        if (fmt > 1)
+            nToRead = prev->m_nBodySize - prev->m_nBytesRead;
+    }
+    if (fmt < 3)
+        timestamp = AMF_DecodeInt24((const char *) p + basic);
+    if (fmt < 2)
+        nToRead = AMF_DecodeInt24((const char *) p + basic + 3);
+
+    if (timestamp == 0xffffff) {
+        size += 4;
+        if (avail < size)
+            return size;
+    }
+    if (hSize)
+        *hSize = size;
+    if (nToRead > r->m_inChunkSize)
+        nToRead = r->m_inChunkSize;
+    return size + (nToRead > 0 ? nToRead : 0);
+}
+
+/*
+ * @brief take n bytes used in place off the receive buffer
+ */
+static int SockBufConsume(RTMP *r, int n) {
+    r->m_sb.sb_start += n;
+    r->m_sb.sb_size -= n;
+    return BytesIn(r, n);
+}
+
+/*
+ * @brief read until the next chunk sits whole in the receive buffer, moving
+ * what is there to the front when the chunk would run past its end
+ * @return TRUE when it does, FALSE if it cannot fit / -1 if the read failed
+ */
+static int SockBufWholeChunk(RTMP *r) {
+    RTMPSockBuf *sb = &r->m_sb;
+    int need;
+
+    while ((need = ChunkSize(r, (uint8_t *) sb->sb_start, sb->sb_size, NULL)) > sb->sb_size) {
+        if (need > RTMP_BUFFER_CACHE_SIZE - 1 - RTMP_MAX_HEADER_SIZE)
+            return FALSE;
+        if (RTMPSockBuf_Reserve(sb, need - sb->sb_size) < need - sb->sb_size) {
+            RTMP_Close(r);
+            return -1;
+        }
+        if (RTMPSockBuf_Fill(sb) < 1) {
+            if (!sb->sb_timedout)
+                RTMP_Close(r);
+            return -1;
+        }
+    }
+    return TRUE;
+}
+
+/*
+ * @brief drop the body of packet as a new message starts on its channel
+ */
+static void ReleaseBody(RTMP *r, RTMPPacket *packet) {
+    /* one cut short goes back, a lent one went back already */
+    if (packet->m_body && packet->m_bodyPool == RTMP_BODY_POOLED
+            && packet->m_nBytesRead < packet->m_nBodySize)
+        SlabPut(r, packet->m_body);
+    RTMP_FreeBody(r, packet);
+}
+
 /*
  * @brief read received message chunk, store in packet. Don't do anything to the message.
  *
@@ -3501,48 +5173,75 @@ static int EncodeInt32LE(char *output, int nVal) {
  * There is no other bytes to mean stream id. 3 -- 63 means completed stream id
  *
  * A complete chunk msg header can be divided into: |timestamp(3 bytes)| msg length (3 bytes) | msg type id (1 byte, little-endian) | msg stream id (4 byte) |
+ *
+ * A header the receive buffer holds whole is parsed where it is, else it
+ * is read piece by piece. With lend set the body is lent, see RTMP_ReadPacketRef.
  */
-int RTMP_ReadPacket(RTMP *r, RTMPPacket *packet) {
+static int ReadPacket(RTMP *r, RTMPPacket *packet, int lend) {
     uint8_t hbuf[RTMP_MAX_HEADER_SIZE] = {0}; // max Chunk header length is 3 + 11 + 4 = 18
-    char *header = (char *) hbuf; // header is pointed to socket received data
+    uint8_t *hp = hbuf; // the chunk header, in place in sb_buf or read into hbuf
+    char *header; // header is pointed to socket received data
     int nSize, hSize, nToRead, nChunk; // nSize is chunk message header length, hSize is chunk header length
-    int didAlloc = FALSE;
+    int direct = 0, inPlace = FALSE;
     int extendedTimestamp;
+    RTMP_Channel *ch;
 
     RTMP_Log(RTMP_LOGDEBUG2, "%s: fd=%d", __FUNCTION__, r->m_sb.sb_socket);
 
-    // Read 1 byte to hbuf[0]
-    if (ReadN(r, (char *) hbuf, 1) == 0) {
+    /* what the last call lent is given back */
+    if (lend && r->m_rxLent) {
+        SlabPut(r, r->m_rxLent);
+        r->m_rxLent = NULL;
+    }
+
+    /* RTMPT responses and RTMPE decryption need ReadN */
+    if (!(r->Link.protocol & RTMP_FEATURE_HTTP)
+#ifdef CRYPTO
+            && !r->Link.rc4keyIn
+#endif
+            ) {
+        if (lend && SockBufWholeChunk(r) < 0) {
+            RTMP_Log(RTMP_LOGERROR, "%s, failed to read RTMP packet", __FUNCTION__);
+            return FALSE;
+        }
+        ChunkSize(r, (uint8_t *) r->m_sb.sb_start, r->m_sb.sb_size, &direct);
+        if (direct)
+            hp = (uint8_t *) r->m_sb.sb_start;
+    }
+    header = (char *) hp;
+
+    // Read 1 byte to hp[0]
+    if (!direct && ReadN(r, (char *) hbuf, 1) == 0) {
         RTMP_Log(RTMP_LOGERROR, "%s, failed to read RTMP packet header", __FUNCTION__);
         return FALSE;
     }
 
-    packet->m_headerType = (hbuf[0] & 0xc0) >> 6; // chunk type fmt
-    packet->m_nChannel = (hbuf[0] & 0x3f); // chunk stream id (2 - 63)
+    packet->m_headerType = (hp[0] & 0xc0) >> 6; // chunk type fmt
+    packet->m_nChannel = (hp[0] & 0x3f); // chunk stream id (2 - 63)
     header++;
     // the first byte of chunk stream id is 0, means chunk stream id is 2 byte, means id range is 64 - 319 (the second byte + 64)
     if (packet->m_nChannel == 0) {
-        // read next 1 byte to hbuf[1]
-        if (ReadN(r, (char *) &hbuf[1], 1) != 1) {
+        // read next 1 byte to hp[1]
+        if (!direct && ReadN(r, (char *) &hbuf[1], 1) != 1) {
             RTMP_Log(RTMP_LOGERROR, "%s, failed to read RTMP packet header 2nd byte",
                     __FUNCTION__);
             return FALSE;
         }
-        // chunk stream id = the second byte + 64 = hbuf[1] + 64
-        packet->m_nChannel = hbuf[1];
+        // chunk stream id = the second byte + 64 = hp[1] + 64
+        packet->m_nChannel = hp[1];
         packet->m_nChannel += 64;
         header++;
     } else if (packet->m_nChannel == 1) {
         // The first byte of chunk stream id is 1, means chunk stream id is 3 bytes, means id range 64 - 65599(the third byte * 256 + the second byte + 64)
         int tmp;
-        // reand 2 bytes to hbuf[1] and hbuf[2]
-        if (ReadN(r, (char *) &hbuf[1], 2) != 2) {
+        // reand 2 bytes to hp[1] and hp[2]
+        if (!direct && ReadN(r, (char *) &hbuf[1], 2) != 2) {
             RTMP_Log(RTMP_LOGERROR, "%s, failed to read RTMP packet header 3nd byte",
                     __FUNCTION__);
             return FALSE;
         }
         // chunk stream id = third byte * 256 + second byte + 64
-        tmp = (hbuf[2] << 8) + hbuf[1];
+        tmp = (hp[2] << 8) + hp[1];
         packet->m_nChannel = tmp + 64;
         RTMP_Log(RTMP_LOGDEBUG, "%s, m_nChannel: %0x", __FUNCTION__, packet->m_nChannel);
         header += 2;
@@ -3552,25 +5251,9 @@ int RTMP_ReadPacket(RTMP *r, RTMPPacket *packet) {
     // chunk header = BasicHeader(1-3 bytes) + ChunkMsgHeader + ExtendTimestamp(0 or 4 bytes)
     nSize = packetSize[packet->m_headerType];
 
-    if (packet->m_nChannel >= r->m_channelsAllocatedIn) {
-        int n = packet->m_nChannel + 10;
-        int *timestamp = realloc(r->m_channelTimestamp, sizeof(int) * n);
-        RTMPPacket **packets = realloc(r->m_vecChannelsIn, sizeof(RTMPPacket *) * n);
-        if (!timestamp) {
-            free(r->m_channelTimestamp);
-        }
-        if (!packets) {
-            free(r->m_vecChannelsIn);
-        }
-        r->m_channelTimestamp = timestamp;
-        r->m_vecChannelsIn = packets;
-        if (!timestamp || !packets) {
-            r->m_channelsAllocatedIn = 0;
-            return FALSE;
-        }
-        memset(r->m_channelTimestamp + r->m_channelsAllocatedIn, 0, sizeof(int) * (n - r->m_channelsAllocatedIn));
-        memset(r->m_vecChannelsIn + r->m_channelsAllocatedIn, 0, sizeof(RTMPPacket *) * (n - r->m_channelsAllocatedIn));
-        r->m_channelsAllocatedIn = n;
+    if (!(ch = ChannelFind(r, packet->m_nChannel, TRUE))) {
+        RTMP_Log(RTMP_LOGERROR, "%s, failed to allocate channel %d", __FUNCTION__, packet->m_nChannel);
+        return FALSE;
     }
 
     // chunk type fmt is 0,
@@ -3578,20 +5261,19 @@ int RTMP_ReadPacket(RTMP *r, RTMPPacket *packet) {
         /* if we get a full header the timestamp is absolute */
         packet->m_hasAbsTimestamp = TRUE;
     } else if (nSize < RTMP_LARGE_HEADER_SIZE) {                /* using values from the last message of this channel */
-        if (r->m_vecChannelsIn[packet->m_nChannel])
-            memcpy(packet, r->m_vecChannelsIn[packet->m_nChannel],
-                    sizeof(RTMPPacket));
+        if (ch->in)
+            memcpy(packet, ch->in, sizeof(RTMPPacket));
     }
 
     nSize--;
 
-    if (nSize > 0 && ReadN(r, header, nSize) != nSize) {
+    if (nSize > 0 && !direct && ReadN(r, header, nSize) != nSize) {
         RTMP_Log(RTMP_LOGERROR, "%s, failed to read RTMP packet header. type: %x",
-                __FUNCTION__, (unsigned int) hbuf[0]);
+                __FUNCTION__, (unsigned int) hp[0]);
         return FALSE;
     }
 
-    hSize = nSize + (header - (char *) hbuf);
+    hSize = nSize + (header - (char *) hp);
 
     if (nSize >= 3) {
         packet->m_nTimeStamp = AMF_DecodeInt24(header);
@@ -3599,9 +5281,9 @@ int RTMP_ReadPacket(RTMP *r, RTMPPacket *packet) {
         /*RTMP_Log(RTMP_LOGDEBUG, "%s, reading RTMP packet chunk on channel %x, headersz %i, timestamp %i, abs timestamp %i", __FUNCTION__, packet.m_nChannel, nSize, packet.m_nTimeStamp, packet.m_hasAbsTimestamp); */
 
         if (nSize >= 6) {
+            ReleaseBody(r, packet);
             packet->m_nBodySize = AMF_DecodeInt24(header + 3);
             packet->m_nBytesRead = 0;
-            RTMPPacket_Free(packet);
 
             if (nSize > 6) {
                 packet->m_packetType = header[6];
@@ -3614,7 +5296,7 @@ int RTMP_ReadPacket(RTMP *r, RTMPPacket *packet) {
 
     extendedTimestamp = packet->m_nTimeStamp == 0xffffff;
     if (extendedTimestamp) {
-        if (ReadN(r, header + nSize, 4) != 4) {
+        if (!direct && ReadN(r, header + nSize, 4) != 4) {
             RTMP_Log(RTMP_LOGERROR, "%s, failed to read extended timestamp",
                     __FUNCTION__);
             return FALSE;
@@ -3623,31 +5305,55 @@ int RTMP_ReadPacket(RTMP *r, RTMPPacket *packet) {
         hSize += 4;
     }
 
-    RTMP_LogHexString(RTMP_LOGDEBUG2, (uint8_t *) hbuf, hSize);
+    if (direct) {
+        /* only fmt 3 on a channel never seen could tell otherwise */
+        if (hSize != direct) {
+            RTMP_Log(RTMP_LOGERROR, "%s, RTMP packet header on unknown channel %d",
+                    __FUNCTION__, packet->m_nChannel);
+            return FALSE;
+        }
+        if (!SockBufConsume(r, hSize))
+            return FALSE;
+    }
+
+    RTMP_LogHexString(RTMP_LOGDEBUG2, hp, hSize);
+
+    nToRead = packet->m_nBodySize - packet->m_nBytesRead;
+    nChunk = r->m_inChunkSize;
+    if (nToRead < nChunk)
+        nChunk = nToRead;
 
     if (packet->m_nBodySize > 0 && packet->m_body == NULL) {
-        if (!RTMPPacket_Alloc(packet, packet->m_nBodySize)) {
+        /* a message in one buffered chunk is lent where it lies, if a header fits in front */
+        if (lend && direct && nChunk == (int) packet->m_nBodySize && r->m_sb.sb_size >= nChunk
+                && r->m_sb.sb_start - r->m_sb.sb_buf >= RTMP_MAX_HEADER_SIZE) {
+            packet->m_body = r->m_sb.sb_start;
+            packet->m_bodyPool = RTMP_BODY_SOCKBUF;
+            inPlace = TRUE;
+        }
+        else if ((packet->m_body = SlabGet(r, packet->m_nBodySize))) {
+            packet->m_bodyPool = RTMP_BODY_POOLED;
+        }
+        else {
             RTMP_Log(RTMP_LOGDEBUG, "%s, failed to allocate packet", __FUNCTION__);
             return FALSE;
         }
-        didAlloc = TRUE;
-        packet->m_headerType = (hbuf[0] & 0xc0) >> 6;
+        packet->m_headerType = (hp[0] & 0xc0) >> 6;
     }
 
-    nToRead = packet->m_nBodySize - packet->m_nBytesRead;
-    nChunk = r->m_inChunkSize;
-    if (nToRead < nChunk)
-        nChunk = nToRead;
-
     /* Does the caller want the raw chunk? */
     if (packet->m_chunk) {
         packet->m_chunk->c_headerSize = hSize;
-        memcpy(packet->m_chunk->c_header, hbuf, hSize);
+        memcpy(packet->m_chunk->c_header, hp, hSize);
         packet->m_chunk->c_chunk = packet->m_body + packet->m_nBytesRead;
         packet->m_chunk->c_chunkSize = nChunk;
     }
 
-    if (ReadN(r, packet->m_body + packet->m_nBytesRead, nChunk) != nChunk) {
+    if (inPlace) {
+        if (!SockBufConsume(r, nChunk))
+            return FALSE;
+    }
+    else if (ReadN(r, packet->m_body + packet->m_nBytesRead, nChunk) != nChunk) {
         RTMP_Log(RTMP_LOGERROR, "%s, failed to read RTMP packet body. len: %u",
                 __FUNCTION__, packet->m_nBodySize);
         return FALSE;
@@ -3658,25 +5364,33 @@ int RTMP_ReadPacket(RTMP *r, RTMPPacket *packet) {
     packet->m_nBytesRead += nChunk;
 
     /* keep the packet as ref for other packets on this channel */
-    if (!r->m_vecChannelsIn[packet->m_nChannel])
-        r->m_vecChannelsIn[packet->m_nChannel] = malloc(sizeof(RTMPPacket));
-    memcpy(r->m_vecChannelsIn[packet->m_nChannel], packet, sizeof(RTMPPacket));
+    if (!ch->in && !(ch->in = ChannelPacket(r)))
+        return FALSE;
+    memcpy(ch->in, packet, sizeof(RTMPPacket));
     if (extendedTimestamp) {
-        r->m_vecChannelsIn[packet->m_nChannel]->m_nTimeStamp = 0xffffff;
+        ch->in->m_nTimeStamp = 0xffffff;
     }
 
     if (RTMPPacket_IsReady(packet)) {
         /* make packet's timestamp absolute */
         if (!packet->m_hasAbsTimestamp)
-            packet->m_nTimeStamp += r->m_channelTimestamp[packet->m_nChannel];    /* timestamps seem to be always relative!! */
+            packet->m_nTimeStamp += ch->timestamp;    /* timestamps seem to be always relative!! */
 
-        r->m_channelTimestamp[packet->m_nChannel] = packet->m_nTimeStamp;
+        ch->timestamp = packet->m_nTimeStamp;
 
         /* reset the data from the stored packet. we keep the header since we may use it later if a new packet for this channel */
         /* arrives and requests to re-use some info (small packet header) */
-        r->m_vecChannelsIn[packet->m_nChannel]->m_body = NULL;
-        r->m_vecChannelsIn[packet->m_nChannel]->m_nBytesRead = 0;
-        r->m_vecChannelsIn[packet->m_nChannel]->m_hasAbsTimestamp = FALSE;    /* can only be false if we reuse header */
+        ch->in->m_body = NULL;
+        ch->in->m_nBytesRead = 0;
+        ch->in->m_hasAbsTimestamp = FALSE;    /* can only be false if we reuse header */
+
+        /* an assembled body is lent, or handed over to the reader */
+        if (packet->m_body && packet->m_bodyPool == RTMP_BODY_POOLED) {
+            if (lend)
+                r->m_rxLent = packet->m_body;
+            else
+                packet->m_bodyPool = RTMP_BODY_SLAB;
+        }
     }
     else {
         packet->m_body = NULL;    /* so it won't be erased on free */
@@ -3685,6 +5399,14 @@ int RTMP_ReadPacket(RTMP *r, RTMPPacket *packet) {
     return TRUE;
 }
 
+int RTMP_ReadPacket(RTMP *r, RTMPPacket *packet) {
+    return ReadPacket(r, packet, FALSE);
+}
+
+int RTMP_ReadPacketRef(RTMP *r, RTMPPacket *packet) {
+    return ReadPacket(r, packet, TRUE);
+}
+
 #ifndef CRYPTO
 static int
 HandShake(RTMP *r, int FP9HandShake)
@@ -3836,40 +5558,331 @@ RTMP_SendChunk(RTMP *r, RTMPChunk *chunk) {
     return wrote;
 }
 
+/* basic header up to 3 bytes plus an extended timestamp */
+#define RTMP_CONT_HEADER_SIZE    (1 + 2 + 4)
+
+/* a body sent with MSG_ZEROCOPY the kernel has not reported done yet */
+typedef struct RTMP_ZCPending {
+    const RTMPPacket *packet;
+    /* set while it is being sent */
+    uint32_t first;
+    uint32_t last;
+    /* ids of the sends carrying it */
+    uint32_t remaining;
+    /* of those not reported done yet */
+    RTMP_ZCRelease *release;
+    void *arg;
+    char cont[RTMP_CONT_HEADER_SIZE];
+    /* continuation header, sent between the body slices */
+    struct RTMP_ZCPending *next;
+} RTMP_ZCPending;
+
+/* a body RTMP_SendPacketFile sends straight from a file */
+typedef struct RTMP_FileBody {
+    const RTMPPacket *packet;
+    int fd;
+    int64_t offset;
+} RTMP_FileBody;
+
+/*
+ * @brief whether bytes go to the socket as they are, no TLS, RC4 or HTTP
+ * wrapping, and sends block
+ */
+static int PlainSocket(RTMP *r) {
+    if (r->m_sb.sb_nonblock || (r->m_sb.sb_ssl && !r->m_sb.sb_ktls)
+            || (r->Link.protocol & RTMP_FEATURE_HTTP))
+        return FALSE;
+#ifdef CRYPTO
+    if (r->Link.rc4keyOut)
+        return FALSE;
+#endif
+    return TRUE;
+}
+
 /*
- * @brief send RTMP package divided into chunks according to the protocol
- * @param[in] r: RTMP context
- * @param[in] packet: RTMP package, contains payload data to send
- * @param[in] queue: remote method queue, used only when packet type is invoke.
+ * @brief header of the continuation chunks of a message, they all carry the same
+ * @return header size
+ */
+static int EncodeContHeader(char *cont, const RTMPPacket *packet, char c, int cSize,
+        uint32_t t) {
+    int contSize = 1 + cSize;
+
+    cont[0] = (0xc0 | c);
+    if (cSize) {
+        int tmp = packet->m_nChannel - 64;
+        cont[1] = tmp & 0xff;
+        if (cSize == 2)
+            cont[2] = tmp >> 8;
+    }
+    if (t >= 0xffffff) {
+        AMF_EncodeInt32(cont + contSize, cont + RTMP_CONT_HEADER_SIZE, t);
+        contSize += 4;
+    }
+    return contSize;
+}
+
+#ifndef _WIN32
+/* iovecs per sendmsg, two per chunk */
+#define RTMP_IOV_BATCH    256
+
+/*
+ * @brief send the chunks of a packet with as few syscalls as possible
  *
- * @return 1: success / 0: fail
+ * Every continuation chunk of a message carries the same header, it is built
+ * once in a side array and sent between the payload slices, so the body is
+ * neither copied nor overwritten.
+ *
+ * @param[in] from, size: the part of the body to send
+ * @param[in] header: header of the chunk at from, hSize bytes
+ * @param[in] c: basic header byte of the first chunk
+ * @param[in] cSize: extra basic header bytes for the chunk stream id
+ * @param[in] t: timestamp (delta) of the message
+ * @param[in] zcCont: storage for the continuation header that outlives the
+ *            call, for zerocopy sends, NULL to keep it on the stack
  */
-int RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue) {
-    const RTMPPacket *prevPacket;
-    uint32_t last = 0;
-    int nSize;
-    int hSize, cSize;
-    char *header, *hptr, *hend, hbuf[RTMP_MAX_HEADER_SIZE], c;
-    uint32_t t;
-    char *buffer, *tbuf = NULL, *toff = NULL;
-    int nChunkSize;
-    int tlen;
-
-    if (packet->m_nChannel >= r->m_channelsAllocatedOut) {
-        int n = packet->m_nChannel + 10;
-        RTMPPacket **packets = realloc(r->m_vecChannelsOut, sizeof(RTMPPacket *) * n);
-        if (!packets) {
-            free(r->m_vecChannelsOut);
-            r->m_vecChannelsOut = NULL;
-            r->m_channelsAllocatedOut = 0;
+static int SendChunksV(RTMP *r, const RTMPPacket *packet, uint32_t from, uint32_t size,
+        char *header, int hSize, char c, int cSize, uint32_t t, char *zcCont) {
+    struct iovec iov[RTMP_IOV_BATCH];
+    char contBuf[RTMP_CONT_HEADER_SIZE];
+    char *cont = zcCont ? zcCont : contBuf;
+    int contSize = EncodeContHeader(cont, packet, c, cSize, t);
+    int nSize = size;
+    int nChunkSize = r->m_outChunkSize;
+    char *buffer = packet->m_body + from;
+    int n = 0, len;
+
+    RTMP_LogHexString(RTMP_LOGDEBUG2, (uint8_t *) header, hSize);
+    iov[n].iov_base = header;
+    iov[n++].iov_len = hSize;
+    do {
+        len = nSize < nChunkSize ? nSize : nChunkSize;
+        if (len) {
+            iov[n].iov_base = buffer;
+            iov[n++].iov_len = len;
+        }
+        buffer += len;
+        nSize -= len;
+
+        if (nSize > 0) {
+            iov[n].iov_base = cont;
+            iov[n++].iov_len = contSize;
+        }
+        /* keep room for the next payload and header */
+        if (!nSize || n > RTMP_IOV_BATCH - 2) {
+            if (!WriteV(r, iov, n))
+                return FALSE;
+            n = 0;
+        }
+    } while (nSize > 0);
+
+    return TRUE;
+}
+#endif
+
+/*
+ * @brief SendChunksV for connections that wrap what they send, the chunks
+ * are put together in a slab buffer and written at once
+ */
+static int SendChunksCopy(RTMP *r, const RTMPPacket *packet, uint32_t from, uint32_t size,
+        char *header, int hSize, char c, int cSize, uint32_t t) {
+    char cont[RTMP_CONT_HEADER_SIZE];
+    int contSize = EncodeContHeader(cont, packet, c, cSize, t);
+    uint32_t chunks = (size + r->m_outChunkSize - 1) / r->m_outChunkSize;
+    char *buf, *ptr, *buffer = packet->m_body + from;
+    int ok;
+
+    if (!(buf = SlabGet(r, hSize + size + (chunks ? chunks - 1 : 0) * contSize)))
+        return FALSE;
+    memcpy(buf, header, hSize);
+    ptr = buf + hSize;
+    while (size > 0) {
+        uint32_t len = size < (uint32_t) r->m_outChunkSize ? size : (uint32_t) r->m_outChunkSize;
+
+        memcpy(ptr, buffer, len);
+        ptr += len;
+        buffer += len;
+        size -= len;
+        if (size > 0) {
+            memcpy(ptr, cont, contSize);
+            ptr += contSize;
+        }
+    }
+    ok = WriteN(r, buf, ptr - buf);
+    SlabPut(r, buf);
+    return ok;
+}
+
+#ifdef __linux__
+static int SockBufSendFile(RTMPSockBuf *sb, const char *buf, int blen, int fd,
+        off_t *offset, int len);
+
+/*
+ * @brief send the chunks of a packet whose body sits in a file
+ *
+ * Each header is written with MSG_MORE and its slice of the body follows
+ * with sendfile, so both leave in the same segments.
+ */
+static int SendChunksFile(RTMP *r, const RTMPPacket *packet, const RTMP_FileBody *fb,
+        char *header, int hSize, char c, int cSize, uint32_t t) {
+    char cont[RTMP_CONT_HEADER_SIZE];
+    int contSize = EncodeContHeader(cont, packet, c, cSize, t);
+    int nSize = packet->m_nBodySize;
+    off_t offset = fb->offset;
+
+    /* held writes go out ahead of the header */
+    if (!RTMP_Flush(r))
+        return FALSE;
+
+    RTMP_LogHexString(RTMP_LOGDEBUG2, (uint8_t *) header, hSize);
+    while (nSize > 0) {
+        int len = nSize < r->m_outChunkSize ? nSize : r->m_outChunkSize;
+
+        if (SockBufSendFile(&r->m_sb, header, hSize, fb->fd, &offset, len) < 0) {
+            RTMP_Log(RTMP_LOGERROR, "%s, RTMP sendfile error %d at offset %lld",
+                    __FUNCTION__, GetSockError(), (long long) offset);
+            RTMP_Close(r);
             return FALSE;
         }
-        r->m_vecChannelsOut = packets;
-        memset(r->m_vecChannelsOut + r->m_channelsAllocatedOut, 0, sizeof(RTMPPacket *) * (n - r->m_channelsAllocatedOut));
-        r->m_channelsAllocatedOut = n;
+        nSize -= len;
+        header = cont;
+        hSize = contSize;
+    }
+    return TRUE;
+}
+#endif
+
+/* tags up to this size are packed into aggregate messages */
+#define RTMP_AGGREGATE_TAG      1024
+/* body of an aggregate message at most */
+#define RTMP_AGGREGATE_SIZE     (16*1024)
+/* FLV tag header and the back pointer after each tag in an aggregate */
+#define RTMP_AGGREGATE_OVERHEAD 15
+
+/*
+ * @brief monotonic ms, RTMP_GetTime is too coarse for the coalescing
+ * and aggregate budgets
+ */
+static uint32_t CoalesceClock(void) {
+#ifdef _WIN32
+    return RTMP_GetTime();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+/*
+ * @brief send the tags held in the aggregate message
+ */
+static int AggregateFlush(RTMP *r) {
+    RTMPPacket packet;
+
+    if (!r->m_agg.m_nBodySize)
+        return TRUE;
+    /* emptied first, a failing send closes r and must find nothing held */
+    packet = r->m_agg;
+    r->m_agg.m_nBodySize = 0;
+    return RTMP_SendPacket(r, &packet, FALSE);
+}
+
+/*
+ * @brief hold a small tag in the aggregate message, anything else sends
+ * what is held first so messages keep their order
+ * @return 1: held / 0: send packet itself / -1: error
+ */
+static int AggregateAdd(RTMP *r, RTMPPacket *packet) {
+    RTMPPacket *agg = &r->m_agg;
+    char *enc, *pend;
+
+    if (!r->m_aggregate || !packet->m_body
+            || (packet->m_packetType != RTMP_PACKET_TYPE_AUDIO
+                && packet->m_packetType != RTMP_PACKET_TYPE_VIDEO)
+            || packet->m_nBodySize > RTMP_AGGREGATE_TAG
+            || (r->m_zcSending && r->m_zcSending->packet == packet))
+        return AggregateFlush(r) ? 0 : -1;
+
+    if (agg->m_nBodySize && (agg->m_nInfoField2 != packet->m_nInfoField2
+            || packet->m_nTimeStamp < agg->m_nTimeStamp
+            || agg->m_nBodySize + RTMP_AGGREGATE_OVERHEAD + packet->m_nBodySize
+                > RTMP_AGGREGATE_SIZE)) {
+        if (!AggregateFlush(r))
+            return -1;
+    }
+    if (!agg->m_body && !RTMP_AllocBody(r, agg, RTMP_AGGREGATE_SIZE))
+        return -1;
+    if (!agg->m_nBodySize) {
+        agg->m_headerType = RTMP_PACKET_SIZE_MEDIUM;
+        agg->m_packetType = RTMP_PACKET_TYPE_FLASH_VIDEO;
+        agg->m_hasAbsTimestamp = 0;
+        agg->m_nChannel = packet->m_nChannel;
+        agg->m_nTimeStamp = packet->m_nTimeStamp;
+        agg->m_nInfoField2 = packet->m_nInfoField2;
+        r->m_aggStamp = CoalesceClock();
+    }
+
+    /* an FLV tag with its back pointer, the timestamp as it is */
+    enc = agg->m_body + agg->m_nBodySize;
+    pend = agg->m_body + RTMP_AGGREGATE_SIZE;
+    *enc++ = packet->m_packetType;
+    enc = AMF_EncodeInt24(enc, pend, packet->m_nBodySize);
+    enc = AMF_EncodeInt24(enc, pend, packet->m_nTimeStamp & 0xffffff);
+    *enc++ = packet->m_nTimeStamp >> 24;
+    enc = AMF_EncodeInt24(enc, pend, 0);
+    memcpy(enc, packet->m_body, packet->m_nBodySize);
+    enc += packet->m_nBodySize;
+    enc = AMF_EncodeInt32(enc, pend, packet->m_nBodySize + 11);
+    agg->m_nBodySize = enc - agg->m_body;
+
+    /* the tags span the budget or the first one has waited it out */
+    if ((packet->m_nTimeStamp - agg->m_nTimeStamp >= (uint32_t) r->m_aggregateMS
+                || CoalesceClock() - r->m_aggStamp >= (uint32_t) r->m_aggregateMS)
+            && !AggregateFlush(r))
+        return -1;
+    return 1;
+}
+
+/*
+ * @brief what comes before the header of a message: flush ahead of a
+ * keyframe, adapt the chunk size and pick the header type against the
+ * last message on the chunk stream
+ * @param[out] last: timestamp the header is relative to
+ * @return the chunk stream / NULL on error
+ */
+static RTMP_Channel *StartMessage(RTMP *r, RTMPPacket *packet, uint32_t *last) {
+    const RTMPPacket *prevPacket;
+    RTMP_Channel *ch;
+
+    /* a keyframe starts a new GOP, do not hold back the end of the last one */
+    if (packet->m_packetType == RTMP_PACKET_TYPE_VIDEO && packet->m_body
+            && packet->m_nBodySize && (packet->m_body[0] & 0xf0) == 0x10) {
+        if (!RTMP_Flush(r))
+            return NULL;
+    }
+
+    /* chunk size changes go between messages */
+    if ((r->Link.protocol & RTMP_FEATURE_WRITE)
+            && (packet->m_packetType == RTMP_PACKET_TYPE_AUDIO
+                || packet->m_packetType == RTMP_PACKET_TYPE_VIDEO)) {
+        if (!AdaptChunkSize(r, packet))
+            return NULL;
+    }
+
+    if (!(ch = ChannelFind(r, packet->m_nChannel, TRUE)))
+        return NULL;
+    if (ch->outSent) {
+        RTMP_Log(RTMP_LOGERROR, "%s, chunk stream %d is in the middle of a message",
+                __FUNCTION__, packet->m_nChannel);
+        return NULL;
     }
 
-    prevPacket = r->m_vecChannelsOut[packet->m_nChannel];
+    *last = 0;
+    prevPacket = ch->out;
+    /* the message stream id only goes in a full header, and a chunk stream
+     * has nothing to carry on from before its first */
+    if (!prevPacket || prevPacket->m_nInfoField2 != packet->m_nInfoField2)
+        packet->m_headerType = RTMP_PACKET_SIZE_LARGE;
     if (prevPacket && packet->m_headerType != RTMP_PACKET_SIZE_LARGE) {
         /* compress a bit by using the prev packet's attributes */
         if (prevPacket->m_nBodySize == packet->m_nBodySize
@@ -3880,62 +5893,61 @@ int RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue) {
         if (prevPacket->m_nTimeStamp == packet->m_nTimeStamp
                 && packet->m_headerType == RTMP_PACKET_SIZE_SMALL)
             packet->m_headerType = RTMP_PACKET_SIZE_MINIMUM;
-        last = prevPacket->m_nTimeStamp;
+        *last = prevPacket->m_nTimeStamp;
     }
 
     if (packet->m_headerType > 3)    /* sanity */
     {
         RTMP_Log(RTMP_LOGERROR, "sanity failed!! trying to send header of type: 0x%02x.",
                 (unsigned char) packet->m_headerType);
-        return FALSE;
+        return NULL;
     }
+    return ch;
+}
 
-    nSize = packetSize[packet->m_headerType];
-    hSize = nSize;
-    cSize = 0;
-    t = packet->m_nTimeStamp - last;
-
-    if (packet->m_body) {
-        header = packet->m_body - nSize;
-        hend = packet->m_body;
-    }
-    else {
-        header = hbuf + 6;
-        hend = hbuf + sizeof(hbuf);
-    }
+/*
+ * @brief write the header of the first chunk of packet, ending at hend
+ * @param[in] t: timestamp (delta) of the message
+ * @param[out] hSize: header size
+ * @param[out] c: basic header byte
+ * @param[out] cSize: extra basic header bytes for the chunk stream id
+ * @return where the header starts
+ */
+static char *EncodeHeader(const RTMPPacket *packet, uint32_t t, char *hend, int *hSize,
+        char *c, int *cSize) {
+    int nSize = packetSize[packet->m_headerType];
+    char *header, *hptr;
 
+    *cSize = 0;
     if (packet->m_nChannel > 319)
-        cSize = 2;
+        *cSize = 2;
     else if (packet->m_nChannel > 63)
-        cSize = 1;
-    if (cSize) {
-        header -= cSize;
-        hSize += cSize;
-    }
+        *cSize = 1;
+    header = hend - nSize - *cSize;
 
     if (t >= 0xffffff) {
         header -= 4;
-        hSize += 4;
         RTMP_Log(RTMP_LOGWARNING, "Larger timestamp than 24-bit: 0x%x", t);
     }
+    *hSize = hend - header;
 
     hptr = header;
-    c = packet->m_headerType << 6;
-    switch (cSize) {
+    *c = packet->m_headerType << 6;
+    switch (*cSize) {
         case 0:
-            c |= packet->m_nChannel;
+            *c |= packet->m_nChannel;
             break;
         case 1:
             break;
         case 2:
-            c |= 1;
+            *c |= 1;
             break;
     }
-    *hptr++ = c;
-    if (cSize) {
+    *hptr++ = *c;
+    if (*cSize) {
         int tmp = packet->m_nChannel - 64;
         *hptr++ = tmp & 0xff;
-        if (cSize == 2)
+        if (*cSize == 2)
             *hptr++ = tmp >> 8;
     }
 
@@ -3953,6 +5965,72 @@ int RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue) {
 
     if (t >= 0xffffff)
         hptr = AMF_EncodeInt32(hptr, hend, t);
+    return header;
+}
+
+/*
+ * @brief what follows a message sent: the chunk stream keeps it to compress
+ * the next header against, commands are flushed and the uplink sampled
+ */
+static int EndMessage(RTMP *r, const RTMPPacket *packet) {
+    /* sending may have added channels and moved ch */
+    RTMP_Channel *ch = ChannelFind(r, packet->m_nChannel, FALSE);
+
+    if (!ch || (!ch->out && !(ch->out = ChannelPacket(r))))
+        return FALSE;
+    memcpy(ch->out, packet, sizeof(RTMPPacket));
+    ch->outSent = 0;
+
+    /* commands and control messages wait for nothing */
+    if (packet->m_packetType != RTMP_PACKET_TYPE_AUDIO
+            && packet->m_packetType != RTMP_PACKET_TYPE_VIDEO
+            && packet->m_packetType != RTMP_PACKET_TYPE_FLASH_VIDEO
+            && !r->m_sb.sb_cork && !RTMP_Flush(r))
+        return FALSE;
+
+    if (r->m_bwe.interval > 0
+            && RTMP_GetTime() - r->m_bwe.lastSample >= (uint32_t) r->m_bwe.interval)
+        RTMP_SampleBandwidth(r);
+    return TRUE;
+}
+
+/*
+ * @brief send RTMP package divided into chunks according to the protocol
+ * @param[in] r: RTMP context
+ * @param[in] packet: RTMP package, contains payload data to send
+ * @param[in] queue: remote method queue, used only when packet type is invoke.
+ *
+ * @return 1: success / 0: fail
+ */
+int RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue) {
+    uint32_t last;
+    int nSize;
+    int hSize, cSize;
+    char *header, hbuf[RTMP_MAX_HEADER_SIZE], c;
+    uint32_t t;
+    char *buffer, *tbuf = NULL, *toff = NULL;
+    int nChunkSize;
+    int tlen, held;
+    int vectored = FALSE;
+    int zerocopy = r->m_zcSending && r->m_zcSending->packet == packet;
+    const RTMP_FileBody *file = r->m_fileSending && r->m_fileSending->packet == packet
+            ? r->m_fileSending : NULL;
+
+    if ((held = AggregateAdd(r, packet)))
+        return held > 0;
+    if (!StartMessage(r, packet, &last))
+        return FALSE;
+    t = packet->m_nTimeStamp - last;
+
+#ifndef _WIN32
+    /* plain sockets take header and payload slices in one go, RTMPE encrypts them on the way */
+    vectored = packet->m_body && !(r->Link.protocol & RTMP_FEATURE_HTTP)
+            && (!r->m_sb.sb_ssl || r->m_sb.sb_ktls);
+#endif
+
+    /* the kernel reads a zerocopy header after we return, keep it off the stack */
+    header = EncodeHeader(packet, t, packet->m_body && !file && (!vectored || zerocopy)
+            ? packet->m_body : hbuf + sizeof(hbuf), &hSize, &c, &cSize);
 
     nSize = packet->m_nBodySize;
     buffer = packet->m_body;
@@ -3960,12 +6038,33 @@ int RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue) {
 
     RTMP_Log(RTMP_LOGDEBUG2, "%s: fd=%d, size=%d", __FUNCTION__, r->m_sb.sb_socket,
             nSize);
+#ifdef __linux__
+    if (file) {
+        if (!SendChunksFile(r, packet, file, header, hSize, c, cSize, t))
+            return FALSE;
+        nSize = hSize = 0;
+    }
+    else
+#endif
+#ifndef _WIN32
+    if (vectored) {
+        int ok;
+
+        r->m_sb.sb_zerocopy = zerocopy;
+        ok = SendChunksV(r, packet, 0, packet->m_nBodySize, header, hSize, c, cSize, t,
+                zerocopy ? r->m_zcSending->cont : NULL);
+        r->m_sb.sb_zerocopy = FALSE;
+        if (!ok)
+            return FALSE;
+        nSize = hSize = 0;
+    }
+#endif
     /* send all chunks in one HTTP request */
     if (r->Link.protocol & RTMP_FEATURE_HTTP) {
         int chunks = (nSize + nChunkSize - 1) / nChunkSize;
         if (chunks > 1) {
             tlen = chunks * (cSize + 1) + nSize + hSize;
-            tbuf = malloc(tlen);
+            tbuf = SlabGet(r, tlen);
             if (!tbuf)
                 return FALSE;
             toff = tbuf;
@@ -4016,34 +6115,327 @@ int RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue) {
             }
         }
     }
-    if (tbuf) {
-        int wrote = WriteN(r, tbuf, toff - tbuf);
-        free(tbuf);
-        tbuf = NULL;
-        if (!wrote)
-            return FALSE;
+    if (tbuf) {
+        int wrote = WriteN(r, tbuf, toff - tbuf);
+        SlabPut(r, tbuf);
+        tbuf = NULL;
+        if (!wrote)
+            return FALSE;
+    }
+
+    /* we invoked a remote method */
+    if (packet->m_packetType == RTMP_PACKET_TYPE_INVOKE) {
+        AVal method;
+        char *ptr;
+        ptr = packet->m_body + 1;
+        AMF_DecodeString(ptr, &method);
+        RTMP_Log(RTMP_LOGDEBUG, "Invoking %s", method.av_val);
+        /* keep it in call queue till result arrives */
+        if (queue) {
+            int txn;
+            ptr += 3 + method.av_len;
+            txn = (int) AMF_DecodeNumber(ptr);
+            AV_queue(&r->m_methodCalls, &r->m_numCalls, &method, txn);
+        }
+    }
+
+    return EndMessage(r, packet);
+}
+
+int RTMP_SendPacketPart(RTMP *r, RTMPPacket *packet, int maxBytes) {
+    RTMP_Channel *ch = ChannelFind(r, packet->m_nChannel, FALSE);
+    char hbuf[RTMP_MAX_HEADER_SIZE], cont[RTMP_CONT_HEADER_SIZE], *header, c;
+    uint32_t from = 0, size, t, last;
+    int hSize, cSize, chunks, ok;
+
+    if (!ch || !ch->outSent) {
+        /* what fits goes out whole, the way RTMP_SendPacket sends it */
+        if (!packet->m_body || packet->m_nBodySize <= (uint32_t) maxBytes
+                || packet->m_nBodySize <= (uint32_t) r->m_outChunkSize)
+            return RTMP_SendPacket(r, packet, FALSE) ? 1 : -1;
+        if (!AggregateFlush(r) || !StartMessage(r, packet, &last))
+            return -1;
+        t = packet->m_nTimeStamp - last;
+        header = EncodeHeader(packet, t, hbuf + sizeof(hbuf), &hSize, &c, &cSize);
+    }
+    else {
+        from = ch->outSent;
+        t = ch->outDelta;
+        cSize = packet->m_nChannel > 319 ? 2 : packet->m_nChannel > 63 ? 1 : 0;
+        c = cSize == 2 ? 1 : cSize ? 0 : packet->m_nChannel;
+        hSize = EncodeContHeader(cont, packet, c, cSize, t);
+        header = cont;
+    }
+
+    /* whole chunks, at least one */
+    chunks = maxBytes / r->m_outChunkSize;
+    if (chunks < 1)
+        chunks = 1;
+    size = packet->m_nBodySize - from;
+    if (size > (uint32_t) chunks * r->m_outChunkSize)
+        size = chunks * r->m_outChunkSize;
+
+#ifndef _WIN32
+    if (!(r->Link.protocol & RTMP_FEATURE_HTTP) && (!r->m_sb.sb_ssl || r->m_sb.sb_ktls))
+        ok = SendChunksV(r, packet, from, size, header, hSize, c, cSize, t, NULL);
+    else
+#endif
+        ok = SendChunksCopy(r, packet, from, size, header, hSize, c, cSize, t);
+    /* sending may have added channels and moved ch */
+    if (!ok || !(ch = ChannelFind(r, packet->m_nChannel, FALSE)))
+        return -1;
+
+    if (from + size < packet->m_nBodySize) {
+        if (!from) {
+            r->m_outInFlight++;
+            ch->outDelta = t;
+        }
+        ch->outSent = from + size;
+        return 0;
+    }
+    if (from)
+        r->m_outInFlight--;
+    return EndMessage(r, packet) ? 1 : -1;
+}
+
+#ifdef RTMP_ZEROCOPY
+/*
+ * @brief whether the body of packet should go out with MSG_ZEROCOPY
+ *
+ * Pinning pages only pays off for large bodies, and only plain blocking
+ * sockets send straight from the body, everything else copies it anyway.
+ */
+static int ZeroCopyWanted(RTMP *r, const RTMPPacket *packet) {
+    int on = 1;
+
+    if (r->m_zcThreshold <= 0 || r->m_zcSocket < 0 || !packet->m_body
+            || packet->m_packetType != RTMP_PACKET_TYPE_VIDEO
+            || packet->m_nBodySize < (uint32_t) r->m_zcThreshold)
+        return FALSE;
+    /* kernel TLS encrypts into its own pages and refuses MSG_ZEROCOPY */
+    if (!PlainSocket(r) || r->m_sb.sb_ssl)
+        return FALSE;
+    if (!r->m_zcSocket) {
+        if (setsockopt(r->m_sb.sb_socket, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) < 0) {
+            RTMP_Log(RTMP_LOGDEBUG, "%s, SO_ZEROCOPY failed (%d), sending copies",
+                    __FUNCTION__, GetSockError());
+            r->m_zcSocket = -1;
+            return FALSE;
+        }
+        r->m_zcSocket = 1;
+    }
+    return TRUE;
+}
+
+/*
+ * @brief the kernel is done with the zerocopy sends lo to hi
+ *
+ * Ranges may arrive out of order and span several bodies, each body counts
+ * down the sends it still waits for.
+ */
+static void ZeroCopyComplete(RTMP *r, uint32_t lo, uint32_t hi) {
+    RTMP_ZCPending **pp = &r->m_zcPending, *zc;
+
+    while ((zc = *pp)) {
+        /* ids wrap around, compare by distance */
+        uint32_t from = (int32_t) (zc->first - lo) > 0 ? zc->first : lo;
+        uint32_t to = (int32_t) (zc->last - hi) < 0 ? zc->last : hi;
+
+        if ((int32_t) (zc->first - hi) > 0)
+            break;
+        if ((int32_t) (to - from) >= 0)
+            zc->remaining -= to - from + 1;
+        if (zc->remaining) {
+            pp = &zc->next;
+            continue;
+        }
+        *pp = zc->next;
+        if (zc->release)
+            zc->release(zc->arg);
+        zc->next = r->m_zcSpare;
+        r->m_zcSpare = zc;
+    }
+}
+
+/*
+ * @brief a cleared record for a body to send, a spare one if there is
+ */
+static RTMP_ZCPending *ZeroCopyRecord(RTMP *r) {
+    RTMP_ZCPending *zc = r->m_zcSpare;
+
+    if (!zc)
+        return calloc(1, sizeof(RTMP_ZCPending));
+    r->m_zcSpare = zc->next;
+    memset(zc, 0, sizeof(RTMP_ZCPending));
+    return zc;
+}
+#endif
+
+/*
+ * @brief release every pending body, the connection is going away
+ */
+static void ZeroCopyDrop(RTMP *r) {
+    RTMP_ZCPending *zc;
+
+    while ((zc = r->m_zcPending)) {
+        r->m_zcPending = zc->next;
+        if (zc->release)
+            zc->release(zc->arg);
+        free(zc);
+    }
+    while ((zc = r->m_zcSpare)) {
+        r->m_zcSpare = zc->next;
+        free(zc);
+    }
+    r->m_zcSocket = 0;
+}
+
+int RTMP_ReapZeroCopy(RTMP *r) {
+    RTMP_ZCPending *zc;
+    int n = 0;
+#ifdef RTMP_ZEROCOPY
+    /* sock_extended_err followed by the offender address */
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+
+    while (r->m_zcPending && r->m_sb.sb_socket != -1) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(r->m_sb.sb_socket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            break;
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err *ee;
+
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                    && !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+                continue;
+            ee = (struct sock_extended_err *) CMSG_DATA(cm);
+            if (ee->ee_errno || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            /* the device could not send from our pages, pinning them is wasted */
+            if ((ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && r->m_zcSocket > 0) {
+                RTMP_Log(RTMP_LOGDEBUG, "%s, zerocopy sends were copied, sending copies",
+                        __FUNCTION__);
+                r->m_zcSocket = -1;
+            }
+            ZeroCopyComplete(r, ee->ee_info, ee->ee_data);
+        }
+    }
+#endif
+    for (zc = r->m_zcPending; zc; zc = zc->next)
+        n++;
+    return n;
+}
+
+/*
+ * @brief give the kernel up to the session timeout to finish the pending
+ * bodies, what it sends after they are released could see them change
+ */
+static void ZeroCopyWait(RTMP *r) {
+#ifdef RTMP_ZEROCOPY
+    uint32_t start = RTMP_GetTime();
+    struct pollfd pfd;
+    int n, left;
+
+    while ((n = RTMP_ReapZeroCopy(r))) {
+        left = r->Link.timeout * 1000 - (int) (RTMP_GetTime() - start);
+        pfd.fd = r->m_sb.sb_socket;
+        pfd.events = 0;
+        /* completions show up as POLLERR, so does a socket error */
+        if (left <= 0 || poll(&pfd, 1, left) <= 0
+                || (pfd.revents & (POLLHUP | POLLNVAL)) || RTMP_ReapZeroCopy(r) == n)
+            break;
     }
+#endif
+}
 
-    /* we invoked a remote method */
-    if (packet->m_packetType == RTMP_PACKET_TYPE_INVOKE) {
-        AVal method;
-        char *ptr;
-        ptr = packet->m_body + 1;
-        AMF_DecodeString(ptr, &method);
-        RTMP_Log(RTMP_LOGDEBUG, "Invoking %s", method.av_val);
-        /* keep it in call queue till result arrives */
-        if (queue) {
-            int txn;
-            ptr += 3 + method.av_len;
-            txn = (int) AMF_DecodeNumber(ptr);
-            AV_queue(&r->m_methodCalls, &r->m_numCalls, &method, txn);
+int RTMP_SendPacketZC(RTMP *r, RTMPPacket *packet, RTMP_ZCRelease *release, void *arg) {
+    int ret;
+#ifdef RTMP_ZEROCOPY
+    RTMP_ZCPending *zc, **pp;
+    uint32_t first = r->m_sb.sb_zcNext;
+
+    if (r->m_zcPending)
+        RTMP_ReapZeroCopy(r);
+    if (ZeroCopyWanted(r, packet) && (zc = ZeroCopyRecord(r))) {
+        zc->packet = packet;
+        r->m_zcSending = zc;
+        ret = RTMP_SendPacket(r, packet, FALSE);
+        r->m_zcSending = NULL;
+        zc->packet = NULL;
+
+        /* the kernel holds the body until it reports these sends done */
+        if (r->m_sb.sb_zcNext != first && RTMP_IsConnected(r)) {
+            zc->first = first;
+            zc->last = r->m_sb.sb_zcNext - 1;
+            zc->remaining = r->m_sb.sb_zcNext - first;
+            zc->release = release;
+            zc->arg = arg;
+            for (pp = &r->m_zcPending; *pp; pp = &(*pp)->next);
+            *pp = zc;
+            return ret;
         }
+        zc->next = r->m_zcSpare;
+        r->m_zcSpare = zc;
     }
+    else
+#endif
+        ret = RTMP_SendPacket(r, packet, FALSE);
 
-    if (!r->m_vecChannelsOut[packet->m_nChannel])
-        r->m_vecChannelsOut[packet->m_nChannel] = malloc(sizeof(RTMPPacket));
-    memcpy(r->m_vecChannelsOut[packet->m_nChannel], packet, sizeof(RTMPPacket));
-    return TRUE;
+    if (release)
+        release(arg);
+    return ret;
+}
+
+int RTMP_SendPacketFile(RTMP *r, RTMPPacket *packet, int fd, int64_t offset) {
+    RTMPPacket body;
+    char *ptr;
+    uint32_t left;
+    int ret;
+#ifdef __linux__
+    RTMP_FileBody fb;
+
+    /* one chunk, one header: the file bytes are the wire bytes */
+    if (packet->m_nBodySize && packet->m_nBodySize <= (uint32_t) r->m_outChunkSize
+            && PlainSocket(r)) {
+        fb.packet = packet;
+        fb.fd = fd;
+        fb.offset = offset;
+        r->m_fileSending = &fb;
+        ret = RTMP_SendPacket(r, packet, FALSE);
+        r->m_fileSending = NULL;
+        return ret;
+    }
+#endif
+
+    body = *packet;
+    if (!RTMP_AllocBody(r, &body, packet->m_nBodySize))
+        return FALSE;
+    for (ptr = body.m_body, left = packet->m_nBodySize; left > 0;) {
+#ifdef _WIN32
+        int n = _lseeki64(fd, offset, SEEK_SET) < 0 ? -1 : _read(fd, ptr, left);
+#else
+        ssize_t n = pread(fd, ptr, left, offset);
+#endif
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            RTMP_Log(RTMP_LOGERROR, "%s, reading %u bytes at offset %lld failed",
+                    __FUNCTION__, left, (long long) offset);
+            RTMP_FreeBody(r, &body);
+            return FALSE;
+        }
+        ptr += n;
+        left -= n;
+        offset += n;
+    }
+    ret = RTMP_SendPacket(r, &body, FALSE);
+    packet->m_headerType = body.m_headerType;
+    RTMP_FreeBody(r, &body);
+    return ret;
 }
 
 int
@@ -4053,19 +6445,33 @@ RTMP_Serve(RTMP *r) {
 
 void
 RTMP_Close(RTMP *r) {
+    /* held tags go out ahead of the unpublish */
+    if (RTMP_IsConnected(r))
+        AggregateFlush(r);
     CloseInternal(r, 0);
 }
 
 static void
 CloseInternal(RTMP *r, int reconnect) {
+    RTMP_Stream *streams = r->m_streams;
+    int numStreams = r->m_numStreams;
     int i;
 
+    /* taken off r first, a send failing on the way closes again */
+    r->m_streams = NULL;
+    r->m_numStreams = 0;
     if (RTMP_IsConnected(r)) {
+        for (i = 0; i < numStreams && RTMP_IsConnected(r); i++) {
+            if (streams[i].id > 0) {
+                SendFCUnpublish(r, &streams[i].playpath);
+                SendDeleteStream(r, streams[i].id);
+            }
+        }
         if (r->m_stream_id > 0) {
             i = r->m_stream_id;
             r->m_stream_id = 0;
             if ((r->Link.protocol & RTMP_FEATURE_WRITE))
-                SendFCUnpublish(r);
+                SendFCUnpublish(r, &r->Link.playpath);
             SendDeleteStream(r, i);
         }
         if (r->m_clientID.av_val) {
@@ -4074,11 +6480,26 @@ CloseInternal(RTMP *r, int reconnect) {
             r->m_clientID.av_val = NULL;
             r->m_clientID.av_len = 0;
         }
+        ZeroCopyWait(r);
+#if defined(CRYPTO) && !defined(NO_SSL) && defined(TLS_SESSION)
+        TLSCacheSave(r);
+#endif
         RTMPSockBuf_Close(&r->m_sb);
     }
+    ZeroCopyDrop(r);
+    for (i = 0; i < numStreams; i++)
+        free(streams[i].playpath.av_val);
+    free(streams);
 
     r->m_stream_id = -1;
+    r->m_outInFlight = 0;
     r->m_sb.sb_socket = -1;
+    /* a new connection starts over with the protocol default */
+    r->m_inChunkSize = RTMP_DEFAULT_CHUNKSIZE;
+    r->m_outChunkSize = RTMP_DEFAULT_CHUNKSIZE;
+    r->m_avgVideoSize = 0;
+    r->m_nbState = RTMP_NB_IDLE;
+    r->m_standby = 0;
     r->m_nBWCheckCounter = 0;
     r->m_nBytesIn = 0;
     r->m_nBytesInSent = 0;
@@ -4095,29 +6516,25 @@ CloseInternal(RTMP *r, int reconnect) {
     r->m_read.nIgnoredFlvFrameCounter = 0;
 
     r->m_write.m_nBytesRead = 0;
-    RTMPPacket_Free(&r->m_write);
-
-    for (i = 0; i < r->m_channelsAllocatedIn; i++) {
-        if (r->m_vecChannelsIn[i]) {
-            RTMPPacket_Free(r->m_vecChannelsIn[i]);
-            free(r->m_vecChannelsIn[i]);
-            r->m_vecChannelsIn[i] = NULL;
-        }
-    }
-    free(r->m_vecChannelsIn);
-    r->m_vecChannelsIn = NULL;
-    free(r->m_channelTimestamp);
-    r->m_channelTimestamp = NULL;
-    r->m_channelsAllocatedIn = 0;
-    for (i = 0; i < r->m_channelsAllocatedOut; i++) {
-        if (r->m_vecChannelsOut[i]) {
-            free(r->m_vecChannelsOut[i]);
-            r->m_vecChannelsOut[i] = NULL;
-        }
-    }
-    free(r->m_vecChannelsOut);
-    r->m_vecChannelsOut = NULL;
-    r->m_channelsAllocatedOut = 0;
+    RTMP_FreeBody(r, &r->m_write);
+    RTMP_FreeBody(r, &r->m_agg);
+    r->m_agg.m_nBodySize = 0;
+    r->m_aggregate = FALSE;
+
+    /* the channel packets go with their slab blocks */
+    for (i = 0; i < r->m_numChannels; i++) {
+        if (r->m_channels[i].in)
+            ReleaseBody(r, r->m_channels[i].in);
+    }
+    free(r->m_channels);
+    r->m_channels = NULL;
+    r->m_numChannels = 0;
+    r->m_channelsAllocated = 0;
+    if (r->m_rxLent) {
+        SlabPut(r, r->m_rxLent);
+        r->m_rxLent = NULL;
+    }
+    SlabDrain(r);
     AV_clear(r->m_methodCalls, r->m_numCalls);
     r->m_methodCalls = NULL;
     r->m_numCalls = 0;
@@ -4158,21 +6575,88 @@ CloseInternal(RTMP *r, int reconnect) {
         RC4_free(r->Link.rc4keyOut);
         r->Link.rc4keyOut = NULL;
     }
+    free(r->Link.rc4Buf);
+    r->Link.rc4Buf = NULL;
+    r->Link.rc4BufSize = 0;
 #endif
 }
 
+/*
+ * @brief reallocate sb_buf to size bytes, keeping what it holds in place
+ */
+static int SockBufResize(RTMPSockBuf *sb, int size) {
+    char *buf = realloc(sb->sb_buf, size);
+
+    if (!buf)
+        return FALSE;
+    sb->sb_start = sb->sb_buf ? buf + (sb->sb_start - sb->sb_buf) : buf + RTMP_MAX_HEADER_SIZE;
+    sb->sb_buf = buf;
+    sb->sb_bufSize = size;
+    return TRUE;
+}
+
+int RTMPSockBuf_Reserve(RTMPSockBuf *sb, int need) {
+    int room, size;
+
+    if (!sb->sb_buf && !SockBufResize(sb, RTMP_BUFFER_INITIAL_SIZE))
+        return -1;
+    room = sb->sb_bufSize - 1 - (sb->sb_start - sb->sb_buf) - sb->sb_size;
+    if (room >= need)
+        return room;
+
+    if (sb->sb_start != sb->sb_buf + RTMP_MAX_HEADER_SIZE) {
+        if (sb->sb_size)
+            memmove(sb->sb_buf + RTMP_MAX_HEADER_SIZE, sb->sb_start, sb->sb_size);
+        sb->sb_start = sb->sb_buf + RTMP_MAX_HEADER_SIZE;
+    }
+    room = sb->sb_bufSize - 1 - RTMP_MAX_HEADER_SIZE - sb->sb_size;
+    if (room >= need || sb->sb_bufSize >= RTMP_BUFFER_CACHE_SIZE)
+        return room;
+
+    for (size = sb->sb_bufSize * 2; size < RTMP_BUFFER_CACHE_SIZE
+            && size - 1 - RTMP_MAX_HEADER_SIZE - sb->sb_size < need; size *= 2);
+    if (size > RTMP_BUFFER_CACHE_SIZE)
+        size = RTMP_BUFFER_CACHE_SIZE;
+    if (!SockBufResize(sb, size))
+        return -1;
+    return size - 1 - RTMP_MAX_HEADER_SIZE - sb->sb_size;
+}
+
+void RTMPSockBuf_Filled(RTMPSockBuf *sb, int asked, int got) {
+    if (got < asked || sb->sb_bufSize >= RTMP_BUFFER_CACHE_SIZE) {
+        sb->sb_fullReads = 0;
+        return;
+    }
+    /* a player streaming in, a publisher never gets here */
+    if (++sb->sb_fullReads >= RTMP_BUFFER_GROW_READS) {
+        sb->sb_fullReads = 0;
+        SockBufResize(sb, sb->sb_bufSize * 2 < RTMP_BUFFER_CACHE_SIZE ?
+                sb->sb_bufSize * 2 : RTMP_BUFFER_CACHE_SIZE);
+    }
+}
+
 /*
  * @brief use recv() to receive data.
  */
 int RTMPSockBuf_Fill(RTMPSockBuf *sb) {
-    int nBytes;
+    int nBytes, room;
 
-    if (!sb->sb_size) {
-        sb->sb_start = sb->sb_buf;
+    /* the peer may be waiting for what we hold */
+    if (sb->sb_outLen && RTMPSockBuf_Flush(sb) < 0) {
+        return -1;
+    }
+
+    /* leave room for a header in front of a body lent in place */
+    if (!sb->sb_size && sb->sb_buf) {
+        sb->sb_start = sb->sb_buf + RTMP_MAX_HEADER_SIZE;
+    }
+    if ((room = RTMPSockBuf_Reserve(sb, 1)) < 1) {
+        RTMP_Log(RTMP_LOGERROR, "%s, no room in the receive buffer", __FUNCTION__);
+        return -1;
     }
 
     while (1) {
-        nBytes = sizeof(sb->sb_buf) - 1 - sb->sb_size - (sb->sb_start - sb->sb_buf);
+        nBytes = room;
 #if defined(CRYPTO) && !defined(NO_SSL)
         if (sb->sb_ssl) {
             nBytes = TLS_read(sb->sb_ssl, sb->sb_start + sb->sb_size, nBytes);
@@ -4184,6 +6668,7 @@ int RTMPSockBuf_Fill(RTMPSockBuf *sb) {
         }
         if (nBytes != -1) {
             sb->sb_size += nBytes;
+            RTMPSockBuf_Filled(sb, room, nBytes);
         }
         else {
             int sockerr = GetSockError();
@@ -4205,36 +6690,381 @@ int RTMPSockBuf_Fill(RTMPSockBuf *sb) {
 }
 
 /*
- * @brief Socket send, return byte sent
+ * @brief one send call on the socket
+ * @param[in] more: more data follows right away, let the kernel merge it
  */
-int RTMPSockBuf_Send(RTMPSockBuf *sb, const char *buf, int len) {
+static int SockBufWrite(RTMPSockBuf *sb, const char *buf, int len, int more) {
     int rc;
 
-#ifdef _DEBUG
-  fwrite(buf, 1, len, netstackdump);
-#endif
-
+    sb->sb_sends++;
 #if defined(CRYPTO) && !defined(NO_SSL)
-    if (sb->sb_ssl) {
+    if (sb->sb_ssl && !sb->sb_ktls) {
         rc = TLS_write(sb->sb_ssl, buf, len);
     }
     else
 #endif
     {
+#ifdef MSG_MORE
+        rc = send(sb->sb_socket, buf, len, more ? MSG_MORE : 0);
+#else
         rc = send(sb->sb_socket, buf, len, 0);
+#endif
     }
+    if (rc > 0)
+        sb->sb_bytesSent += rc;
     return rc;
 }
 
+static int SockBufFlush(RTMPSockBuf *sb, int more) {
+    char *ptr = sb->sb_out + sb->sb_outOff;
+
+    while (sb->sb_outLen > 0) {
+        int rc = SockBufWrite(sb, ptr, sb->sb_outLen, more);
+        if (rc <= 0) {
+            if (rc < 0 && GetSockError() == EINTR && !RTMP_ctrlC)
+                continue;
+            sb->sb_outLen = 0;
+            sb->sb_outOff = 0;
+            return -1;
+        }
+        ptr += rc;
+        sb->sb_outLen -= rc;
+    }
+    sb->sb_outOff = 0;
+    return 0;
+}
+
+/*
+ * @brief queue what a non-blocking socket did not take
+ */
+static int SockBufQueue(RTMPSockBuf *sb, const char *buf, int len) {
+    if (sb->sb_outOff + sb->sb_outLen + len > sb->sb_outSize) {
+        if (sb->sb_outOff) {
+            memmove(sb->sb_out, sb->sb_out + sb->sb_outOff, sb->sb_outLen);
+            sb->sb_outOff = 0;
+        }
+        if (sb->sb_outLen + len > sb->sb_outSize) {
+            int size = sb->sb_outSize ? sb->sb_outSize : RTMP_COALESCE_SIZE;
+            char *out;
+
+            while (size < sb->sb_outLen + len)
+                size *= 2;
+            out = realloc(sb->sb_out, size);
+            if (!out)
+                return FALSE;
+            sb->sb_out = out;
+            sb->sb_outSize = size;
+        }
+    }
+    memcpy(sb->sb_out + sb->sb_outOff + sb->sb_outLen, buf, len);
+    sb->sb_outLen += len;
+    return TRUE;
+}
+
+/*
+ * @brief send what is queued until a non-blocking socket would block
+ * @return bytes still queued / -1 on socket error
+ */
+static int SockBufDrain(RTMPSockBuf *sb) {
+    while (sb->sb_outLen > 0) {
+        int rc = SockBufWrite(sb, sb->sb_out + sb->sb_outOff, sb->sb_outLen, FALSE);
+        if (rc < 0) {
+            int sockerr = GetSockError();
+            if (sockerr == EINTR)
+                continue;
+            if (sockerr == EAGAIN || sockerr == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+        sb->sb_outOff += rc;
+        sb->sb_outLen -= rc;
+    }
+    if (!sb->sb_outLen)
+        sb->sb_outOff = 0;
+    return sb->sb_outLen;
+}
+
+/*
+ * @brief how many leading bytes of a non-blocking send to queue, -1 on error
+ */
+static int SockBufSent(int rc) {
+    if (rc >= 0)
+        return rc;
+    rc = GetSockError();
+    return (rc == EAGAIN || rc == EWOULDBLOCK || rc == EINTR) ? 0 : -1;
+}
+
+/*
+ * @brief whether len bytes can be held back instead of sent
+ */
+static int CoalesceRoom(RTMPSockBuf *sb, size_t len) {
+    if ((sb->sb_coalesceMS <= 0 && !sb->sb_cork) || sb->sb_nonblock || sb->sb_zerocopy
+            || len >= RTMP_COALESCE_SIZE)
+        return FALSE;
+    if (!sb->sb_out) {
+        if (!(sb->sb_out = malloc(RTMP_COALESCE_SIZE)))
+            return FALSE;
+        sb->sb_outSize = RTMP_COALESCE_SIZE;
+    }
+    /* make room, what is held goes out together with what follows */
+    if (sb->sb_outLen + len > RTMP_COALESCE_SIZE && SockBufFlush(sb, TRUE) < 0)
+        return -1;
+    return TRUE;
+}
+
+static void CoalesceAppend(RTMPSockBuf *sb, const char *buf, size_t len) {
+    if (!sb->sb_outLen)
+        sb->sb_outStamp = CoalesceClock();
+    memcpy(sb->sb_out + sb->sb_outLen, buf, len);
+    sb->sb_outLen += len;
+}
+
+/*
+ * @brief send what is held once the buffer is full or the budget is spent
+ */
+static int CoalesceCheck(RTMPSockBuf *sb) {
+    if (sb->sb_outLen == RTMP_COALESCE_SIZE
+            || (!sb->sb_cork
+                && CoalesceClock() - sb->sb_outStamp >= (uint32_t) sb->sb_coalesceMS))
+        return SockBufFlush(sb, FALSE);
+    return 0;
+}
+
+/*
+ * @brief Socket send, return byte sent
+ *
+ * With sb_coalesceMS set small writes are held and sent together when the
+ * buffer fills, the budget is spent, or RTMPSockBuf_Flush is called.
+ * In non-blocking mode all of buf is taken, what the socket does not
+ * accept is queued until RTMPSockBuf_Flush.
+ */
+int RTMPSockBuf_Send(RTMPSockBuf *sb, const char *buf, int len) {
+    int room;
+
+#ifdef _DEBUG
+  fwrite(buf, 1, len, netstackdump);
+#endif
+
+    sb->sb_writes++;
+    if (sb->sb_nonblock) {
+        int sent = 0;
+
+        if (!sb->sb_outLen && sb->sb_nonblock != RTMP_SB_DEFERRED
+                && (sent = SockBufSent(SockBufWrite(sb, buf, len, FALSE))) < 0)
+            return -1;
+        if (sent < len && !SockBufQueue(sb, buf + sent, len - sent))
+            return -1;
+        return len;
+    }
+
+    room = CoalesceRoom(sb, len);
+    if (room < 0)
+        return -1;
+    if (room) {
+        CoalesceAppend(sb, buf, len);
+        return CoalesceCheck(sb) < 0 ? -1 : len;
+    }
+
+    if (sb->sb_outLen && SockBufFlush(sb, TRUE) < 0)
+        return -1;
+    return SockBufWrite(sb, buf, len, FALSE);
+}
+
+/*
+ * @brief send what is held or queued, in non-blocking mode only what the
+ * socket takes right now
+ */
+int RTMPSockBuf_Flush(RTMPSockBuf *sb) {
+    if (sb->sb_nonblock == RTMP_SB_DEFERRED)
+        return 0;
+    if (sb->sb_nonblock)
+        return SockBufDrain(sb) < 0 ? -1 : 0;
+    return SockBufFlush(sb, FALSE);
+}
+
+int RTMP_FlushDeadline(RTMP *r) {
+    RTMPSockBuf *sb = &r->m_sb;
+    uint32_t now = CoalesceClock();
+    int32_t left = 0, agg;
+    int held = FALSE;
+
+    /* what a non-blocking socket did not take waits for it to be writable,
+     * what a cork holds waits for RTMP_Flush */
+    if (sb->sb_cork)
+        return -1;
+    if (sb->sb_outLen && !sb->sb_nonblock) {
+        left = (int32_t) (sb->sb_outStamp + sb->sb_coalesceMS - now);
+        held = TRUE;
+    }
+    if (r->m_agg.m_nBodySize) {
+        agg = (int32_t) (r->m_aggStamp + r->m_aggregateMS - now);
+        if (!held || agg < left)
+            left = agg;
+        held = TRUE;
+    }
+    if (!held)
+        return -1;
+    return left > 0 ? left : 0;
+}
+
+int RTMP_Flush(RTMP *r) {
+    if (!AggregateFlush(r))
+        return FALSE;
+    if (!r->m_sb.sb_outLen)
+        return TRUE;
+
+    if (RTMPSockBuf_Flush(&r->m_sb) < 0) {
+        int sockerr = GetSockError();
+        RTMP_Log(RTMP_LOGERROR, "%s, RTMP send error %d", __FUNCTION__, sockerr);
+        RTMP_Close(r);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void RTMP_GetSendStats(RTMP *r, RTMP_SendStats *stats) {
+    stats->writes = r->m_sb.sb_writes;
+    stats->sends = r->m_sb.sb_sends;
+    stats->bytes = r->m_sb.sb_bytesSent;
+}
+
+#ifndef _WIN32
+/*
+ * @brief socket send of scattered data, return byte sent
+ */
+int RTMPSockBuf_SendV(RTMPSockBuf *sb, const struct iovec *iov, int iovcnt) {
+    struct msghdr msg;
+    size_t total = 0;
+    int i, rc;
+
+#ifdef _DEBUG
+    for (i = 0; i < iovcnt; i++)
+        fwrite(iov[i].iov_base, 1, iov[i].iov_len, netstackdump);
+#endif
+
+    sb->sb_writes++;
+    for (i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+
+    rc = CoalesceRoom(sb, total);
+    if (rc < 0)
+        return -1;
+    if (rc) {
+        for (i = 0; i < iovcnt; i++)
+            CoalesceAppend(sb, iov[i].iov_base, iov[i].iov_len);
+        return CoalesceCheck(sb) < 0 ? -1 : (int) total;
+    }
+
+    if (sb->sb_outLen && !sb->sb_nonblock && SockBufFlush(sb, TRUE) < 0)
+        return -1;
+
+    rc = 0;
+    if (!sb->sb_outLen && sb->sb_nonblock != RTMP_SB_DEFERRED) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = (struct iovec *) iov;
+        msg.msg_iovlen = iovcnt;
+        sb->sb_sends++;
+#ifdef RTMP_ZEROCOPY
+        if (sb->sb_zerocopy) {
+            rc = sendmsg(sb->sb_socket, &msg, MSG_ZEROCOPY);
+            /* every send that took data gets an id, in order */
+            if (rc > 0)
+                sb->sb_zcNext++;
+            /* out of memory for completions, copy this one */
+            else if (rc < 0 && GetSockError() == ENOBUFS)
+                rc = sendmsg(sb->sb_socket, &msg, 0);
+        }
+        else
+#endif
+            rc = sendmsg(sb->sb_socket, &msg, 0);
+        if (rc > 0)
+            sb->sb_bytesSent += rc;
+        if (!sb->sb_nonblock)
+            return rc;
+        if ((rc = SockBufSent(rc)) < 0)
+            return -1;
+    }
+
+    /* non-blocking, queue the part the socket did not take */
+    for (i = 0; i < iovcnt; i++) {
+        if ((size_t) rc >= iov[i].iov_len) {
+            rc -= iov[i].iov_len;
+            continue;
+        }
+        if (!SockBufQueue(sb, (char *) iov[i].iov_base + rc, iov[i].iov_len - rc))
+            return -1;
+        rc = 0;
+    }
+    return (int) total;
+}
+#endif
+
+#ifdef __linux__
+/*
+ * @brief write buf, then len bytes of fd from *offset without copying them
+ * through userspace, the caller flushed what was held
+ * @return 0 / -1 on error, a file shorter than expected included
+ */
+static int SockBufSendFile(RTMPSockBuf *sb, const char *buf, int blen, int fd,
+        off_t *offset, int len) {
+    sb->sb_writes++;
+    while (blen > 0) {
+        int rc = SockBufWrite(sb, buf, blen, TRUE);
+        if (rc <= 0) {
+            if (rc < 0 && GetSockError() == EINTR && !RTMP_ctrlC)
+                continue;
+            return -1;
+        }
+        buf += rc;
+        blen -= rc;
+    }
+    while (len > 0) {
+        ssize_t rc;
+
+        sb->sb_sends++;
+        rc = sendfile(sb->sb_socket, fd, offset, len);
+        if (rc <= 0) {
+            if (rc < 0 && GetSockError() == EINTR && !RTMP_ctrlC)
+                continue;
+            return -1;
+        }
+        sb->sb_bytesSent += rc;
+        len -= rc;
+    }
+    return 0;
+}
+#endif
+
 /*
  * @brief close socket
  */
 int RTMPSockBuf_Close(RTMPSockBuf *sb) {
+    if (sb->sb_outLen && sb->sb_socket != -1) {
+        if (sb->sb_nonblock == RTMP_SB_NONBLOCK)
+            SockBufDrain(sb);
+        else if (!sb->sb_nonblock)
+            SockBufFlush(sb, FALSE);
+    }
+    free(sb->sb_out);
+    sb->sb_out = NULL;
+    sb->sb_outSize = 0;
+    sb->sb_outOff = 0;
+    free(sb->sb_buf);
+    sb->sb_buf = sb->sb_start = NULL;
+    sb->sb_bufSize = 0;
+    sb->sb_size = 0;
+    sb->sb_fullReads = 0;
+    sb->sb_outLen = 0;
+    sb->sb_nonblock = FALSE;
+    sb->sb_zcNext = 0;
+    sb->sb_cork = FALSE;
+
 #if defined(CRYPTO) && !defined(NO_SSL)
     if (sb->sb_ssl) {
         TLS_shutdown(sb->sb_ssl);
         TLS_close(sb->sb_ssl);
         sb->sb_ssl = NULL;
+        sb->sb_ktls = FALSE;
     }
 #endif
     if (sb->sb_socket != -1)
@@ -4242,6 +7072,129 @@ int RTMPSockBuf_Close(RTMPSockBuf *sb) {
     return 0;
 }
 
+/* share of the estimated bandwidth recommended to the encoder */
+#define RTMP_BWE_HEADROOM    0.85
+/* the recommended bitrate leaves room to drain the send queue within this */
+#define RTMP_BWE_DRAIN_MS    1000
+
+#ifdef __linux__
+/*
+ * @brief the kernel's struct tcp_info, read by offset past what the libc
+ * header declares, which differs from one libc to the next
+ */
+typedef union RTMPTCPInfo {
+    struct tcp_info base;
+    uint8_t raw[256];
+} RTMPTCPInfo;
+
+/* offsets in the kernel's struct tcp_info, both there since Linux 4.9 */
+#define RTMP_TCPI_APP_LIMITED      7
+#define RTMP_TCPI_DELIVERY_RATE    160
+
+/* tcpi_delivery_rate_app_limited, the first bit field of its byte */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define RTMP_TCPI_APP_LIMITED_BIT  0x80
+#else
+#define RTMP_TCPI_APP_LIMITED_BIT  0x01
+#endif
+#endif
+
+/*
+ * @brief sample TCP_INFO and SIOCOUTQ and update the bandwidth estimate
+ *
+ * What the socket accepted minus what still sits in its send queue is what
+ * the network has taken. While more than a congestion window is queued the
+ * connection is network limited and that rate is the available bandwidth;
+ * otherwise the encoder is the limit and the kernel delivery rate tells how
+ * much more would fit, or cwnd / rtt when that rate was itself measured
+ * while the encoder was the limit.
+ *
+ * @return TRUE if a sample was taken
+ */
+int RTMP_SampleBandwidth(RTMP *r) {
+    RTMP_BWE *bwe = &r->m_bwe;
+    RTMP_BWStats *s = &bwe->stats;
+    uint32_t now = RTMP_GetTime();
+    uint32_t elapsed = now - bwe->lastSample;
+    uint64_t drained;
+    double rate, sample, capacity = 0, bitrate;
+    int backlogged;
+
+    if (!RTMP_IsConnected(r) || !elapsed)
+        return FALSE;
+
+    s->bytesSent = r->m_sb.sb_bytesSent;
+#ifdef __linux__
+    {
+        RTMPTCPInfo ti;
+        socklen_t len = sizeof(ti);
+        int queued = 0;
+
+        memset(&ti, 0, sizeof(ti));
+        if (!getsockopt(r->m_sb.sb_socket, IPPROTO_TCP, TCP_INFO, &ti, &len)) {
+            s->unacked = ti.base.tcpi_unacked;
+            s->cwnd = ti.base.tcpi_snd_cwnd;
+            s->mss = ti.base.tcpi_snd_mss;
+            s->rtt = ti.base.tcpi_rtt;
+            s->rttVar = ti.base.tcpi_rttvar;
+            /* len is what this kernel filled in */
+            if (len >= RTMP_TCPI_DELIVERY_RATE + sizeof(s->deliveryRate)) {
+                memcpy(&s->deliveryRate, ti.raw + RTMP_TCPI_DELIVERY_RATE,
+                        sizeof(s->deliveryRate));
+                s->appLimited = !!(ti.raw[RTMP_TCPI_APP_LIMITED] & RTMP_TCPI_APP_LIMITED_BIT);
+            }
+        }
+        /* counts TLS records, close enough to the plaintext accepted */
+        if (!ioctl(r->m_sb.sb_socket, SIOCOUTQ, &queued) && queued >= 0)
+            s->sendQueue = queued;
+    }
+#endif
+
+    drained = s->bytesSent > s->sendQueue ? s->bytesSent - s->sendQueue : 0;
+    rate = drained > bwe->lastDrained ? (drained - bwe->lastDrained) * 1000.0 / elapsed : 0;
+    bwe->lastDrained = drained;
+    bwe->lastSample = now;
+
+    /* an app-limited delivery rate only shows what the encoder sent */
+    if (s->deliveryRate && !s->appLimited)
+        capacity = (double) s->deliveryRate;
+    else if (s->rtt)
+        capacity = (double) s->cwnd * s->mss * 1000000.0 / s->rtt;
+    backlogged = s->cwnd && s->sendQueue > s->cwnd * s->mss;
+    sample = backlogged || rate > capacity ? rate : capacity;
+
+    if (!s->samples++) {
+        s->sendRate = rate;
+        s->bandwidth = sample;
+    }
+    else {
+        s->sendRate += (rate - s->sendRate) / 4;
+        /* back off faster than we probe up */
+        s->bandwidth += (sample - s->bandwidth) / (sample < s->bandwidth ? 4 : 8);
+    }
+
+    bitrate = s->bandwidth * 8 * RTMP_BWE_HEADROOM
+              - s->sendQueue * 8.0 * 1000 / RTMP_BWE_DRAIN_MS;
+    s->bitrate = bitrate > 0 ? (uint32_t) bitrate : 0;
+
+    RTMP_Log(RTMP_LOGDEBUG2, "%s: rate=%.0f bw=%.0f rtt=%u cwnd=%u queued=%u bitrate=%u",
+            __FUNCTION__, s->sendRate, s->bandwidth, s->rtt, s->cwnd, s->sendQueue,
+            s->bitrate);
+
+    if (bwe->cb)
+        bwe->cb(r, s, bwe->cbArg);
+    return TRUE;
+}
+
+void RTMP_GetBandwidthStats(RTMP *r, RTMP_BWStats *stats) {
+    *stats = r->m_bwe.stats;
+}
+
+void RTMP_SetBandwidthCallback(RTMP *r, RTMP_BWCallback *cb, void *arg) {
+    r->m_bwe.cb = cb;
+    r->m_bwe.cbArg = arg;
+}
+
 #define HEX2BIN(a)    (((a)&0x40)?((a)&0xf)+9:((a)&0xf))
 
 /*
@@ -4952,7 +7905,6 @@ RTMP_Write(RTMP *r, const char *buf, int size) {
     char *pend, *enc;
     int s2 = size, ret, num;
 
-    pkt->m_nChannel = 0x04;    /* source channel */
     pkt->m_nInfoField2 = r->m_stream_id;
 
     while (s2) {
@@ -4968,6 +7920,8 @@ RTMP_Write(RTMP *r, const char *buf, int size) {
             }
 
             pkt->m_packetType = *buf++;
+            /* video on a chunk stream of its own, audio never waits behind its chunks */
+            pkt->m_nChannel = RTMP_StreamChannel(r, r->m_stream_id, pkt->m_packetType);
             pkt->m_nBodySize = AMF_DecodeInt24(buf);
             buf += 3;
             pkt->m_nTimeStamp = AMF_DecodeInt24(buf);
@@ -4987,7 +7941,7 @@ RTMP_Write(RTMP *r, const char *buf, int size) {
                 pkt->m_headerType = RTMP_PACKET_SIZE_MEDIUM;
             }
 
-            if (!RTMPPacket_Alloc(pkt, pkt->m_nBodySize)) {
+            if (!RTMP_AllocBody(r, pkt, pkt->m_nBodySize)) {
                 RTMP_Log(RTMP_LOGDEBUG, "%s, failed to allocate packet", __FUNCTION__);
                 return FALSE;
             }
@@ -5010,7 +7964,7 @@ RTMP_Write(RTMP *r, const char *buf, int size) {
         buf += num;
         if (pkt->m_nBytesRead == pkt->m_nBodySize) {
             ret = RTMP_SendPacket(r, pkt, FALSE);
-            RTMPPacket_Free(pkt);
+            RTMP_FreeBody(r, pkt);
             pkt->m_nBytesRead = 0;
             if (!ret)
                 return -1;
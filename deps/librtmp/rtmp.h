@@ -60,9 +60,19 @@ extern "C"
 
 #define RTMP_DEFAULT_CHUNKSIZE    128
 
+/* outbound chunk size a publisher starts with and its bounds when adapting */
+#define RTMP_CHUNKSIZE_INITIAL    4096
+#define RTMP_CHUNKSIZE_MAX        65536
+#define RTMP_CHUNKBUDGET_DEFAULT  20
+
 /* needs to fit largest number of bytes recv() may return */
 #define RTMP_BUFFER_CACHE_SIZE (16*1024)
 
+/* the receive buffer starts this small and doubles up to RTMP_BUFFER_CACHE_SIZE */
+#define RTMP_BUFFER_INITIAL_SIZE (2*1024)
+/* after this many reads in a row filled it */
+#define RTMP_BUFFER_GROW_READS 2
+
 #define    RTMP_CHANNELS    65600
 
 extern const char RTMPProtocolStringsLower[][7];
@@ -109,10 +119,21 @@ typedef struct RTMPChunk {
     char c_header[RTMP_MAX_HEADER_SIZE];
 } RTMPChunk;
 
+/* owners of RTMPPacket.m_body */
+#define RTMP_BODY_HEAP      0   /* RTMPPacket_Alloc, freed by RTMPPacket_Free */
+#define RTMP_BODY_POOLED    1   /* lent from the connection's slab */
+#define RTMP_BODY_SOCKBUF   2   /* lent in place from the receive buffer */
+#define RTMP_BODY_SLAB      3   /* from a connection's slab, owned by the caller */
+
+/* body size classes of the per connection slab, 256 bytes to 1MB */
+#define RTMP_SLAB_MIN       256
+#define RTMP_SLAB_CLASSES   13
+
 typedef struct RTMPPacket {
     uint8_t m_headerType; // ChunkMsgHeader type (4 kinds)
     uint8_t m_packetType; // Message type ID (1 - 7 protocol control; 8, 9 audio/video; 10 and after used for AMF encode message)
     uint8_t m_hasAbsTimestamp; /* timestamp absolute or relative? */
+    uint8_t m_bodyPool; /* RTMP_BODY_*, who m_body belongs to */
     int m_nChannel; // chunk stream id(csid) (3 <= ID <= 65599)
     uint32_t m_nTimeStamp; /* timestamp */
     int32_t m_nInfoField2; /* last 4 bytes in a long header, message stream id */
@@ -128,12 +149,54 @@ typedef struct RTMPSockBuf {
     /* number of unprocessed bytes in buffer */
     char *sb_start;
     /* pointer into sb_pBuffer of next byte to process */
-    char sb_buf[RTMP_BUFFER_CACHE_SIZE];
-    /* data read from socket */
+    char *sb_buf;
+    /* data read from socket, allocated on the first read */
+    int sb_bufSize;
+    int sb_fullReads;
+    /* reads in a row that filled sb_buf, see RTMP_BUFFER_GROW_READS */
     int sb_timedout;
     void *sb_ssl;
+    int sb_ktls;
+    /* the kernel encrypts sends on sb_ssl, they go straight to the socket */
+    uint64_t sb_bytesSent;
+    /* bytes handed to the socket */
+    int sb_coalesceMS;
+    /* hold small writes up to this long, 0 sends them right away */
+    char *sb_out;
+    /* held writes, RTMP_COALESCE_SIZE bytes, more in non-blocking mode */
+    int sb_outSize;
+    int sb_outOff;
+    int sb_outLen;
+    /* pending bytes start at sb_out + sb_outOff */
+    int sb_nonblock;
+    /* RTMP_SB_*, sends never block, what the socket does not take waits in sb_out */
+    uint32_t sb_outStamp;
+    /* when the oldest held byte was written */
+    uint64_t sb_writes;
+    /* calls to RTMPSockBuf_Send / RTMPSockBuf_SendV */
+    uint64_t sb_sends;
+    /* send calls made on the socket */
+    int sb_zerocopy;
+    /* add MSG_ZEROCOPY to sends, set while RTMP_SendPacketZC sends a body */
+    uint32_t sb_zcNext;
+    /* id the kernel gives the next zerocopy send */
+    int sb_cork;
+    /* hold every write until RTMPSockBuf_Flush, whatever sb_coalesceMS says */
 } RTMPSockBuf;
 
+#define RTMP_COALESCE_SIZE (16*1024)
+
+/* sb_nonblock modes */
+#define RTMP_SB_NONBLOCK    1   /* send right away what the socket takes */
+#define RTMP_SB_DEFERRED    2   /* only queue, the owner writes sb_out out */
+
+/* writes per send call is the coalescing ratio */
+typedef struct RTMP_SendStats {
+    uint64_t writes;
+    uint64_t sends;
+    uint64_t bytes;
+} RTMP_SendStats;
+
 void RTMPPacket_Reset(RTMPPacket *p);
 
 void RTMPPacket_Dump(RTMPPacket *p);
@@ -176,6 +239,8 @@ typedef struct RTMP_LNK {
 #define RTMP_LF_BUFX    0x0010    /* toggle stream on BufferEmpty msg */
 #define RTMP_LF_FTCU    0x0020    /* free tcUrl on close */
 #define RTMP_LF_FAPU    0x0040    /* free app on close */
+#define RTMP_LF_KTLS    0x0080    /* let the kernel encrypt TLS sends */
+#define RTMP_LF_FAST    0x0100    /* publish setup sent along with connect */
     int lFlags;
 
     int swfAge;
@@ -196,6 +261,9 @@ typedef struct RTMP_LNK {
     /* for encryption */
     void *rc4keyIn;
     void *rc4keyOut;
+    char *rc4Buf;
+    /* RTMPTE requests are encrypted here whole, grown as needed */
+    int rc4BufSize;
 
     uint32_t SWFSize;
     uint8_t SWFHash[RTMP_SWF_HASHLEN];
@@ -239,15 +307,110 @@ typedef struct RTMP_METHOD {
     int num;
 } RTMP_METHOD;
 
+/* uplink bandwidth estimate, rates are in bytes per second */
+typedef struct RTMP_BWStats {
+    uint64_t bytesSent;
+    /* accepted by RTMPSockBuf_Send */
+    uint32_t sendQueue;
+    /* bytes in the socket not acked yet (SIOCOUTQ) */
+    uint32_t unacked;
+    /* segments in flight */
+    uint32_t cwnd;
+    /* congestion window in segments */
+    uint32_t mss;
+    uint32_t rtt;
+    /* smoothed rtt in microseconds */
+    uint32_t rttVar;
+    uint64_t deliveryRate;
+    /* kernel delivery rate, 0 if unknown */
+    int appLimited;
+    /* deliveryRate was measured while there was too little to send */
+    double sendRate;
+    /* smoothed rate the socket buffer drains at */
+    double bandwidth;
+    /* smoothed available bandwidth */
+    uint32_t bitrate;
+    /* recommended encoder bitrate in bits per second */
+    uint32_t samples;
+} RTMP_BWStats;
+
+struct RTMP;
+
+struct RTMP_ZCPending;
+
+struct RTMP_FileBody;
+
+typedef void (RTMP_BWCallback)(struct RTMP *r, const RTMP_BWStats *stats, void *arg);
+
+#define RTMP_BWE_INTERVAL_DEFAULT    500
+
+/* state of the uplink bandwidth estimator */
+typedef struct RTMP_BWE {
+    RTMP_BWStats stats;
+    int interval;
+    /* ms between samples, 0 disables sampling on send */
+    uint32_t lastSample;
+    uint64_t lastDrained;
+    RTMP_BWCallback *cb;
+    void *cbArg;
+} RTMP_BWE;
+
 typedef struct RTMP {
     int m_inChunkSize;
     int m_outChunkSize;
+    int m_chunkBudgetMS;
+    /* max time one outbound chunk may hold up audio, 0 disables adapting */
+    uint32_t m_chunkSizeStamp;
+    /* RTMP_GetTime() of the last SetChunkSize sent */
+    int m_avgVideoSize;
+    int m_aggregateMS;
+    /* small tags go out packed in aggregate messages spanning up to this, 0 disables */
+    int m_aggregate;
+    /* the server takes aggregate messages, as its connect _result tells */
+    int m_nbState;
+    /* RTMP_NB_*, stage of a connection made by RTMP_ConnectNB */
+    uint32_t m_nbStamp;
+    /* RTMP_GetTime() when RTMP_ConnectNB started */
+    int m_standby;
+    /* RTMP_STANDBY_*, set by RTMP_ConnectStandby */
+    int m_zcThreshold;
+    /* video bodies from this size go out with MSG_ZEROCOPY, 0 disables */
+    int m_zcSocket;
+    /* SO_ZEROCOPY is set on the socket, -1 if it is not worth it */
+    struct RTMP_ZCPending *m_zcPending;
+    /* bodies the kernel may still read, oldest first */
+    struct RTMP_ZCPending *m_zcSending;
+    /* the one RTMP_SendPacketZC is sending */
+    struct RTMP_FileBody *m_fileSending;
+    /* where the body RTMP_SendPacketFile is sending sits */
+    struct RTMP_ZCPending *m_zcSpare;
+    /* finished records, reused by the next RTMP_SendPacketZC */
+    struct RTMP_SlabBuf *m_slabFree[RTMP_SLAB_CLASSES];
+    /* bodies not in use, by size class */
+    uint16_t m_slabCount[RTMP_SLAB_CLASSES];
+    uint16_t m_slabKeep[RTMP_SLAB_CLASSES];
+    /* free bodies kept per class past RTMP_SLAB_KEEP, grown by bursts */
+    uint16_t m_slabShort[RTMP_SLAB_CLASSES];
+    /* bodies freed past the keep since the class last ran dry */
+    uint32_t m_slabCached;
+    /* bytes held in m_slabFree */
+    int m_slabLimit;
+    /* m_slabCached stays under this, 0 frees every body once done */
+    struct RTMP_ChannelSlab *m_channelSlab;
+    /* blocks the packets of m_channels are carved from */
+    char *m_rxLent;
+    /* the assembled body RTMP_ReadPacketRef lent last */
     int m_nBWCheckCounter;
     int m_nBytesIn;
     int m_nBytesInSent;
     int m_nBufferMS;
     int m_stream_id;
     /* returned in _result from createStream */
+    struct RTMP_Stream *m_streams;
+    /* more streams published on the connection, see RTMP_AddStream */
+    int m_numStreams;
+    int m_outInFlight;
+    /* messages RTMP_SendPacketPart started and has not finished */
     int m_mediaChannel;
     uint32_t m_mediaStamp;
     uint32_t m_pauseStamp;
@@ -264,12 +427,10 @@ typedef struct RTMP {
     RTMP_METHOD *m_methodCalls;
     /* remote method calls queue */
 
-    int m_channelsAllocatedIn;
-    int m_channelsAllocatedOut;
-    RTMPPacket **m_vecChannelsIn;
-    RTMPPacket **m_vecChannelsOut;
-    int *m_channelTimestamp;
-    /* abs timestamp of last packet */
+    struct RTMP_Channel *m_channels;
+    /* chunk streams in use either way, sorted by id */
+    int m_numChannels;
+    int m_channelsAllocated;
 
     double m_fAudioCodecs;
     /* audioCodecs for the connect packet */
@@ -290,7 +451,12 @@ typedef struct RTMP {
 
     RTMP_READ m_read;
     RTMPPacket m_write;
+    RTMPPacket m_agg;
+    /* aggregate message the small tags sent are held in until it goes out */
+    uint32_t m_aggStamp;
+    /* monotonic ms the first tag of m_agg was held at */
     RTMPSockBuf m_sb;
+    RTMP_BWE m_bwe;
     RTMP_LNK Link;
 } RTMP;
 
@@ -325,22 +491,172 @@ void RTMP_SetupStream(RTMP *r, int protocol,
         int dStart,
         int dStop, int bLiveStream, long int timeout);
 
+/*
+ * @brief resolve the host and race connects to all its IPv4 and IPv6
+ * addresses, the first one through is kept
+ */
 int RTMP_Connect(RTMP *r, RTMPPacket *cp);
 
+/*
+ * @brief look up the host of r, set up with RTMP_SetupURL, on a thread of
+ * its own so the next connect finds the addresses cached, a connect made
+ * while it runs waits for it. Nothing is started while one is in flight.
+ * @return FALSE if the lookup could not be started
+ */
+int RTMP_ResolveAhead(RTMP *r);
+
+/*
+ * @brief how long looked up addresses are reused, 60 seconds by default,
+ * 0 to look up the host on every connect
+ *
+ * getaddrinfo tells nothing of record TTLs. Should the DNS fail, the
+ * addresses last cached are used however old they are.
+ */
+void RTMP_SetDNSTTL(int seconds);
+
 struct sockaddr;
 
 int RTMP_Connect0(RTMP *r, struct sockaddr *svc);
 
 int RTMP_Connect1(RTMP *r, RTMPPacket *cp);
 
+/* stages of a connection made by RTMP_ConnectNB */
+#define RTMP_NB_FAILED      (-1)
+#define RTMP_NB_IDLE        0
+#define RTMP_NB_TCP         1   /* TCP connect in progress */
+#define RTMP_NB_HANDSHAKE   2   /* C0 C1 sent, waiting for S0 S1 */
+#define RTMP_NB_HANDSHAKE2  3   /* C2 sent, waiting for S2 */
+#define RTMP_NB_NETCONNECT  4   /* connect sent, waiting for the stream */
+#define RTMP_NB_READY       5   /* publishing or playing */
+
+/* socket readiness for RTMP_ProcessNB / RTMP_WantsNB */
+#define RTMP_IO_READ    0x01
+#define RTMP_IO_WRITE   0x02
+#define RTMP_IO_FILLED  0x04    /* the caller appended to sb_buf, parse only */
+
+/*
+ * @brief start connecting without blocking, then drive the socket with
+ * RTMP_ProcessNB until RTMP_NB_READY
+ *
+ * Handshake, connect and publish resume wherever the socket would block,
+ * sends are queued instead of blocking. Only plain rtmp:// without SOCKS
+ * is supported. Only the preferred address is tried, the host name is
+ * resolved synchronously unless RTMP_ResolveAhead cached it.
+ */
+int RTMP_ConnectNB(RTMP *r);
+
+/*
+ * @brief advance on socket readiness, also checks the connect timeout
+ * @param[in] events: RTMP_IO_READ / RTMP_IO_WRITE, 0 for a timeout check only
+ * @return the stage, on RTMP_NB_FAILED the caller closes with RTMP_Close
+ */
+int RTMP_ProcessNB(RTMP *r, int events);
+
+/*
+ * @brief readiness the connection waits for, RTMP_IO_WRITE while sends are queued
+ */
+int RTMP_WantsNB(RTMP *r);
+
+/* states of a connection made by RTMP_ConnectStandby */
+#define RTMP_STANDBY_WAIT   1   /* connect sent, waiting for its result */
+#define RTMP_STANDBY_READY  2   /* connected, stream setup held back */
+
+/*
+ * @brief connect as a warm standby: TCP, TLS, the RTMP handshake and the
+ * NetConnection connect are done, the stream is not set up yet
+ *
+ * Blocks like RTMP_Connect, make standbys from a thread of their own. A
+ * failover is RTMP_ConnectStream on the standby, which then only sends
+ * createStream and publish (or play).
+ */
+int RTMP_ConnectStandby(RTMP *r);
+
+/*
+ * @brief handle what a standby received, pings and acks, without waiting
+ * for more, call it now and then to keep the standby alive
+ * @return FALSE once the standby is gone
+ */
+int RTMP_ServiceStandby(RTMP *r);
+
 int RTMP_Serve(RTMP *r);
 
 int RTMP_TLS_Accept(RTMP *r, void *ctx);
 
+/*
+ * @brief RTMPPacket_Alloc from the slab of r
+ *
+ * Bodies come from and go back to buffers the connection keeps by size
+ * class, so a steady stream of packets does not touch the heap. Give the
+ * body back with RTMP_FreeBody, RTMPPacket_Free also works but frees it.
+ */
+int RTMP_AllocBody(RTMP *r, RTMPPacket *p, int nSize);
+
+/*
+ * @brief RTMPPacket_Free returning a slab body to r
+ */
+void RTMP_FreeBody(RTMP *r, RTMPPacket *p);
+
+/*
+ * @brief read a chunk into packet, once the message is complete its body
+ * is handed over, a slab body RTMP_FreeBody returns
+ */
 int RTMP_ReadPacket(RTMP *r, RTMPPacket *packet);
 
+/*
+ * @brief RTMP_ReadPacket lending the body instead of handing it over
+ *
+ * A message that came in one chunk is not copied, m_body points into the
+ * receive buffer. Others are assembled in buffers the connection reuses.
+ * Either way the body stays valid until the next RTMP_ReadPacketRef or
+ * RTMP_Close, RTMPPacket_Free leaves it alone, and RTMP_SendPacket may
+ * forward it.
+ */
+int RTMP_ReadPacketRef(RTMP *r, RTMPPacket *packet);
+
 int RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue);
 
+/*
+ * @brief send the next chunks of packet, about maxBytes of its body
+ *
+ * Call again with the same packet until it is out. In between, messages
+ * on other chunk streams may go out, whole or part by part, which is how
+ * streams sharing a connection take turns within a large message. A chunk
+ * stream carries one message at a time.
+ * @return 1: packet sent / 0: more to send / -1: error
+ */
+int RTMP_SendPacketPart(RTMP *r, RTMPPacket *packet, int maxBytes);
+
+typedef void RTMP_ZCRelease(void *arg);
+
+/*
+ * @brief send a packet whose body the kernel may still read after returning
+ *
+ * Video bodies of at least the "zeroCopy" option size go out with
+ * MSG_ZEROCOPY and must stay untouched until release(arg) is called, once
+ * the kernel reports them sent, from a later RTMP_SendPacketZC,
+ * RTMP_ReapZeroCopy or RTMP_Close. Other packets are released before this
+ * returns. The body needs the RTMP_MAX_HEADER_SIZE bytes RTMPPacket_Alloc
+ * reserves in front of it.
+ */
+int RTMP_SendPacketZC(RTMP *r, RTMPPacket *packet, RTMP_ZCRelease *release, void *arg);
+
+/*
+ * @brief send a packet whose body is m_nBodySize bytes of fd from offset on
+ *
+ * When the body fits in one outbound chunk on a plain socket only the
+ * header is written from here, the body follows with sendfile and never
+ * passes through userspace. RTMPE, RTMPS, RTMPT, non-blocking sockets and
+ * bodies larger than the chunk size read the body in and send it normally.
+ * packet->m_body is not used.
+ */
+int RTMP_SendPacketFile(RTMP *r, RTMPPacket *packet, int fd, int64_t offset);
+
+/*
+ * @brief release the bodies the kernel is done with, never blocks
+ * @return number of bodies the kernel still holds
+ */
+int RTMP_ReapZeroCopy(RTMP *r);
+
 int RTMP_SendChunk(RTMP *r, RTMPChunk *chunk);
 
 int RTMP_IsConnected(RTMP *r);
@@ -359,6 +675,48 @@ int RTMP_ReconnectStream(RTMP *r, int seekTime);
 
 void RTMP_DeleteStream(RTMP *r);
 
+/*
+ * @brief publish one more stream on a publishing connection, blocks until
+ * the server has started it
+ *
+ * Each stream has a message stream id and chunk streams of its own, send
+ * its packets on RTMP_StreamChannel with m_nInfoField2 set to the id. A
+ * stream the server refuses leaves the connection and its other streams
+ * up. RTMP_Close drops the added streams, also when it reconnects.
+ * @return message stream id / -1 on failure
+ */
+int RTMP_AddStream(RTMP *r, const AVal *playpath);
+
+/*
+ * @brief send the requests RTMP_AddStream does, for a caller that sends on
+ * r while the server replies
+ * @return transaction id for RTMP_AddStreamStep / -1 on failure
+ */
+int RTMP_AddStreamStart(RTMP *r, const AVal *playpath);
+
+/*
+ * @brief read one chunk of the replies to RTMP_AddStreamStart
+ *
+ * Only the caller stepping reads r, wait for it to be readable between
+ * steps. A read timing out fails the stream.
+ * @return message stream id once the server started it / 0 while it has
+ * not / -1 once the stream failed, it is dropped then
+ */
+int RTMP_AddStreamStep(RTMP *r, int txn);
+
+/*
+ * @brief unpublish and delete a stream added with RTMP_AddStream
+ */
+void RTMP_RemoveStream(RTMP *r, int streamId);
+
+/*
+ * @brief chunk stream packets of type go on for message stream streamId
+ *
+ * Video has a chunk stream apart from audio and data, so a message of one
+ * can go out between the chunks of a large message of the other.
+ */
+int RTMP_StreamChannel(RTMP *r, int streamId, int type);
+
 int RTMP_GetNextMediaPacket(RTMP *r, RTMPPacket *packet);
 
 int RTMP_ClientPacket(RTMP *r, RTMPPacket *packet);
@@ -377,6 +735,21 @@ void *RTMP_TLS_AllocServerContext(const char *cert, const char *key);
 
 void RTMP_TLS_FreeServerContext(void *ctx);
 
+/*
+ * @brief keep depth RTMPE Diffie-Hellman keypairs generated ahead on a
+ * background thread, handshakes take one instead of making their own
+ *
+ * Calling it again changes the depth, and starts the thread anew if it
+ * stopped on a key it failed to generate.
+ * @return FALSE if not supported by this build
+ */
+int RTMP_DHPoolStart(int depth);
+
+/*
+ * @brief stop the keypair thread and free what it generated
+ */
+void RTMP_DHPoolStop(void);
+
 int RTMP_LibVersion(void);
 
 void RTMP_UserInterrupt(void);
@@ -396,10 +769,56 @@ int RTMP_Pause(RTMP *r, int DoPause);
 int RTMP_FindFirstMatchingProperty(AMFObject *obj, const AVal *name,
         AMFObjectProperty *p);
 
+/* sample the socket now and update the bandwidth estimate */
+int RTMP_SampleBandwidth(RTMP *r);
+
+void RTMP_GetBandwidthStats(RTMP *r, RTMP_BWStats *stats);
+
+/* cb is called after every sample, on the thread that sends */
+void RTMP_SetBandwidthCallback(RTMP *r, RTMP_BWCallback *cb, void *arg);
+
+/* send held writes now, call when going idle */
+int RTMP_Flush(RTMP *r);
+
+/*
+ * @brief milliseconds until held writes or the aggregate message are due
+ * to go out, whichever comes first
+ *
+ * Both are otherwise only sent by a later write, so a caller that
+ * may pause calls RTMP_Flush when this comes due. The reactor and the mux
+ * do it for the connections they drive.
+ * @return ms left, 0 when due / -1 when nothing is held
+ */
+int RTMP_FlushDeadline(RTMP *r);
+
+void RTMP_GetSendStats(RTMP *r, RTMP_SendStats *stats);
+
 int RTMPSockBuf_Fill(RTMPSockBuf *sb);
 
+/*
+ * @brief make room for need bytes after what sb_buf holds, moving that to
+ * the front or growing sb_buf up to RTMP_BUFFER_CACHE_SIZE
+ * @return bytes that fit after the data / -1 if sb_buf could not grow
+ */
+int RTMPSockBuf_Reserve(RTMPSockBuf *sb, int need);
+
+/*
+ * @brief account a read that got bytes of the room asked for, reads that
+ * keep filling sb_buf make it grow
+ */
+void RTMPSockBuf_Filled(RTMPSockBuf *sb, int asked, int got);
+
+int RTMPSockBuf_Flush(RTMPSockBuf *sb);
+
 int RTMPSockBuf_Send(RTMPSockBuf *sb, const char *buf, int len);
 
+#ifndef _WIN32
+struct iovec;
+
+/* plain sockets only, returns bytes sent */
+int RTMPSockBuf_SendV(RTMPSockBuf *sb, const struct iovec *iov, int iovcnt);
+#endif
+
 int RTMPSockBuf_Close(RTMPSockBuf *sb);
 
 int RTMP_SendCreateStream(RTMP *r);
@@ -408,6 +827,9 @@ int RTMP_SendSeek(RTMP *r, int dTime);
 
 int RTMP_SendServerBW(RTMP *r);
 
+/* send SetChunkSize and use size for the following messages */
+int RTMP_SendChunkSize(RTMP *r, int size);
+
 int RTMP_SendClientBW(RTMP *r);
 
 void RTMP_DropRequest(RTMP *r, int i, int freeit);
@@ -40,17 +40,21 @@
 #define EWOULDBLOCK	WSAETIMEDOUT	/* we don't use nonblocking, but we do use timeouts */
 #define sleep(n)	Sleep(n*1000)
 #define msleep(n)	Sleep(n)
+#define poll(fds,n,t)	WSAPoll(fds,n,t)
 #define SET_RCVTIMEO(tv,s)	int tv = s*1000
 #else /* !_WIN32 */
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/times.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <poll.h>
 
 #define GetSockError()    errno
 #define SetSockError(e)    errno = e
@@ -107,6 +111,8 @@ typedef struct tls_server_ctx {
 #define TLS_write(s,b,l)	ssl_write(s,(unsigned char *)b,l)
 #define TLS_shutdown(s)	ssl_close_notify(s)
 #define TLS_close(s)	ssl_free(s); free(s)
+#define TLS_ktls_enable(s)	((void) (s))
+#define TLS_ktls_send(s)	0
 
 #elif defined(USE_GNUTLS)
 #include <gnutls/gnutls.h>
@@ -124,6 +130,14 @@ typedef struct tls_ctx {
 #define TLS_write(s,b,l)	gnutls_record_send(s,b,l)
 #define TLS_shutdown(s)	gnutls_bye(s, GNUTLS_SHUT_RDWR)
 #define TLS_close(s)	gnutls_deinit(s)
+/* GnuTLS turns kTLS on from its system config */
+#define TLS_ktls_enable(s)	((void) (s))
+#if GNUTLS_VERSION_NUMBER >= 0x030703
+#include <gnutls/socket.h>
+#define TLS_ktls_send(s)	(gnutls_transport_is_ktls_enabled(s) & GNUTLS_KTLS_SEND)
+#else
+#define TLS_ktls_send(s)	0
+#endif
 
 #else	/* USE_OPENSSL */
 #define TLS_CTX    SSL_CTX *
@@ -136,6 +150,23 @@ typedef struct tls_ctx {
 #define TLS_write(s, b, l)    SSL_write(s,b,l)
 #define TLS_shutdown(s)    SSL_shutdown(s)
 #define TLS_close(s)    SSL_free(s)
+#define TLS_SESSION    SSL_SESSION *
+#define TLS_get_session(s)    SSL_get1_session(s)
+#define TLS_set_session(s, ss)    SSL_set_session(s, ss)
+#define TLS_free_session(ss)    SSL_SESSION_free(ss)
+#define TLS_session_reused(s)    SSL_session_reused(s)
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+#define TLS_session_resumable(ss)    SSL_SESSION_is_resumable(ss)
+#else
+#define TLS_session_resumable(ss)    1
+#endif
+#if defined(SSL_OP_ENABLE_KTLS) && defined(BIO_get_ktls_send)
+#define TLS_ktls_enable(s)    SSL_set_options(s, SSL_OP_ENABLE_KTLS)
+#define TLS_ktls_send(s)    BIO_get_ktls_send(SSL_get_wbio(s))
+#else
+#define TLS_ktls_enable(s)    ((void) (s))
+#define TLS_ktls_send(s)    0
+#endif
 
 #endif
 #endif
@@ -0,0 +1,152 @@
+/*
+ *  This file is part of librtmp.
+ *
+ *  librtmp is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation; either version 2.1,
+ *  or (at your option) any later version.
+ *
+ *  librtmp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with librtmp see the file COPYING.  If not, write to
+ *  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *  http://www.gnu.org/copyleft/lesser.html
+ */
+
+/*
+ * Outbound chunk size sweep: the same FLV tags, a 4 Mbit/s mix of video
+ * and audio, go to RTMP_Write at a fixed chunk size each run and once with
+ * the size adapted to the video. A reader on the other end of a socketpair
+ * throws the bytes away. Prints the bytes on the wire over the payload,
+ * the send calls and the writer's CPU time per Mbit of payload.
+ *
+ *   cc -O2 -DNO_CRYPTO -I.. chunk.c ../rtmp.c ../amf.c ../log.c \
+ *       ../parseurl.c -o chunk -lpthread && ./chunk
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "rtmp_sys.h"
+
+#define TAGS        6000
+#define KEYFRAME    (150 * 1024)
+/* every nth video tag is a keyframe */
+#define GOP         50
+
+/* 0 runs with the size adapted to the video */
+static const int sizes[] = {128, 512, 1024, 4096, 16384, 65536, 0};
+
+static char tag[11 + KEYFRAME + 4];
+
+/*
+ * @brief two audio tags for every video tag, 25 frames a second
+ */
+static int TagSize(int i, int *type) {
+    *type = i % 3 ? RTMP_PACKET_TYPE_AUDIO : RTMP_PACKET_TYPE_VIDEO;
+    if (i % 3)
+        return 300 + i % 40;
+    return (i / 3) % GOP ? 12000 + (i * 7919) % 12000 : KEYFRAME;
+}
+
+static double CpuTime(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * @brief write the tags at chunk size, print what it cost
+ */
+static int Run(int size) {
+    RTMP r;
+    char buf[65536];
+    int sv[2], i, n, type, ts, status;
+    double payload = 0, cpu;
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("socketpair");
+        return FALSE;
+    }
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return FALSE;
+    }
+    if (!pid) {
+        close(sv[0]);
+        while (read(sv[1], buf, sizeof(buf)) > 0)
+            ;
+        _exit(0);
+    }
+    close(sv[1]);
+
+    RTMP_Init(&r);
+    r.m_sb.sb_socket = sv[0];
+    r.Link.protocol |= RTMP_FEATURE_WRITE;
+    r.m_stream_id = 1;
+    if (size) {
+        r.m_chunkBudgetMS = 0;
+        if (size != RTMP_DEFAULT_CHUNKSIZE)
+            RTMP_SendChunkSize(&r, size);
+    }
+
+    cpu = CpuTime();
+    for (i = 0; i < TAGS; i++) {
+        n = TagSize(i, &type);
+        ts = i / 3 * 40;
+        tag[0] = type;
+        tag[1] = n >> 16;
+        tag[2] = n >> 8;
+        tag[3] = n;
+        tag[4] = ts >> 16;
+        tag[5] = ts >> 8;
+        tag[6] = ts;
+        tag[7] = tag[8] = tag[9] = tag[10] = 0;
+        tag[11] = type == RTMP_PACKET_TYPE_AUDIO ? 0xaf : (i / 3) % GOP ? 0x27 : 0x17;
+        if (RTMP_Write(&r, tag, 11 + n + 4) <= 0) {
+            fprintf(stderr, "write failed at tag %d\n", i);
+            break;
+        }
+        payload += n;
+    }
+    RTMP_Flush(&r);
+    cpu = CpuTime() - cpu;
+
+    if (size)
+        printf("%8d", size);
+    else
+        printf("   adapt");
+    printf(" %10.0f %9.3f%% %9llu %12.1f", payload,
+            100.0 * ((double) r.m_sb.sb_bytesSent - payload) / payload,
+            (unsigned long long) r.m_sb.sb_sends, cpu * 1e6 / (payload * 8 / 1e6));
+    if (!size)
+        printf("  (ended at %d)", r.m_outChunkSize);
+    printf("\n");
+
+    RTMP_Close(&r);
+    waitpid(pid, &status, 0);
+    return i == TAGS;
+}
+
+int main(void) {
+    size_t i;
+    int ok = TRUE;
+
+    memset(tag + 12, 0x5a, KEYFRAME - 1);
+    printf("   chunk    payload  overhead     sends  cpu us/Mbit\n");
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        ok = Run(sizes[i]) && ok;
+    return !ok;
+}
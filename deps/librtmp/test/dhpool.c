@@ -0,0 +1,165 @@
+/*
+ *  This file is part of librtmp.
+ *
+ *  librtmp is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation; either version 2.1,
+ *  or (at your option) any later version.
+ *
+ *  librtmp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with librtmp see the file COPYING.  If not, write to
+ *  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *  http://www.gnu.org/copyleft/lesser.html
+ */
+
+/*
+ * RTMPE connect cost, the handshake and connect request, with the client
+ * making its Diffie-Hellmann keypair on the spot and with it taken from
+ * RTMP_DHPoolStart's pool. Prints the median latency and the CPU time the
+ * connecting thread spent:
+ *
+ *   cold:   no pool
+ *   pooled: connects paced so the pool is topped up in between
+ *   burst:  connects back to back, more than the pool holds
+ *
+ * The server is a process of its own on loopback, with a pool deep enough
+ * that its side costs the same in every run.
+ *
+ *   cc -O2 -DUSE_GNUTLS -I.. dhpool.c ../rtmp.c ../amf.c ../log.c \
+ *       ../parseurl.c ../hashswf.c -o dhpool -lgnutls -lhogweed -lnettle \
+ *       -lgmp -lz -lpthread && ./dhpool
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "rtmp_sys.h"
+
+#define CONNECTS    50
+#define DEPTH       8
+/* time the pool gets to make up for a take */
+#define PACE_US     50000
+
+static double Now(clockid_t clock) {
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int Compare(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * @brief handshake with whoever connects, read their requests until they
+ * hang up
+ */
+static void Serve(int ls) {
+    RTMP r;
+    char buf[4096];
+    int fd;
+
+    RTMP_DHPoolStart(4 * DEPTH);
+    while ((fd = accept(ls, NULL, NULL)) >= 0) {
+        RTMP_Init(&r);
+        r.m_sb.sb_socket = fd;
+        r.Link.timeout = 10;
+        if (RTMP_Serve(&r)) {
+            while (recv(fd, buf, sizeof(buf), 0) > 0)
+                ;
+        }
+        RTMP_Close(&r);
+    }
+}
+
+/*
+ * @brief connect count times, pausing pace between connects, and print
+ * what they took
+ */
+static int Run(const char *name, const struct sockaddr_in *addr, int count, int pace) {
+    RTMP r;
+    double took[CONNECTS], cpu = 0, start, thread;
+    int i, fd;
+
+    for (i = 0; i < count; i++) {
+        if (pace)
+            usleep(pace);
+        start = Now(CLOCK_MONOTONIC);
+        thread = Now(CLOCK_THREAD_CPUTIME_ID);
+        if ((fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0
+                || connect(fd, (const struct sockaddr *) addr, sizeof(*addr)) < 0) {
+            perror("connect");
+            return FALSE;
+        }
+        RTMP_Init(&r);
+        r.m_sb.sb_socket = fd;
+        r.Link.protocol = RTMP_PROTOCOL_RTMPE;
+        r.Link.timeout = 10;
+        if (!RTMP_Connect1(&r, NULL)) {
+            fprintf(stderr, "handshake %d failed\n", i);
+            return FALSE;
+        }
+        cpu += Now(CLOCK_THREAD_CPUTIME_ID) - thread;
+        took[i] = Now(CLOCK_MONOTONIC) - start;
+        RTMP_Close(&r);
+    }
+    qsort(took, count, sizeof(double), Compare);
+    printf("%-7s %8d %12.2f %12.2f\n", name, count, took[count / 2] * 1000, cpu * 1000 / count);
+    return TRUE;
+}
+
+int main(void) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int ls, status, ok;
+    pid_t pid;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((ls = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0
+            || bind(ls, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(ls, 64) < 0
+            || getsockname(ls, (struct sockaddr *) &addr, &len) < 0) {
+        perror("listen");
+        return 1;
+    }
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (!pid) {
+        Serve(ls);
+        _exit(0);
+    }
+    close(ls);
+    /* the server fills its pool first */
+    usleep(500000);
+
+    printf("        connects   median ms  client cpu ms\n");
+    ok = Run("cold", &addr, CONNECTS, PACE_US);
+    RTMP_DHPoolStart(DEPTH);
+    usleep(500000);
+    ok = Run("pooled", &addr, CONNECTS, PACE_US) && ok;
+    usleep(500000);
+    ok = Run("burst", &addr, CONNECTS, 0) && ok;
+    RTMP_DHPoolStop();
+
+    kill(pid, SIGTERM);
+    waitpid(pid, &status, 0);
+    return !ok;
+}
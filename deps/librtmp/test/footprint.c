@@ -0,0 +1,288 @@
+/*
+ *  This file is part of librtmp.
+ *
+ *  librtmp is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation; either version 2.1,
+ *  or (at your option) any later version.
+ *
+ *  librtmp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with librtmp see the file COPYING.  If not, write to
+ *  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *  http://www.gnu.org/copyleft/lesser.html
+ */
+
+/*
+ * Memory per publishing connection, many of them open at once to a server
+ * process on loopback. Prints the RSS per connection and the mean receive
+ * buffer size:
+ *
+ *   idle:   handshaked, the server's replies to connect read
+ *   active: a few seconds of audio and video tags written
+ *   read:   a large message read from the server, the receive buffer grows
+ *
+ * Linux only, the server waits on epoll. Takes the connection count and
+ * the slabCache option, each connection needs two descriptors:
+ *
+ *   cc -O2 -DNO_CRYPTO -I.. footprint.c ../rtmp.c ../amf.c ../log.c \
+ *       ../parseurl.c -o footprint -lpthread && ./footprint 10000 [slabCache]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+
+#include "rtmp_sys.h"
+
+#define TAGS        30
+/* handshake C1/S1/C2/S2 */
+#define SIG_SIZE    1536
+/* the message the read phase gets, in 128 byte chunks */
+#define LARGE       40000
+
+static long RssKB(void) {
+    long pages, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+
+    if (f) {
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+            resident = 0;
+        fclose(f);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static int ReadAll(int fd, char *buf, int n) {
+    int k;
+
+    while (n > 0) {
+        if ((k = read(fd, buf, n)) <= 0)
+            return FALSE;
+        buf += k;
+        n -= k;
+    }
+    return TRUE;
+}
+
+/*
+ * @brief the server's replies to connect: window ack size, set peer
+ * bandwidth and a 100 byte invoke
+ */
+static int Replies(char *out) {
+    static const unsigned char replies[] = {
+        0x02, 0, 0, 0, 0, 0, 4, RTMP_PACKET_TYPE_SERVER_BW, 0, 0, 0, 0,
+        0x00, 0x26, 0x25, 0xa0,
+        0x02, 0, 0, 0, 0, 0, 5, RTMP_PACKET_TYPE_CLIENT_BW, 0, 0, 0, 0,
+        0x00, 0x26, 0x25, 0xa0, 0x02,
+        0x03, 0, 0, 0, 0, 0, 100, RTMP_PACKET_TYPE_INVOKE, 0, 0, 0, 0,
+    };
+
+    memcpy(out, replies, sizeof(replies));
+    memset(out + sizeof(replies), 0x05, 100);
+    return sizeof(replies) + 100;
+}
+
+/*
+ * @brief a video message of LARGE bytes in 128 byte chunks on stream 1
+ */
+static int Large(char *out) {
+    char *p = out;
+    int left = LARGE, n;
+
+    *p++ = 0x06;
+    memset(p, 0, 3);
+    p += 3;
+    *p++ = LARGE >> 16;
+    *p++ = LARGE >> 8;
+    *p++ = LARGE & 0xff;
+    *p++ = RTMP_PACKET_TYPE_VIDEO;
+    *p++ = 1;
+    memset(p, 0, 3);
+    p += 3;
+    while (left > 0) {
+        n = left < RTMP_DEFAULT_CHUNKSIZE ? left : RTMP_DEFAULT_CHUNKSIZE;
+        memset(p, 0x27, n);
+        p += n;
+        if ((left -= n) > 0)
+            *p++ = 0xc6;
+    }
+    return p - out;
+}
+
+/*
+ * @brief handshake count connections in turn, then drop what they send
+ * and send each the large message once told to on cmd
+ */
+static void Serve(int ls, int cmd, int count) {
+    static char s012[1 + 2 * SIG_SIZE], c012[1 + SIG_SIZE], buf[65536];
+    static char replies[256], large[LARGE + LARGE / RTMP_DEFAULT_CHUNKSIZE + 16];
+    struct epoll_event ev, evs[256];
+    int *fds, ep, i, n, k, nReplies = Replies(replies), nLarge = Large(large);
+
+    s012[0] = 0x03;
+    fds = calloc(count, sizeof(int));
+    ep = epoll_create1(0);
+    for (i = 0; i < count; i++) {
+        if ((fds[i] = accept(ls, NULL, NULL)) < 0
+                || !ReadAll(fds[i], c012, sizeof(c012))
+                || write(fds[i], s012, sizeof(s012)) != sizeof(s012)
+                || !ReadAll(fds[i], c012, SIG_SIZE)
+                || write(fds[i], replies, nReplies) != nReplies)
+            _exit(1);
+        ev.events = EPOLLIN;
+        ev.data.fd = fds[i];
+        epoll_ctl(ep, EPOLL_CTL_ADD, fds[i], &ev);
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = cmd;
+    epoll_ctl(ep, EPOLL_CTL_ADD, cmd, &ev);
+
+    for (;;) {
+        n = epoll_wait(ep, evs, 256, -1);
+        for (k = 0; k < n; k++) {
+            if (evs[k].data.fd != cmd) {
+                if (read(evs[k].data.fd, buf, sizeof(buf)) <= 0)
+                    epoll_ctl(ep, EPOLL_CTL_DEL, evs[k].data.fd, NULL);
+                continue;
+            }
+            if (read(cmd, buf, 1) <= 0)
+                _exit(0);
+            for (i = 0; i < count; i++) {
+                if (write(fds[i], large, nLarge) != nLarge)
+                    _exit(1);
+            }
+        }
+    }
+}
+
+static void Report(const char *phase, RTMP **rs, int count, long base) {
+    double buffers = 0;
+    int i;
+
+    for (i = 0; i < count; i++)
+        buffers += rs[i]->m_sb.sb_bufSize;
+    printf("%-7s %8.1f KB %10.0f\n", phase, (RssKB() - base) / (double) count,
+            buffers / count);
+}
+
+int main(int argc, char **argv) {
+    static char tag[11 + 40000 + 4];
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    RTMP **rs;
+    RTMPPacket p = {0};
+    int count = argc > 1 ? atoi(argv[1]) : 10000;
+    int ls, cmd[2], i, k, n, ts, status;
+    long base;
+    pid_t pid;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((ls = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0
+            || bind(ls, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(ls, 128) < 0
+            || getsockname(ls, (struct sockaddr *) &addr, &len) < 0 || pipe(cmd) < 0) {
+        perror("listen");
+        return 1;
+    }
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (!pid) {
+        close(cmd[1]);
+        Serve(ls, cmd[0], count);
+        _exit(0);
+    }
+    close(ls);
+    close(cmd[0]);
+
+    rs = calloc(count, sizeof(RTMP *));
+    base = RssKB();
+    for (i = 0; i < count; i++) {
+        rs[i] = RTMP_Alloc();
+        RTMP_Init(rs[i]);
+        rs[i]->Link.protocol = RTMP_PROTOCOL_RTMP | RTMP_FEATURE_WRITE;
+        rs[i]->Link.timeout = 10;
+        if (argc > 2)
+            rs[i]->m_slabLimit = atoi(argv[2]);
+        if ((rs[i]->m_sb.sb_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0
+                || connect(rs[i]->m_sb.sb_socket, (struct sockaddr *) &addr, sizeof(addr)) < 0
+                || !RTMP_Connect1(rs[i], NULL)) {
+            fprintf(stderr, "connection %d failed\n", i);
+            return 1;
+        }
+        for (k = 0; k < 3;) {
+            if (!RTMP_ReadPacket(rs[i], &p)) {
+                fprintf(stderr, "connection %d read failed\n", i);
+                return 1;
+            }
+            if (RTMPPacket_IsReady(&p)) {
+                RTMP_ClientPacket(rs[i], &p);
+                RTMP_FreeBody(rs[i], &p);
+                k++;
+            }
+        }
+        rs[i]->m_stream_id = 1;
+    }
+    printf("%d connections, sizeof(RTMP) %zu\n", count, sizeof(RTMP));
+    printf("phase       RSS/conn  recv buffer\n");
+    Report("idle", rs, count, base);
+
+    for (k = 0; k < TAGS; k++) {
+        n = k % 3 ? 180 : 2000 + (k * 7919) % 38000;
+        ts = k * 20;
+        tag[0] = k % 3 ? RTMP_PACKET_TYPE_AUDIO : RTMP_PACKET_TYPE_VIDEO;
+        tag[1] = n >> 16;
+        tag[2] = n >> 8;
+        tag[3] = n;
+        tag[4] = ts >> 16;
+        tag[5] = ts >> 8;
+        tag[6] = ts;
+        tag[7] = tag[8] = tag[9] = tag[10] = 0;
+        memset(tag + 11, k, n);
+        tag[11] = k % 3 ? 0xaf : k ? 0x27 : 0x17;
+        for (i = 0; i < count; i++) {
+            if (RTMP_Write(rs[i], tag, 11 + n + 4) <= 0) {
+                fprintf(stderr, "connection %d write failed\n", i);
+                return 1;
+            }
+        }
+    }
+    for (i = 0; i < count; i++)
+        RTMP_Flush(rs[i]);
+    Report("active", rs, count, base);
+
+    if (write(cmd[1], "", 1) != 1)
+        return 1;
+    for (i = 0; i < count; i++) {
+        do {
+            if (!RTMP_ReadPacket(rs[i], &p)) {
+                fprintf(stderr, "connection %d read failed\n", i);
+                return 1;
+            }
+        } while (!RTMPPacket_IsReady(&p));
+        RTMP_FreeBody(rs[i], &p);
+    }
+    Report("read", rs, count, base);
+
+    for (i = 0; i < count; i++) {
+        RTMP_Close(rs[i]);
+        RTMP_Free(rs[i]);
+    }
+    close(cmd[1]);
+    kill(pid, SIGTERM);
+    waitpid(pid, &status, 0);
+    return 0;
+}
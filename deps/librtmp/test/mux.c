@@ -0,0 +1,277 @@
+/*
+ *  This file is part of librtmp.
+ *
+ *  librtmp is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation; either version 2.1,
+ *  or (at your option) any later version.
+ *
+ *  librtmp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with librtmp see the file COPYING.  If not, write to
+ *  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *  http://www.gnu.org/copyleft/lesser.html
+ */
+
+/*
+ * A mux shared by an audio and a video thread, with a peer on the other
+ * end of a socketpair reading slowly:
+ *
+ *   audio sent while a keyframe of many slices goes out arrives before the
+ *   keyframe is complete,
+ *   a stream opened meanwhile does not hold the audio up, the peer answers
+ *   createStream only once more audio came,
+ *   once the peer is gone the sends waiting and those after return FALSE.
+ *
+ * Exits non-zero on any failure.
+ *
+ *   cc -DNO_CRYPTO -I.. mux.c ../mux.c ../rtmp.c ../amf.c ../log.c \
+ *       ../parseurl.c -o mux -lpthread && ./mux
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "rtmp_sys.h"
+#include "mux.h"
+
+#define CHUNK       4096
+#define KEYFRAME    (64 * CHUNK)
+#define KEYFRAMES   3
+#define AUDIO       40
+/* audio of the stream opened while the others send */
+#define AUDIO2      5
+/* audio the peer waits for before answering createStream */
+#define HOLDBACK    3
+
+#define ADDED_ID    2
+
+typedef struct Sender {
+    RTMP_MuxStream *s;
+    int type, count, size, pauseUS;
+    int failed;
+    /* sends that returned FALSE */
+} Sender;
+
+static int overtaken, audio, audio2, video, holdback = -1;
+
+/*
+ * @brief send a packet of type count times
+ */
+static void *Send(void *arg) {
+    Sender *t = arg;
+    RTMPPacket p = {0};
+    int i;
+
+    RTMPPacket_Alloc(&p, t->size);
+    for (i = 0; i < t->count; i++) {
+        p.m_packetType = t->type;
+        p.m_headerType = i ? RTMP_PACKET_SIZE_MEDIUM : RTMP_PACKET_SIZE_LARGE;
+        p.m_nTimeStamp = i * 20;
+        p.m_nBodySize = t->size;
+        memset(p.m_body, i, t->size);
+        p.m_body[0] = t->type == RTMP_PACKET_TYPE_VIDEO ? 0x17 : 0xaf;
+        if (!RTMP_MuxSend(t->s, &p))
+            t->failed++;
+        if (t->pauseUS)
+            usleep(t->pauseUS);
+    }
+    RTMPPacket_Free(&p);
+    return NULL;
+}
+
+/*
+ * @brief send an invoke on message stream id
+ */
+static int PeerInvoke(RTMP *r, int id, const AVal *method, double txn, int streamId) {
+    static const AVal level = AVC("level"), status = AVC("status"), code = AVC("code"),
+            started = AVC("NetStream.Publish.Start");
+    RTMPPacket packet = {0};
+    char pbuf[512], *pend = pbuf + sizeof(pbuf);
+    char *enc;
+
+    packet.m_nChannel = 0x03;
+    packet.m_headerType = RTMP_PACKET_SIZE_LARGE;
+    packet.m_packetType = RTMP_PACKET_TYPE_INVOKE;
+    packet.m_nInfoField2 = id;
+    packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
+
+    enc = packet.m_body;
+    enc = AMF_EncodeString(enc, pend, method);
+    enc = AMF_EncodeNumber(enc, pend, txn);
+    *enc++ = AMF_NULL;
+    if (streamId)
+        enc = AMF_EncodeNumber(enc, pend, streamId);
+    else {
+        *enc++ = AMF_OBJECT;
+        enc = AMF_EncodeNamedString(enc, pend, &level, &status);
+        enc = AMF_EncodeNamedString(enc, pend, &code, &started);
+        *enc++ = 0;
+        *enc++ = 0;
+        *enc++ = AMF_OBJECT_END;
+    }
+    packet.m_nBodySize = enc - packet.m_body;
+    return RTMP_SendPacket(r, &packet, FALSE);
+}
+
+/*
+ * @brief read the streams until all was sent, slow on video
+ */
+static void *Peer(void *arg) {
+    static const AVal result = AVC("_result"), onStatus = AVC("onStatus"),
+            createStream = AVC("createStream"), publish = AVC("publish");
+    RTMP r;
+    RTMPPacket p = {0};
+    AMFObject obj;
+    AVal method;
+    double txn = 0;
+    int inVideo = FALSE;
+
+    RTMP_Init(&r);
+    r.m_sb.sb_socket = *(int *) arg;
+    r.Link.timeout = 10;
+    r.m_inChunkSize = CHUNK;
+    while (video < KEYFRAMES || audio < AUDIO || audio2 < AUDIO2) {
+        if (!RTMP_ReadPacket(&r, &p))
+            break;
+        if (!RTMPPacket_IsReady(&p)) {
+            if (p.m_packetType == RTMP_PACKET_TYPE_VIDEO) {
+                inVideo = TRUE;
+                usleep(2000);
+            }
+            continue;
+        }
+        switch (p.m_packetType) {
+        case RTMP_PACKET_TYPE_VIDEO:
+            inVideo = FALSE;
+            video++;
+            break;
+        case RTMP_PACKET_TYPE_AUDIO:
+            if (p.m_nInfoField2 == ADDED_ID) {
+                audio2++;
+                break;
+            }
+            audio++;
+            overtaken += inVideo;
+            if (holdback > 0 && !--holdback)
+                PeerInvoke(&r, 0, &result, txn, ADDED_ID);
+            break;
+        case RTMP_PACKET_TYPE_INVOKE:
+            if (AMF_Decode(&obj, p.m_body, p.m_nBodySize, FALSE) < 0)
+                break;
+            AMFProp_GetString(AMF_GetProp(&obj, NULL, 0), &method);
+            if (AVMATCH(&method, &createStream)) {
+                txn = AMFProp_GetNumber(AMF_GetProp(&obj, NULL, 1));
+                holdback = HOLDBACK;
+            }
+            else if (AVMATCH(&method, &publish))
+                PeerInvoke(&r, ADDED_ID, &onStatus, 0, 0);
+            AMF_Reset(&obj);
+            break;
+        default:
+            RTMP_ClientPacket(&r, &p);
+        }
+        RTMP_FreeBody(&r, &p);
+    }
+    RTMP_FreeBody(&r, &p);
+    return NULL;
+}
+
+static RTMP_MuxStream *Open(RTMP_Mux *m, const char *playpath) {
+    AVal av;
+
+    if (!playpath)
+        return RTMP_MuxOpen(m, NULL);
+    av.av_val = (char *) playpath;
+    av.av_len = strlen(playpath);
+    return RTMP_MuxOpen(m, &av);
+}
+
+int main(void) {
+    RTMP r;
+    RTMP_Mux *m;
+    RTMP_MuxStream *s, *s2;
+    Sender v, a, a2;
+    pthread_t peer, tv, ta;
+    int sv[2], size = CHUNK, ok = TRUE;
+    RTMPPacket p = {0};
+
+    signal(SIGPIPE, SIG_IGN);
+    /* a mux that deadlocks fails too */
+    alarm(60);
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("socketpair");
+        return 1;
+    }
+    /* little in flight, the order the mux sends in is the order it arrives in */
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, (char *) &size, sizeof(size));
+
+    RTMP_Init(&r);
+    r.m_sb.sb_socket = sv[0];
+    r.Link.protocol |= RTMP_FEATURE_WRITE;
+    r.Link.timeout = 5;
+    r.m_stream_id = 1;
+    r.m_outChunkSize = CHUNK;
+    r.m_chunkBudgetMS = 0;
+    if (!(m = RTMP_MuxNew(&r)) || !(s = Open(m, NULL))) {
+        fprintf(stderr, "no mux\n");
+        return 1;
+    }
+
+    pthread_create(&peer, NULL, Peer, &sv[1]);
+    v = (Sender) {s, RTMP_PACKET_TYPE_VIDEO, KEYFRAMES, KEYFRAME, 0, 0};
+    a = (Sender) {s, RTMP_PACKET_TYPE_AUDIO, AUDIO, 200, 10000, 0};
+    pthread_create(&tv, NULL, Send, &v);
+    usleep(20000);
+    pthread_create(&ta, NULL, Send, &a);
+    usleep(50000);
+    s2 = Open(m, "cam2");
+    if (s2) {
+        a2 = (Sender) {s2, RTMP_PACKET_TYPE_AUDIO, AUDIO2, 200, 0, 0};
+        Send(&a2);
+    }
+    pthread_join(tv, NULL);
+    pthread_join(ta, NULL);
+    if (!s2)
+        shutdown(sv[0], SHUT_RDWR);
+    pthread_join(peer, NULL);
+    printf("%d of %d audio out during a keyframe, stream %s, %d+%d audio %d video\n",
+            overtaken, AUDIO, s2 ? "added" : "not added", audio, audio2, video);
+    ok = overtaken > 0 && s2 && audio == AUDIO && audio2 == AUDIO2 && video == KEYFRAMES
+            && !v.failed && !a.failed;
+
+    /* the peer stops reading: video fills the socket, audio waits behind it */
+    v = (Sender) {s, RTMP_PACKET_TYPE_VIDEO, 1, KEYFRAME, 0, 0};
+    a = (Sender) {s, RTMP_PACKET_TYPE_AUDIO, 1, 200, 0, 0};
+    pthread_create(&tv, NULL, Send, &v);
+    usleep(20000);
+    pthread_create(&ta, NULL, Send, &a);
+    usleep(100000);
+    close(sv[1]);
+    pthread_join(tv, NULL);
+    pthread_join(ta, NULL);
+
+    /* and what comes after fails right away */
+    RTMPPacket_Alloc(&p, 200);
+    p.m_packetType = RTMP_PACKET_TYPE_AUDIO;
+    p.m_headerType = RTMP_PACKET_SIZE_LARGE;
+    p.m_nBodySize = 200;
+    printf("after the peer closed: video %s, audio %s, next %s\n",
+            v.failed ? "FALSE" : "TRUE", a.failed ? "FALSE" : "TRUE",
+            RTMP_MuxSend(s, &p) ? "TRUE" : "FALSE");
+    ok = ok && v.failed && a.failed && !RTMP_MuxSend(s, &p);
+    RTMPPacket_Free(&p);
+
+    RTMP_MuxFree(m);
+    RTMP_Close(&r);
+    return !ok;
+}
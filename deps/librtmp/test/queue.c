@@ -0,0 +1,229 @@
+//
+//  queue.c
+//  camera-sdk-demo
+//
+//  Created on 26/10/18
+//  Copyright (c) Pili Engineering, Qiniu Inc. All rights reserved.
+//
+
+/*
+ * Throughput of the push queue against the mutex queue it replaced, at 1, 8
+ * and 64 streams pushing at once. Each stream has a writer thread reading
+ * tags and a sender thread handing them to pili_write_packet, stubbed here
+ * to copy the body out as a socket write would.
+ *
+ * mutex: every tag is malloc'd, its body read into it and the pointer
+ *        queued behind a mutex, the sender frees it once written
+ * ring:  the body is read straight into room reserved in the byte ring
+ *
+ *   cc -O2 -I../../../src -I../.. -I../../pili-camera-sdk/src/include \
+ *       queue.c ../../../src/push-queue.c ../../../src/tag-trace.c \
+ *       -o queue -lpthread -lm && ./queue
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "push-queue.h"
+#include "push.h"
+
+// tags pushed over all streams, split between them
+#define TAGS_TOTAL          (64 * 3000)
+#define RING_SIZE           (1024 * 1024)
+#define MUTEX_CAPACITY      256
+#define KEYFRAME_SIZE       (100 * 1024)
+#define KEYFRAME_INTERVAL   60
+
+static __thread char g_sink[KEYFRAME_SIZE];
+static char g_source[KEYFRAME_SIZE];
+
+// stubs for the SDK, the links are always up
+int RTMP_IsConnected(RTMP *r) {
+    (void)r;
+    return 1;
+}
+
+int pili_write_packet(pili_stream_context_p context, flv_tag_p flv_tag) {
+    (void)context;
+    memcpy(g_sink, flv_tag->data, flv_tag->data_size);
+    return 0;
+}
+
+int flv_release_tag(flv_tag_p flv_tag) {
+    free(flv_tag->data);
+    free(flv_tag);
+    return 0;
+}
+
+/*
+ * @brief two audio tags for every video tag, a keyframe every so often
+ */
+static void make_tag(uint32_t i, uint8_t *tag_type, uint32_t *data_size) {
+    if (i % 3) {
+        *tag_type = FLV_TAG_TYPE_AUDIO;
+        *data_size = 150 + i % 100;
+    } else if (0 == (i / 3) % KEYFRAME_INTERVAL) {
+        *tag_type = FLV_TAG_TYPE_VIDEO;
+        *data_size = KEYFRAME_SIZE;
+    } else {
+        *tag_type = FLV_TAG_TYPE_VIDEO;
+        *data_size = 2000 + (i * 7919) % 12000;
+    }
+}
+
+typedef struct mutex_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t  not_empty;
+    pthread_cond_t  not_full;
+    flv_tag_p       entries[MUTEX_CAPACITY];
+    uint32_t        head;
+    uint32_t        count;
+} mutex_queue_t;
+
+static void *mutex_sender(void *arg) {
+    mutex_queue_t *q = arg;
+    flv_tag_p flv_tag;
+
+    for (;;) {
+        pthread_mutex_lock(&q->lock);
+        while (!q->count) {
+            pthread_cond_wait(&q->not_empty, &q->lock);
+        }
+        flv_tag = q->entries[q->head];
+        q->head = (q->head + 1) % MUTEX_CAPACITY;
+        q->count--;
+        pthread_cond_signal(&q->not_full);
+        pthread_mutex_unlock(&q->lock);
+
+        // a NULL tag ends the stream
+        if (!flv_tag) {
+            return NULL;
+        }
+        pili_write_packet(NULL, flv_tag);
+        flv_release_tag(flv_tag);
+    }
+}
+
+static void mutex_push(mutex_queue_t *q, flv_tag_p flv_tag) {
+    pthread_mutex_lock(&q->lock);
+    while (MUTEX_CAPACITY == q->count) {
+        pthread_cond_wait(&q->not_full, &q->lock);
+    }
+    q->entries[(q->head + q->count) % MUTEX_CAPACITY] = flv_tag;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void *mutex_writer(void *arg) {
+    uint32_t tags = *(uint32_t *)arg;
+    mutex_queue_t q;
+    pthread_t sender;
+    flv_tag_p flv_tag;
+    uint32_t i;
+
+    memset(&q, 0, sizeof(q));
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.not_empty, NULL);
+    pthread_cond_init(&q.not_full, NULL);
+    pthread_create(&sender, NULL, mutex_sender, &q);
+
+    for (i = 0; i < tags; i++) {
+        flv_tag = (flv_tag_p)malloc(sizeof(flv_tag_t));
+        make_tag(i, &flv_tag->tag_type, &flv_tag->data_size);
+        flv_tag->timestamp = i * 20;
+        flv_tag->data = malloc(flv_tag->data_size);
+        memcpy(flv_tag->data, g_source, flv_tag->data_size);
+        mutex_push(&q, flv_tag);
+    }
+    mutex_push(&q, NULL);
+
+    pthread_join(sender, NULL);
+    pthread_cond_destroy(&q.not_full);
+    pthread_cond_destroy(&q.not_empty);
+    pthread_mutex_destroy(&q.lock);
+    return NULL;
+}
+
+static void *ring_writer(void *arg) {
+    uint32_t tags = *(uint32_t *)arg;
+    pili_stream_context_t ctx;
+    push_queue_p q;
+    flv_tag_p flv_tag;
+    uint8_t tag_type;
+    uint32_t data_size, i;
+    int ret;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.rtmp = (RTMP *)&ctx;
+    q = push_queue_create(&ctx, RING_SIZE, 0);
+
+    for (i = 0; i < tags; i++) {
+        make_tag(i, &tag_type, &data_size);
+        while (PUSH_QUEUE_WOULD_BLOCK == (ret = push_queue_reserve(q, data_size, 0, &flv_tag))) {
+            push_queue_wait_writable(q);
+        }
+        if (PUSH_QUEUE_OK != ret) {
+            fprintf(stderr, "reserve failed at tag %u\n", i);
+            break;
+        }
+        flv_tag->tag_type = tag_type;
+        flv_tag->timestamp = i * 20;
+        memcpy(flv_tag->data, g_source, data_size);
+        push_queue_commit(q, flv_tag, NULL, NULL, NULL);
+    }
+
+    push_queue_release(q, 1);
+    return NULL;
+}
+
+/*
+ * @brief push TAGS_TOTAL tags over streams at once
+ * @return seconds until all were written
+ */
+static double run(void *(*writer)(void *), int streams) {
+    pthread_t threads[64];
+    uint32_t tags = TAGS_TOTAL / streams;
+    struct timespec start, end;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < streams; i++) {
+        pthread_create(&threads[i], NULL, writer, &tags);
+    }
+    for (i = 0; i < streams; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main(void) {
+    static const int streams[] = {1, 8, 64};
+    double bytes, mutex_s, ring_s;
+    uint8_t tag_type;
+    uint32_t data_size, i;
+    size_t n;
+
+    memset(g_source, 0x5a, sizeof(g_source));
+
+    printf("%d tags over all streams\n", TAGS_TOTAL);
+    printf("streams  mutex tags/s    ring tags/s   mutex MB/s  ring MB/s\n");
+    for (n = 0; n < sizeof(streams) / sizeof(streams[0]); n++) {
+        for (bytes = 0, i = 0; i < TAGS_TOTAL / streams[n]; i++) {
+            make_tag(i, &tag_type, &data_size);
+            bytes += data_size;
+        }
+        bytes *= streams[n];
+
+        mutex_s = run(mutex_writer, streams[n]);
+        ring_s = run(ring_writer, streams[n]);
+        printf("%7d %14.0f %14.0f %12.0f %10.0f\n", streams[n],
+               TAGS_TOTAL / mutex_s, TAGS_TOTAL / ring_s,
+               bytes / mutex_s / 1e6, bytes / ring_s / 1e6);
+    }
+    return 0;
+}
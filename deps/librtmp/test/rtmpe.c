@@ -0,0 +1,187 @@
+/*
+ *  This file is part of librtmp.
+ *
+ *  librtmp is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation; either version 2.1,
+ *  or (at your option) any later version.
+ *
+ *  librtmp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with librtmp see the file COPYING.  If not, write to
+ *  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *  http://www.gnu.org/copyleft/lesser.html
+ */
+
+/*
+ * Send cost of RTMPE against plain RTMP at several payload sizes: video
+ * messages go out with RTMP_SendPacket to a server process on loopback
+ * that handshakes and throws the rest away. Prints the throughput, the
+ * sender's CPU time per MB and the heap allocations the sends made.
+ *
+ * glibc only, malloc is counted by replacing it in this program:
+ *
+ *   cc -O2 -DUSE_GNUTLS -I.. rtmpe.c ../rtmp.c ../amf.c ../log.c \
+ *       ../parseurl.c ../hashswf.c -o rtmpe -lgnutls -lhogweed -lnettle \
+ *       -lgmp -lz -lpthread && ./rtmpe
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "rtmp_sys.h"
+
+/* bytes sent per payload size and protocol */
+#define TOTAL   (64 * 1024 * 1024)
+
+static const int sizes[] = {256, 4096, 16384, 65536, 262144};
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static long allocs;
+
+void *malloc(size_t size) {
+    allocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    allocs++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    allocs++;
+    return __libc_realloc(ptr, size);
+}
+
+static double Now(clockid_t clock) {
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * @brief handshake with whoever connects and drop what they send
+ */
+static void Serve(int ls) {
+    RTMP r;
+    char buf[65536];
+    int fd;
+
+    while ((fd = accept(ls, NULL, NULL)) >= 0) {
+        RTMP_Init(&r);
+        r.m_sb.sb_socket = fd;
+        r.Link.timeout = 10;
+        if (RTMP_Serve(&r)) {
+            while (recv(fd, buf, sizeof(buf), 0) > 0)
+                ;
+        }
+        RTMP_Close(&r);
+    }
+}
+
+/*
+ * @brief send TOTAL bytes in messages of size over protocol, print the cost
+ */
+static int Run(const struct sockaddr_in *addr, int protocol, int size) {
+    RTMP r;
+    RTMPPacket p = {0};
+    double start, cpu;
+    long base;
+    int i, n = TOTAL / size, fd;
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0
+            || connect(fd, (const struct sockaddr *) addr, sizeof(*addr)) < 0) {
+        perror("connect");
+        return FALSE;
+    }
+    RTMP_Init(&r);
+    r.m_sb.sb_socket = fd;
+    r.Link.protocol = protocol | RTMP_FEATURE_WRITE;
+    r.Link.timeout = 10;
+    r.m_chunkBudgetMS = 0;
+    if (!RTMP_Connect1(&r, NULL) || !RTMP_SendChunkSize(&r, 4096)
+            || !RTMPPacket_Alloc(&p, size)) {
+        fprintf(stderr, "connect failed\n");
+        return FALSE;
+    }
+    memset(p.m_body, 0x5a, size);
+    p.m_body[0] = 0x27;
+    p.m_packetType = RTMP_PACKET_TYPE_VIDEO;
+    p.m_nChannel = 0x06;
+    p.m_nInfoField2 = 1;
+    p.m_nBodySize = size;
+
+    start = Now(CLOCK_MONOTONIC);
+    cpu = Now(CLOCK_PROCESS_CPUTIME_ID);
+    base = allocs;
+    for (i = 0; i < n; i++) {
+        p.m_headerType = i ? RTMP_PACKET_SIZE_MEDIUM : RTMP_PACKET_SIZE_LARGE;
+        p.m_nTimeStamp = i * 40;
+        if (!RTMP_SendPacket(&r, &p, FALSE)) {
+            fprintf(stderr, "send failed at message %d\n", i);
+            break;
+        }
+    }
+    base = allocs - base;
+    cpu = Now(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+    start = Now(CLOCK_MONOTONIC) - start;
+
+    printf("%-6s %8d %10.0f %12.2f %8ld\n", protocol & RTMP_FEATURE_ENC ? "rtmpe" : "rtmp",
+            size, TOTAL / 1e6 / start, cpu * 1000 / (TOTAL / 1e6), base);
+    RTMPPacket_Free(&p);
+    RTMP_Close(&r);
+    return i == n;
+}
+
+int main(void) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int ls, status, ok = TRUE;
+    size_t i;
+    pid_t pid;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((ls = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0
+            || bind(ls, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(ls, 8) < 0
+            || getsockname(ls, (struct sockaddr *) &addr, &len) < 0) {
+        perror("listen");
+        return 1;
+    }
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (!pid) {
+        Serve(ls);
+        _exit(0);
+    }
+    close(ls);
+
+    printf("proto      size       MB/s   cpu ms/MB   allocs\n");
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        ok = Run(&addr, RTMP_PROTOCOL_RTMP, sizes[i]) && ok;
+        ok = Run(&addr, RTMP_PROTOCOL_RTMPE, sizes[i]) && ok;
+    }
+
+    kill(pid, SIGTERM);
+    waitpid(pid, &status, 0);
+    return !ok;
+}
@@ -0,0 +1,192 @@
+/*
+ *  This file is part of librtmp.
+ *
+ *  librtmp is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation; either version 2.1,
+ *  or (at your option) any later version.
+ *
+ *  librtmp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with librtmp see the file COPYING.  If not, write to
+ *  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *  http://www.gnu.org/copyleft/lesser.html
+ */
+
+/*
+ * Steady-state packets must not touch the heap: a writer feeding FLV tags
+ * to RTMP_Write and a reader on the other end of a socketpair count the
+ * allocations they make once warmed up, the reader also in bursts holding
+ * several bodies of one size class at once. Exits non-zero on any.
+ *
+ * glibc only, malloc is counted by replacing it in this program:
+ *
+ *   cc -DNO_CRYPTO -I.. slab.c ../rtmp.c ../amf.c ../log.c ../parseurl.c \
+ *       -o slab -lpthread && ./slab
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "rtmp_sys.h"
+
+/* packets before counting, and packets counted */
+#define WARM    300
+#define COUNT   3000
+
+/* bodies the reader holds at once in a burst, past RTMP_SLAB_KEEP */
+#define BURST   8
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static long allocs;
+
+void *malloc(size_t size) {
+    allocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    allocs++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    allocs++;
+    return __libc_realloc(ptr, size);
+}
+
+/*
+ * @brief audio sized tags with a video tag of up to 60KB every third
+ */
+static int TagSize(int i) {
+    return i % 3 ? 150 + i % 60 : 2000 + (i * 7919) % 60000;
+}
+
+/*
+ * @brief read the media messages, every other batch held as a burst
+ * @return allocations made after warming up
+ */
+static long Reader(int fd) {
+    RTMP r;
+    RTMPPacket p, held[BURST];
+    int got = 0, nheld = 0, i;
+    long base = 0;
+
+    RTMP_Init(&r);
+    r.m_sb.sb_socket = fd;
+    r.Link.timeout = 10;
+    memset(&p, 0, sizeof(p));
+    while (got < WARM + COUNT) {
+        if (!RTMP_ReadPacket(&r, &p)) {
+            fprintf(stderr, "reader failed after %d messages\n", got);
+            return -1;
+        }
+        if (!RTMPPacket_IsReady(&p) || !p.m_nBodySize)
+            continue;
+        if (p.m_packetType != RTMP_PACKET_TYPE_AUDIO
+                && p.m_packetType != RTMP_PACKET_TYPE_VIDEO) {
+            RTMP_ClientPacket(&r, &p);
+            RTMP_FreeBody(&r, &p);
+            continue;
+        }
+        if (++got == WARM)
+            base = allocs;
+
+        /* audio of one size class, kept until BURST of them are held */
+        if (p.m_packetType == RTMP_PACKET_TYPE_AUDIO && (got / 100) % 2) {
+            held[nheld++] = p;
+            memset(&p, 0, sizeof(p));
+            if (nheld == BURST) {
+                for (i = 0; i < nheld; i++)
+                    RTMP_FreeBody(&r, &held[i]);
+                nheld = 0;
+            }
+            continue;
+        }
+        RTMP_FreeBody(&r, &p);
+    }
+    for (i = 0; i < nheld; i++)
+        RTMP_FreeBody(&r, &held[i]);
+    base = allocs - base;
+    RTMP_Close(&r);
+    return base;
+}
+
+/*
+ * @brief write the tags as FLV
+ * @return allocations made after warming up
+ */
+static long Writer(int fd) {
+    static char tag[11 + 62000 + 4];
+    RTMP r;
+    int i, n, ts;
+    long base = 0;
+
+    RTMP_Init(&r);
+    r.m_sb.sb_socket = fd;
+    r.Link.protocol |= RTMP_FEATURE_WRITE;
+    r.m_stream_id = 1;
+    for (i = 0; i < WARM + COUNT; i++) {
+        n = TagSize(i);
+        ts = i * 20;
+        tag[0] = i % 3 ? RTMP_PACKET_TYPE_AUDIO : RTMP_PACKET_TYPE_VIDEO;
+        tag[1] = n >> 16;
+        tag[2] = n >> 8;
+        tag[3] = n;
+        tag[4] = ts >> 16;
+        tag[5] = ts >> 8;
+        tag[6] = ts;
+        tag[7] = tag[8] = tag[9] = tag[10] = 0;
+        memset(tag + 11, i, n);
+        tag[11] = i % 3 ? 0xaf : 0x27;
+        if (i == WARM)
+            base = allocs;
+        if (RTMP_Write(&r, tag, 11 + n + 4) <= 0) {
+            fprintf(stderr, "writer failed at tag %d\n", i);
+            return -1;
+        }
+    }
+    base = allocs - base;
+    RTMP_Close(&r);
+    return base;
+}
+
+int main(void) {
+    int sv[2], status;
+    long n;
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("socketpair");
+        return 1;
+    }
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (!pid) {
+        close(sv[0]);
+        n = Reader(sv[1]);
+        printf("reader: %ld allocations over %d messages, bursts of %d\n", n, COUNT, BURST);
+        fflush(stdout);
+        _exit(n != 0);
+    }
+    close(sv[1]);
+    n = Writer(sv[0]);
+    printf("writer: %ld allocations over %d tags\n", n, COUNT);
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+        return 1;
+    return n != 0;
+}
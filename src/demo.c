@@ -10,15 +10,24 @@
 #include <stdlib.h>
 #include "flv-parser.h"
 #include "push.h"
+#include "push-queue.h"
+#include "tag-trace.h"
+
+#define QUEUE_HIGH_WATERMARK_MS 2000
+#define QUEUE_LOW_WATERMARK_MS  500
+#define QUEUE_LATENCY_TARGET_MS 1500
+#define TRACE_SAMPLE_EVERY      10
 
 char *g_url = NULL;
 
 void usage(char *program_name) {
-    printf("Usage: %s [input.flv] [your_push_url]\n", program_name);
+    printf("Usage: %s [input.flv] [your_push_url] [trace.json]\n", program_name);
     exit(-1);
 }
 
 pili_stream_context_p g_ctx = NULL;
+push_queue_p g_queue = NULL;
+tag_tracer_p g_tracer = NULL;
 int g_ready_to_send_packet = 0;
 
 const char *stream_states[] = {
@@ -33,6 +42,14 @@ void stream_state_cb(uint8_t state) {
     printf("=========== %s ===========\n", stream_states[state]);
 }
 
+void queue_high_cb(push_queue_p queue, uint32_t queued_ms, void *opaque) {
+    printf("=========== Queue above high watermark: %u ms ===========\n", queued_ms);
+}
+
+void queue_low_cb(push_queue_p queue, uint32_t queued_ms, void *opaque) {
+    printf("=========== Queue below low watermark: %u ms ===========\n", queued_ms);
+}
+
 void start_push() {
     g_ready_to_send_packet = 0;
     const char *url = g_url;
@@ -51,22 +68,70 @@ void start_push() {
     }
     
     if (!ret) {
+        g_queue = push_queue_create(g_ctx,
+                                    PUSH_QUEUE_SIZE_DEFAULT,
+                                    PILI_STREAM_BUFFER_TIME_INTERVAL_DEFAULT * 1000);
+    }
+    
+    if (g_queue) {
+        push_queue_set_watermarks(g_queue,
+                                  QUEUE_HIGH_WATERMARK_MS,
+                                  QUEUE_LOW_WATERMARK_MS,
+                                  queue_high_cb,
+                                  queue_low_cb,
+                                  NULL);
+        push_queue_set_drop_policy(g_queue,
+                                   PUSH_QUEUE_DROP_POLICY_GOP,
+                                   QUEUE_LATENCY_TARGET_MS);
+        push_queue_set_tracer(g_queue, g_tracer);
         g_ready_to_send_packet = 1;
     } else {
         printf("pili_stream_push_open failed.");
     }
 }
 
+/*
+ * @brief reserve the tag in the push queue, the parser reads its body right
+ * into the queue
+ */
+flv_tag_p reserve_flv_tag(uint32_t data_size) {
+    flv_tag_p flv_tag = NULL;
+    // the header is read, time blocked on a full queue is traced as wait
+    uint64_t read_at = g_tracer ? tag_trace_now() : 0;
+    int ret;
+    
+    // only audio and sequence headers are left when this blocks
+    while (PUSH_QUEUE_WOULD_BLOCK ==
+           (ret = push_queue_reserve(g_queue, data_size, read_at, &flv_tag))) {
+        if (PUSH_QUEUE_OK != push_queue_wait_writable(g_queue)) {
+            return NULL;
+        }
+    }
+    
+    return PUSH_QUEUE_OK == ret ? flv_tag : NULL;
+}
+
+void cancel_flv_tag(flv_tag_p flv_tag) {
+    push_queue_cancel(g_queue, flv_tag);
+}
+
 void parsed_flv_tag(flv_tag_p flv_tag) {
-    if (g_ctx && g_ready_to_send_packet) {
-        pili_write_packet(g_ctx, flv_tag);
+    if (!g_queue) {
+        flv_release_tag(flv_tag);
+        return;
+    }
+    
+    if (!g_ready_to_send_packet) {
+        push_queue_cancel(g_queue, flv_tag);
+    } else if (PUSH_QUEUE_OK != push_queue_commit(g_queue, flv_tag, NULL, NULL, NULL)) {
+        g_ready_to_send_packet = 0;
     }
 }
 
 int main(int argc, char *argv[]) {
     FILE *infile = NULL;
     
-    if (3 != argc) {
+    if (3 != argc && 4 != argc) {
         usage(argv[0]);
     } else {
         infile = fopen(argv[1], "r");
@@ -77,12 +142,23 @@ int main(int argc, char *argv[]) {
         g_url = argv[2];
     }
     
+    g_tracer = tag_tracer_create(4 == argc ? argv[3] : NULL, TRACE_SAMPLE_EVERY);
+    
     start_push();
     
     flv_parser_init(infile);
+    if (g_queue) {
+        flv_parser_set_allocator(reserve_flv_tag, cancel_flv_tag);
+    }
     
     flv_parser_run(parsed_flv_tag);
     
+    push_queue_release(g_queue, 1);
+    if (g_tracer) {
+        printf("=========== Tag latency ===========\n");
+        tag_tracer_print(g_tracer, stdout);
+        tag_tracer_release(g_tracer);
+    }
     pili_stream_push_close(g_ctx);
     pili_release_stream_context(g_ctx);
     
@@ -99,6 +99,12 @@ const char *avc_packet_types[] = {
 
 static FILE *g_infile;
 
+static flv_tag_p flv_default_alloc(uint32_t data_size);
+static void flv_default_release(flv_tag_p flv_tag);
+
+static flv_tag_alloc_callback g_alloc_cb = flv_default_alloc;
+static flv_tag_release_callback g_release_cb = flv_default_release;
+
 void die(void) {
     printf("Error!\n");
     exit(-1);
@@ -206,7 +212,6 @@ void read_audio_tag(flv_tag_p flv_tag) {
     printf("  - Sound size: %u - %s\n", sound_size, sound_sizes[sound_size]);
     printf("  - Sound type: %u - %s\n", sound_type, sound_types[sound_type]);
     
-    flv_tag->data = malloc((size_t) flv_tag->data_size);
     fread(flv_tag->data, (size_t) flv_tag->data_size, 1, g_infile);
 }
 
@@ -226,7 +231,6 @@ void read_video_tag(flv_tag_p flv_tag) {
     printf("  - Frame type: %u - %s\n", frame_type, frame_types[frame_type]);
     printf("  - Codec ID: %u - %s\n", codec_id, codec_ids[codec_id]);
 
-    flv_tag->data = malloc((size_t) flv_tag->data_size);
     fread(flv_tag->data, (size_t) flv_tag->data_size, 1, g_infile);
 }
 
@@ -234,6 +238,32 @@ void flv_parser_init(FILE *in_file) {
     g_infile = in_file;
 }
 
+static flv_tag_p flv_default_alloc(uint32_t data_size) {
+    flv_tag_p tag = (flv_tag_p)malloc(sizeof(flv_tag_t));
+    if (!tag) {
+        return NULL;
+    }
+
+    memset(tag, 0, sizeof(flv_tag_t));
+    tag->data = malloc((size_t) data_size);
+    if (!tag->data) {
+        free(tag);
+        return NULL;
+    }
+    tag->data_size = data_size;
+
+    return tag;
+}
+
+static void flv_default_release(flv_tag_p flv_tag) {
+    flv_release_tag(flv_tag);
+}
+
+void flv_parser_set_allocator(flv_tag_alloc_callback alloc_cb, flv_tag_release_callback release_cb) {
+    g_alloc_cb = alloc_cb ? alloc_cb : flv_default_alloc;
+    g_release_cb = release_cb ? release_cb : flv_default_release;
+}
+
 extern char *put_be16(char *output, uint16_t nVal);
 extern char *put_amf_string(char *c, const char *str);
 
@@ -283,9 +313,9 @@ int flv_parser_run(flv_tag_callback cb) {
         }
         if (hasMetaDataParsed) {
             cb(tag);
+        } else {
+            g_release_cb(tag);
         }
-        
-        flv_release_tag(tag);
     }
 }
 
@@ -311,21 +341,32 @@ int flv_read_header(void) {
 
 flv_tag_p flv_read_tag(int *b_next_is_key) {
     uint32_t prev_tag_size = 0;
-    flv_tag_p tag = (flv_tag_p)malloc(sizeof(flv_tag_t));
+    uint8_t tag_type = 0;
+    uint32_t data_size = 0, timestamp = 0, stream_id = 0;
+    flv_tag_p tag = NULL;
     
-    if (feof(g_infile)) {
+    // Start reading next tag
+    if (1 != fread_1(&tag_type)) {
         return NULL;
     }
-    // Start reading next tag
-    fread_1(&(tag->tag_type));
-    fread_3(&(tag->data_size));
-    read_time(&(tag->timestamp));
-    fread_3(&(tag->stream_id));
+    fread_3(&data_size);
+    read_time(&timestamp);
+    fread_3(&stream_id);
     
     printf("\n");
     printf("Prev tag size: %lu\n", (unsigned long) prev_tag_size);
     
-    printf("Tag type: %u - Tag size: %u\n", tag->tag_type, tag->data_size);
+    printf("Tag type: %u - Tag size: %u\n", tag_type, data_size);
+    
+    // script data goes out behind a 16 bytes @setDataFrame prefix
+    tag = g_alloc_cb(FLV_TAG_TYPE_SCRIPT == tag_type ? data_size + 16 : data_size);
+    if (!tag) {
+        return NULL;
+    }
+    tag->tag_type = tag_type;
+    tag->timestamp = timestamp;
+    tag->stream_id = stream_id;
+    
     switch (tag->tag_type) {
         case FLV_TAG_TYPE_AUDIO:
             read_audio_tag(tag);
@@ -333,21 +374,19 @@ flv_tag_p flv_read_tag(int *b_next_is_key) {
         case FLV_TAG_TYPE_VIDEO:
             read_video_tag(tag);
             break;
-        case FLV_TAG_TYPE_SCRIPT:
-            tag->data = malloc((size_t) tag->data_size);
-            fread(tag->data, (size_t)tag->data_size, 1, g_infile);
-            
-            uint8_t *body = (uint8_t *)malloc(tag->data_size + 16);
-            memset(body, 0, tag->data_size + 16);
-            uint8_t *tmp_body = body;
+        case FLV_TAG_TYPE_SCRIPT: {
+            uint8_t *tmp_body = (uint8_t *)tag->data;
             tmp_body = (uint8_t *)put_amf_string((char *)tmp_body, "@setDataFrame");
-            memcpy(tmp_body, tag->data, tag->data_size);
-            
-            free(tag->data);
-            tag->data = body;
-            tag->data_size += 16;
+            // marker, length and 13 characters fill the 16 bytes, the body
+            // the rest, nothing of the ring is left unwritten
+            assert(tmp_body == (uint8_t *)tag->data + 16);
+            if (data_size && 1 != fread(tmp_body, (size_t) data_size, 1, g_infile)) {
+                g_release_cb(tag);
+                return NULL;
+            }
             
             break;
+        }
         default:
             printf("Unknown tag type!\n");
             die();
@@ -50,6 +50,21 @@ size_t fread_4s(uint32_t *ptr);
 
 void flv_parser_init(FILE *in_file);
 
+/*
+ * @brief where flv_read_tag reads tags into, the defaults malloc the tag
+ * and release it with flv_release_tag
+ *
+ * alloc_cb returns a tag with data and data_size set, NULL stops the parser.
+ */
+typedef flv_tag_p (*flv_tag_alloc_callback)(uint32_t data_size);
+typedef void (*flv_tag_release_callback)(flv_tag_p flv_tag);
+
+void flv_parser_set_allocator(flv_tag_alloc_callback alloc_cb, flv_tag_release_callback release_cb);
+
+/*
+ * @brief the callback takes ownership of flv_tag and releases it with the
+ * release callback of the allocator
+ */
 typedef void (*flv_tag_callback)(flv_tag_p flv_tag);
 
 int flv_parser_run(flv_tag_callback cb);
@@ -0,0 +1,802 @@
+//
+//  push-queue.c
+//  camera-sdk-demo
+//
+//  Created on 26/10/18
+//  Copyright (c) Pili Engineering, Qiniu Inc. All rights reserved.
+//
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "push-queue.h"
+#include "push.h"
+
+#define CACHE_LINE_SIZE 64
+#define CACHE_ALIGN(n)  (((n) + CACHE_LINE_SIZE - 1) & ~((size_t)CACHE_LINE_SIZE - 1))
+
+#define WATERMARK_NONE  0
+#define WATERMARK_HIGH  1
+#define WATERMARK_LOW   2
+
+/*
+ * @brief drop classes of a queued tag, higher is dropped first
+ */
+#define TAG_KEEP            0   // audio, script data, sequence headers
+#define TAG_KEYFRAME        1
+#define TAG_INTERFRAME      2
+#define TAG_DISPOSABLE      3   // disposable or non-reference video frame
+
+#define AVC_NAL_LENGTH_SIZE_DEFAULT 4
+
+/*
+ * @brief record states, the sender claims QUEUED -> SENDING and the writer
+ * claims QUEUED -> DROPPED, whoever wins owns the record
+ */
+#define RECORD_QUEUED   0
+#define RECORD_SENDING  1
+#define RECORD_DROPPED  2
+#define RECORD_PADDING  3   // fills the ring up to its end before wrapping
+#define RECORD_SENT     4
+
+/*
+ * @brief send lanes, each lane is sent in order and the lane heads are
+ * interleaved earliest deadline first
+ */
+#define LANE_CONTROL    0   // script data
+#define LANE_AUDIO      1
+#define LANE_VIDEO      2
+#define LANE_COUNT      3
+#define LANE_NONE       LANE_COUNT
+
+/*
+ * @brief a queued tag, the tag body follows the header in the ring
+ */
+typedef struct push_record {
+    atomic_uint         state;
+    uint32_t            size;       // header and body, multiple of CACHE_LINE_SIZE
+    uint8_t             drop_class;
+    uint8_t             lane;
+    push_tag_done_cb    done_cb;
+    void                *opaque;
+    tag_trace_t         trace;
+    flv_tag_t           tag;
+} push_record_t;
+
+#define RECORD_HEADER_SIZE  CACHE_ALIGN(sizeof(push_record_t))
+
+/*
+ * @brief single producer / single consumer byte ring
+ *
+ * head and tail are free running byte offsets, head is only written by the
+ * writing thread and tail only by the sender thread. The lock is only taken
+ * to park a thread that has nothing to do.
+ */
+struct push_queue {
+    pili_stream_context_p   ctx;
+    uint8_t                 *buffer;
+    size_t                  size;
+    uint32_t                max_ms;
+    uint32_t                video_slack_ms;
+
+    uint8_t                 drop_frame_policy;
+    uint32_t                latency_target_ms;
+
+    uint32_t                high_ms;
+    uint32_t                low_ms;
+    push_watermark_cb       high_cb;
+    push_watermark_cb       low_cb;
+    void                    *watermark_opaque;
+
+    tag_tracer_p            tracer;
+
+    // written by the writing thread
+    atomic_size_t           head __attribute__((aligned(CACHE_LINE_SIZE)));
+    atomic_uint             last_ts;
+    size_t                  wanted;     // bytes the last failed reservation needed
+    int                     skip_to_keyframe;
+    int                     nal_length_size;
+
+    // written by the sender thread
+    atomic_size_t           tail __attribute__((aligned(CACHE_LINE_SIZE)));
+    size_t                  lane_pos[LANE_COUNT];
+
+    atomic_int              above_high __attribute__((aligned(CACHE_LINE_SIZE)));
+    atomic_int              broken;
+    atomic_int              closing;
+    atomic_int              drain;
+    atomic_int              sender_waiting;
+    atomic_int              writer_waiting;
+
+    pthread_mutex_t         lock;
+    pthread_cond_t          readable;
+    pthread_cond_t          writable;
+    pthread_t               sender;
+};
+
+static push_record_t *record_at(push_queue_p q, size_t pos) {
+    return (push_record_t *)(q->buffer + pos % q->size);
+}
+
+static push_record_t *record_of(flv_tag_p tag) {
+    return (push_record_t *)((uint8_t *)tag - offsetof(push_record_t, tag));
+}
+
+/*
+ * @brief tell whether every VCL NAL unit of an AVC frame has nal_ref_idc 0
+ */
+static int avc_is_non_reference(const uint8_t *nalus, uint32_t size, int nal_length_size) {
+    uint32_t pos = 0, nal_size;
+    int i, vcl = 0;
+
+    while (pos + nal_length_size < size) {
+        nal_size = 0;
+        for (i = 0; i < nal_length_size; i++) {
+            nal_size = (nal_size << 8) | nalus[pos + i];
+        }
+        pos += nal_length_size;
+        if (!nal_size || nal_size > size - pos) {
+            return 0;
+        }
+
+        // nal_unit_type 1 - 5 are coded slices
+        if ((nalus[pos] & 0x1f) >= 1 && (nalus[pos] & 0x1f) <= 5) {
+            if (nalus[pos] & 0x60) {
+                return 0;
+            }
+            vcl = 1;
+        }
+        pos += nal_size;
+    }
+
+    return vcl;
+}
+
+static uint8_t classify_tag(push_queue_p q, flv_tag_p tag) {
+    const uint8_t *data = (const uint8_t *)tag->data;
+    uint8_t frame_type;
+
+    if (FLV_TAG_TYPE_VIDEO != tag->tag_type || tag->data_size < 1) {
+        return TAG_KEEP;
+    }
+
+    frame_type = data[0] & 0xf0;
+    if ((data[0] & 0x0f) == FLV_VIDEO_TAG_CODEC_AVC) {
+        if (tag->data_size < 5) {
+            return TAG_KEEP;
+        }
+        if (0 == data[1]) {
+            // AVCDecoderConfigurationRecord, lengthSizeMinusOne is in byte 4
+            if (tag->data_size > 9) {
+                q->nal_length_size = (data[9] & 0x03) + 1;
+            }
+            return TAG_KEEP;
+        }
+        if (1 != data[1]) {
+            return TAG_KEEP;
+        }
+        if (FLV_VIDEO_TAG_FRAME_TYPE_INTERFRAME == frame_type
+            && avc_is_non_reference(data + 5, tag->data_size - 5, q->nal_length_size)) {
+            return TAG_DISPOSABLE;
+        }
+    }
+
+    switch (frame_type) {
+        case FLV_VIDEO_TAG_FRAME_TYPE_KEYFRAME:
+        case FLV_VIDEO_TAG_FRAME_TYPE_GENERATED_KEYFRAME:
+            return TAG_KEYFRAME;
+        case FLV_VIDEO_TAG_FRAME_TYPE_INTERFRAME:
+            return TAG_INTERFRAME;
+        case FLV_VIDEO_TAG_FRAME_TYPE_DISPOSABLE_INTERFRAME:
+            return TAG_DISPOSABLE;
+        default:
+            return TAG_KEEP;
+    }
+}
+
+static uint8_t lane_of(flv_tag_p tag) {
+    switch (tag->tag_type) {
+        case FLV_TAG_TYPE_AUDIO:
+            return LANE_AUDIO;
+        case FLV_TAG_TYPE_VIDEO:
+            return LANE_VIDEO;
+        default:
+            return LANE_CONTROL;
+    }
+}
+
+/*
+ * @brief media duration between the oldest unsent tag and the newest one
+ * @param[in] droppable_only: start from the oldest video frame that can
+ *            still be dropped instead
+ */
+static uint32_t queued_ms(push_queue_p q, int droppable_only) {
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_acquire);
+    size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    uint32_t last = atomic_load_explicit(&q->last_ts, memory_order_relaxed);
+    push_record_t *rec = NULL;
+    unsigned int state;
+
+    for (; pos != head; pos += rec->size) {
+        rec = record_at(q, pos);
+        state = atomic_load_explicit(&rec->state, memory_order_relaxed);
+        if (RECORD_PADDING == state || RECORD_DROPPED == state || RECORD_SENT == state) {
+            continue;
+        }
+        if (droppable_only && (RECORD_QUEUED != state || TAG_KEEP == rec->drop_class)) {
+            continue;
+        }
+        return last > rec->tag.timestamp ? last - rec->tag.timestamp : 0;
+    }
+
+    return 0;
+}
+
+static size_t free_bytes(push_queue_p q) {
+    return q->size - (atomic_load_explicit(&q->head, memory_order_relaxed)
+                      - atomic_load_explicit(&q->tail, memory_order_acquire));
+}
+
+static int is_writable(push_queue_p q) {
+    return free_bytes(q) >= q->wanted
+           && !(q->max_ms && queued_ms(q, 0) >= q->max_ms);
+}
+
+static void wake_sender(push_queue_p q) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&q->sender_waiting, memory_order_relaxed)) {
+        pthread_mutex_lock(&q->lock);
+        pthread_cond_signal(&q->readable);
+        pthread_mutex_unlock(&q->lock);
+    }
+}
+
+static void wake_writer(push_queue_p q) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&q->writer_waiting, memory_order_relaxed)) {
+        pthread_mutex_lock(&q->lock);
+        pthread_cond_broadcast(&q->writable);
+        pthread_mutex_unlock(&q->lock);
+    }
+}
+
+static int drop_record(push_record_t *rec) {
+    unsigned int state = RECORD_QUEUED;
+
+    if (!atomic_compare_exchange_strong(&rec->state, &state, RECORD_DROPPED)) {
+        return 0;
+    }
+    if (rec->done_cb) {
+        rec->done_cb(&rec->tag, PUSH_QUEUE_DROPPED, rec->opaque);
+    }
+    return 1;
+}
+
+/*
+ * @brief drop the oldest queued disposable frame
+ */
+static int drop_disposable(push_queue_p q) {
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_acquire);
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    push_record_t *rec = NULL;
+
+    for (; pos != head; pos += rec->size) {
+        rec = record_at(q, pos);
+        if (TAG_DISPOSABLE == rec->drop_class && drop_record(rec)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * @brief drop the oldest queued video up to the next keyframe, the viewer
+ * sees a freeze instead of a corrupted picture
+ */
+static int drop_gop(push_queue_p q) {
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_acquire);
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    push_record_t *rec = NULL;
+    int dropped = 0;
+
+    for (; pos != head; pos += rec->size) {
+        rec = record_at(q, pos);
+        if (RECORD_PADDING == atomic_load_explicit(&rec->state, memory_order_relaxed)
+            || TAG_KEEP == rec->drop_class) {
+            continue;
+        }
+        if (TAG_KEYFRAME == rec->drop_class && dropped) {
+            return dropped;
+        }
+        dropped |= drop_record(rec);
+    }
+
+    if (dropped) {
+        // the rest of this GOP is still to come
+        q->skip_to_keyframe = 1;
+    }
+    return dropped;
+}
+
+/*
+ * @brief drop video frames according to the drop policy, called on the
+ * writing thread
+ * @param[in] force: drop at least one round even below the latency target
+ */
+static void drop_frames(push_queue_p q, int force) {
+    while (force || (q->latency_target_ms && queued_ms(q, 1) > q->latency_target_ms)) {
+        force = 0;
+        if (drop_disposable(q)) {
+            continue;
+        }
+        if (q->drop_frame_policy < PUSH_QUEUE_DROP_POLICY_GOP || !drop_gop(q)) {
+            break;
+        }
+    }
+}
+
+static int check_watermark(push_queue_p q, uint32_t *ms) {
+    if (!q->high_ms) {
+        return WATERMARK_NONE;
+    }
+
+    *ms = queued_ms(q, 0);
+    if (*ms >= q->high_ms && !atomic_exchange(&q->above_high, 1)) {
+        return WATERMARK_HIGH;
+    }
+    if (*ms <= q->low_ms && atomic_exchange(&q->above_high, 0)) {
+        return WATERMARK_LOW;
+    }
+    return WATERMARK_NONE;
+}
+
+static void fire_watermark(push_queue_p q, int event, uint32_t ms) {
+    if (WATERMARK_HIGH == event && q->high_cb) {
+        q->high_cb(q, ms, q->watermark_opaque);
+    } else if (WATERMARK_LOW == event && q->low_cb) {
+        q->low_cb(q, ms, q->watermark_opaque);
+    }
+}
+
+/*
+ * @brief give finished records at the tail back to the writer
+ */
+static size_t advance_tail(push_queue_p q, size_t head) {
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    push_record_t *rec = NULL;
+    unsigned int state;
+    int advanced = 0;
+
+    for (; tail != head; tail += rec->size, advanced = 1) {
+        rec = record_at(q, tail);
+        state = atomic_load_explicit(&rec->state, memory_order_acquire);
+        if (RECORD_QUEUED == state || RECORD_SENDING == state) {
+            break;
+        }
+    }
+
+    if (advanced) {
+        atomic_store_explicit(&q->tail, tail, memory_order_release);
+        wake_writer(q);
+    }
+    return tail;
+}
+
+/*
+ * @brief oldest queued record of a lane, NULL if there is none
+ */
+static push_record_t *lane_head(push_queue_p q, int lane, size_t tail, size_t head) {
+    size_t pos = q->lane_pos[lane];
+    push_record_t *rec = NULL;
+
+    if (pos - tail > head - tail) {
+        // behind the tail or not set yet
+        pos = tail;
+    }
+
+    for (; pos != head; pos += rec->size) {
+        rec = record_at(q, pos);
+        if (lane == rec->lane
+            && RECORD_QUEUED == atomic_load_explicit(&rec->state, memory_order_relaxed)) {
+            break;
+        }
+    }
+
+    q->lane_pos[lane] = pos;
+    return pos != head ? rec : NULL;
+}
+
+/*
+ * @brief pick the lane head with the earliest deadline
+ *
+ * A tag is due at its timestamp, video gets video_slack_ms on top so audio
+ * and script data up to that far ahead overtake a large video frame. Ties go
+ * to the lower lane.
+ */
+static push_record_t *pick_record(push_queue_p q, size_t tail, size_t head) {
+    push_record_t *rec = NULL, *best = NULL;
+    uint32_t deadline, best_deadline = 0;
+    int lane;
+
+    for (lane = 0; lane < LANE_COUNT; lane++) {
+        rec = lane_head(q, lane, tail, head);
+        if (!rec) {
+            continue;
+        }
+        deadline = rec->tag.timestamp + (LANE_VIDEO == lane ? q->video_slack_ms : 0);
+        if (!best || (int32_t)(deadline - best_deadline) < 0) {
+            best = rec;
+            best_deadline = deadline;
+        }
+    }
+
+    return best;
+}
+
+/*
+ * @brief whether the SDK still has its RTMP link up, pili_write_packet
+ * returns 0 both when the link is down and when it closes it on a failed send
+ */
+static int link_connected(push_queue_p q) {
+    return NULL != q->ctx->rtmp && RTMP_IsConnected(q->ctx->rtmp);
+}
+
+static void *push_queue_sender(void *arg) {
+    push_queue_p q = (push_queue_p)arg;
+    push_record_t *rec = NULL;
+    unsigned int state;
+    size_t tail, head;
+    uint32_t ms = 0;
+    int ret;
+
+    for (;;) {
+        head = atomic_load_explicit(&q->head, memory_order_acquire);
+        tail = advance_tail(q, head);
+
+        rec = pick_record(q, tail, head);
+        if (!rec) {
+            if (tail == head && atomic_load(&q->closing)) {
+                break;
+            }
+
+            pthread_mutex_lock(&q->lock);
+            atomic_store(&q->sender_waiting, 1);
+            atomic_thread_fence(memory_order_seq_cst);
+            while (head == atomic_load_explicit(&q->head, memory_order_acquire)
+                   && !atomic_load(&q->closing)) {
+                pthread_cond_wait(&q->readable, &q->lock);
+            }
+            atomic_store(&q->sender_waiting, 0);
+            pthread_mutex_unlock(&q->lock);
+            continue;
+        }
+
+        // the tag is sent straight from the ring, the record is only given
+        // back to the writer once every record before it is done
+        state = RECORD_QUEUED;
+        if (!atomic_compare_exchange_strong(&rec->state, &state, RECORD_SENDING)) {
+            // dropped by the writer meanwhile
+            continue;
+        }
+
+        ret = PUSH_QUEUE_OK;
+        if (atomic_load(&q->broken)
+            || (atomic_load(&q->closing) && !atomic_load(&q->drain))) {
+            ret = PUSH_QUEUE_ERROR;
+        } else {
+            if (q->tracer) {
+                rec->trace.at[TAG_TRACE_DEQUEUE] = tag_trace_now();
+            }
+            if (!link_connected(q)
+                || 0 != pili_write_packet(q->ctx, &rec->tag)
+                || !link_connected(q)) {
+                atomic_store(&q->broken, 1);
+                wake_writer(q);
+                ret = PUSH_QUEUE_ERROR;
+            } else if (q->tracer) {
+                rec->trace.at[TAG_TRACE_WRITTEN] = tag_trace_now();
+                tag_tracer_record(q->tracer, &rec->tag, &rec->trace);
+            }
+        }
+        if (rec->done_cb) {
+            rec->done_cb(&rec->tag, ret, rec->opaque);
+        }
+        atomic_store_explicit(&rec->state, RECORD_SENT, memory_order_release);
+
+        ret = check_watermark(q, &ms);
+        fire_watermark(q, ret, ms);
+    }
+
+    return NULL;
+}
+
+push_queue_p push_queue_create(pili_stream_context_p ctx, uint32_t size, uint32_t max_ms) {
+    push_queue_p q = NULL;
+
+    assert(NULL != ctx);
+    if (posix_memalign((void **)&q, CACHE_LINE_SIZE, sizeof(push_queue_t))) {
+        return NULL;
+    }
+    memset(q, 0, sizeof(push_queue_t));
+
+    q->ctx = ctx;
+    q->size = CACHE_ALIGN(size ? size : PUSH_QUEUE_SIZE_DEFAULT);
+    q->max_ms = max_ms;
+    q->video_slack_ms = PUSH_QUEUE_VIDEO_SLACK_DEFAULT;
+    q->nal_length_size = AVC_NAL_LENGTH_SIZE_DEFAULT;
+    if (posix_memalign((void **)&q->buffer, CACHE_LINE_SIZE, q->size)) {
+        free(q);
+        return NULL;
+    }
+
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->readable, NULL);
+    pthread_cond_init(&q->writable, NULL);
+
+    if (0 != pthread_create(&q->sender, NULL, push_queue_sender, q)) {
+        pthread_cond_destroy(&q->writable);
+        pthread_cond_destroy(&q->readable);
+        pthread_mutex_destroy(&q->lock);
+        free(q->buffer);
+        free(q);
+        return NULL;
+    }
+
+    return q;
+}
+
+void push_queue_set_watermarks(push_queue_p queue,
+                               uint32_t high_ms,
+                               uint32_t low_ms,
+                               push_watermark_cb high_cb,
+                               push_watermark_cb low_cb,
+                               void *opaque) {
+    assert(NULL != queue);
+    assert(low_ms <= high_ms);
+
+    queue->high_ms = high_ms;
+    queue->low_ms = low_ms;
+    queue->high_cb = high_cb;
+    queue->low_cb = low_cb;
+    queue->watermark_opaque = opaque;
+    atomic_store(&queue->above_high, 0);
+}
+
+void push_queue_set_drop_policy(push_queue_p queue,
+                                uint8_t drop_frame_policy,
+                                uint32_t latency_target_ms) {
+    assert(NULL != queue);
+
+    queue->drop_frame_policy = drop_frame_policy;
+    queue->latency_target_ms = latency_target_ms;
+}
+
+void push_queue_set_tracer(push_queue_p queue, tag_tracer_p tracer) {
+    assert(NULL != queue);
+
+    queue->tracer = tracer;
+}
+
+void push_queue_set_video_slack(push_queue_p queue, uint32_t video_slack_ms) {
+    assert(NULL != queue);
+
+    queue->video_slack_ms = video_slack_ms;
+}
+
+int push_queue_reserve(push_queue_p queue, uint32_t data_size, uint64_t read_at, flv_tag_p *flv_tag) {
+    push_record_t *rec = NULL;
+    size_t head, pos, contiguous, record_size;
+
+    assert(NULL != queue);
+    assert(NULL != flv_tag);
+
+    *flv_tag = NULL;
+    if (atomic_load(&queue->broken) || atomic_load(&queue->closing)) {
+        return PUSH_QUEUE_ERROR;
+    }
+
+    record_size = RECORD_HEADER_SIZE + CACHE_ALIGN(data_size);
+    if (record_size > queue->size) {
+        return PUSH_QUEUE_ERROR;
+    }
+
+    head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    pos = head % queue->size;
+    contiguous = queue->size - pos;
+
+    if (record_size > contiguous) {
+        // records never wrap, pad the end of the ring and start over at 0
+        if (free_bytes(queue) < contiguous) {
+            queue->wanted = contiguous;
+            // what is dropped comes back once the sender passes it, the
+            // padding is retried by the next reserve
+            if (PUSH_QUEUE_DROP_POLICY_NONE != queue->drop_frame_policy) {
+                drop_frames(queue, 1);
+            }
+            return PUSH_QUEUE_WOULD_BLOCK;
+        }
+        rec = record_at(queue, head);
+        atomic_store_explicit(&rec->state, RECORD_PADDING, memory_order_relaxed);
+        rec->size = contiguous;
+        rec->drop_class = TAG_KEEP;
+        rec->lane = LANE_NONE;
+        atomic_store_explicit(&queue->head, head + contiguous, memory_order_release);
+        wake_sender(queue);
+        head += contiguous;
+    }
+
+    queue->wanted = record_size;
+    if (!is_writable(queue)) {
+        if (PUSH_QUEUE_DROP_POLICY_NONE != queue->drop_frame_policy) {
+            drop_frames(queue, 1);
+        }
+        return PUSH_QUEUE_WOULD_BLOCK;
+    }
+
+    rec = record_at(queue, head);
+    atomic_store_explicit(&rec->state, RECORD_QUEUED, memory_order_relaxed);
+    rec->size = record_size;
+    rec->drop_class = TAG_KEEP;
+    rec->lane = LANE_NONE;
+    rec->done_cb = NULL;
+    rec->opaque = NULL;
+    memset(&rec->tag, 0, sizeof(flv_tag_t));
+    rec->tag.data = (uint8_t *)rec + RECORD_HEADER_SIZE;
+    rec->tag.data_size = data_size;
+    if (queue->tracer) {
+        rec->trace.at[TAG_TRACE_RESERVED] = tag_trace_now();
+        rec->trace.at[TAG_TRACE_READ] = read_at ? read_at : rec->trace.at[TAG_TRACE_RESERVED];
+    }
+
+    *flv_tag = &rec->tag;
+    return PUSH_QUEUE_OK;
+}
+
+int push_queue_commit(push_queue_p queue,
+                      flv_tag_p flv_tag,
+                      push_tag_done_cb done_cb,
+                      void *opaque,
+                      uint32_t *queued_ms_out) {
+    push_record_t *rec = NULL;
+    size_t head;
+    uint32_t ms = 0;
+    int event;
+
+    assert(NULL != queue);
+    assert(NULL != flv_tag);
+
+    rec = record_of(flv_tag);
+    head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    assert(record_at(queue, head) == rec);
+
+    if (atomic_load(&queue->broken) || atomic_load(&queue->closing)) {
+        return PUSH_QUEUE_ERROR;
+    }
+
+    rec->drop_class = classify_tag(queue, flv_tag);
+    rec->lane = lane_of(flv_tag);
+    rec->done_cb = done_cb;
+    rec->opaque = opaque;
+
+    if (queue->skip_to_keyframe && TAG_KEEP != rec->drop_class) {
+        if (TAG_KEYFRAME == rec->drop_class) {
+            queue->skip_to_keyframe = 0;
+        } else {
+            // never published, the reservation is simply reused
+            if (done_cb) {
+                done_cb(flv_tag, PUSH_QUEUE_DROPPED, opaque);
+            }
+            goto done;
+        }
+    }
+
+    if (queue->tracer) {
+        rec->trace.at[TAG_TRACE_ENQUEUE] = tag_trace_now();
+    }
+    atomic_store_explicit(&queue->last_ts, flv_tag->timestamp, memory_order_relaxed);
+    atomic_store_explicit(&queue->head, head + rec->size, memory_order_release);
+    wake_sender(queue);
+
+    if (PUSH_QUEUE_DROP_POLICY_NONE != queue->drop_frame_policy) {
+        drop_frames(queue, 0);
+    }
+
+done:
+    event = check_watermark(queue, &ms);
+    fire_watermark(queue, event, ms);
+    if (queued_ms_out) {
+        *queued_ms_out = queue->high_ms ? ms : queued_ms(queue, 0);
+    }
+
+    return PUSH_QUEUE_OK;
+}
+
+void push_queue_cancel(push_queue_p queue, flv_tag_p flv_tag) {
+    assert(NULL != queue);
+    assert(record_at(queue, atomic_load_explicit(&queue->head, memory_order_relaxed))
+           == record_of(flv_tag));
+
+    // nothing was published, the next reservation reuses the space
+}
+
+int push_queue_try_write(push_queue_p queue,
+                         flv_tag_p flv_tag,
+                         push_tag_done_cb done_cb,
+                         void *opaque,
+                         uint32_t *queued_ms_out) {
+    flv_tag_p queued = NULL;
+    int ret;
+
+    assert(NULL != flv_tag);
+
+    ret = push_queue_reserve(queue, flv_tag->data_size, 0, &queued);
+    if (PUSH_QUEUE_OK != ret) {
+        if (queued_ms_out) {
+            *queued_ms_out = queued_ms(queue, 0);
+        }
+        return ret;
+    }
+
+    queued->tag_type = flv_tag->tag_type;
+    queued->timestamp = flv_tag->timestamp;
+    queued->stream_id = flv_tag->stream_id;
+    memcpy(queued->data, flv_tag->data, flv_tag->data_size);
+
+    ret = push_queue_commit(queue, queued, done_cb, opaque, queued_ms_out);
+    if (PUSH_QUEUE_OK == ret) {
+        flv_release_tag(flv_tag);
+    }
+
+    return ret;
+}
+
+int push_queue_wait_writable(push_queue_p queue) {
+    int ret;
+
+    assert(NULL != queue);
+
+    pthread_mutex_lock(&queue->lock);
+    atomic_store(&queue->writer_waiting, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    while (!atomic_load(&queue->broken) && !atomic_load(&queue->closing)
+           && !is_writable(queue)) {
+        pthread_cond_wait(&queue->writable, &queue->lock);
+    }
+    atomic_store(&queue->writer_waiting, 0);
+    ret = (atomic_load(&queue->broken) || atomic_load(&queue->closing))
+          ? PUSH_QUEUE_ERROR : PUSH_QUEUE_OK;
+    pthread_mutex_unlock(&queue->lock);
+
+    return ret;
+}
+
+uint32_t push_queue_queued_ms(push_queue_p queue) {
+    assert(NULL != queue);
+
+    return queued_ms(queue, 0);
+}
+
+void push_queue_release(push_queue_p queue, int drain) {
+    if (!queue) {
+        return;
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    atomic_store(&queue->drain, drain);
+    atomic_store(&queue->closing, 1);
+    pthread_cond_signal(&queue->readable);
+    pthread_cond_broadcast(&queue->writable);
+    pthread_mutex_unlock(&queue->lock);
+
+    pthread_join(queue->sender, NULL);
+
+    pthread_cond_destroy(&queue->writable);
+    pthread_cond_destroy(&queue->readable);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->buffer);
+    free(queue);
+}
@@ -0,0 +1,169 @@
+//
+//  push-queue.h
+//  camera-sdk-demo
+//
+//  Created on 26/10/18
+//  Copyright (c) Pili Engineering, Qiniu Inc. All rights reserved.
+//
+
+#ifndef PUSH_QUEUE_H_
+#define PUSH_QUEUE_H_ (1)
+
+#include <stdint.h>
+
+#include "pili_type.h"
+#include "flv.h"
+#include "tag-trace.h"
+
+/*
+ * @brief return codes of push_queue_reserve / push_queue_try_write
+ */
+#define PUSH_QUEUE_OK           (0)
+#define PUSH_QUEUE_WOULD_BLOCK  (1)
+#define PUSH_QUEUE_ERROR        (-1)
+#define PUSH_QUEUE_DROPPED      (-2)    // done_cb status only
+
+#define PUSH_QUEUE_SIZE_DEFAULT (4 * 1024 * 1024)
+#define PUSH_QUEUE_VIDEO_SLACK_DEFAULT (300)
+
+/*
+ * @brief what the queue may drop when it is full or above its latency target,
+ * audio, script data and sequence headers are never dropped
+ *
+ * NONE: never drop, the queue returns PUSH_QUEUE_WOULD_BLOCK when full
+ * NON_REFERENCE: drop disposable and non-reference video frames
+ * GOP: as NON_REFERENCE, then drop video up to the next keyframe
+ */
+#define PUSH_QUEUE_DROP_POLICY_NONE             (0x00)
+#define PUSH_QUEUE_DROP_POLICY_NON_REFERENCE    (0x01)
+#define PUSH_QUEUE_DROP_POLICY_GOP              (0x02)
+
+/*
+ * Tags are stored in a single producer / single consumer byte ring: the
+ * writing thread reserves a record, fills the tag body in place and commits
+ * it, the sender thread sends it from the ring and hands the space back.
+ * Only one thread may write to a queue.
+ *
+ * The sender keeps script data, audio and video in separate lanes, each
+ * sent in order. Audio and script data overtake queued video as long as
+ * their timestamp is at most the video slack ahead of it, so a large
+ * keyframe does not hold up the audio behind it.
+ */
+typedef struct push_queue push_queue_t;
+typedef struct push_queue *push_queue_p;
+
+/*
+ * @brief called on the sender thread once a tag has left the queue
+ * @param[in] flv_tag: the queued tag, its memory is reused once this returns
+ * @param[in] status: PUSH_QUEUE_OK when pili_write_packet has written the tag
+ *            to the socket, PUSH_QUEUE_ERROR when it failed or was discarded,
+ *            PUSH_QUEUE_DROPPED when the drop policy removed it (this one is
+ *            reported on the writing thread)
+ */
+typedef void (*push_tag_done_cb)(flv_tag_p flv_tag, int status, void *opaque);
+
+/*
+ * @brief called when the queued media duration crosses a watermark
+ */
+typedef void (*push_watermark_cb)(push_queue_p queue, uint32_t queued_ms, void *opaque);
+
+/*
+ * @brief create a queue and its sender thread for an opened stream context
+ * @param[in] ctx: stream context already opened by pili_stream_push_open
+ * @param[in] size: ring size in bytes, 0 for default
+ * @param[in] max_ms: max queued media duration in ms, 0 for no limit
+ */
+push_queue_p push_queue_create(pili_stream_context_p ctx, uint32_t size, uint32_t max_ms);
+
+/*
+ * @brief set watermark callbacks before the first tag is written, high_cb fires once the queued duration
+ * reaches high_ms, low_cb fires once it has drained back to low_ms
+ */
+void push_queue_set_watermarks(push_queue_p queue,
+                               uint32_t high_ms,
+                               uint32_t low_ms,
+                               push_watermark_cb high_cb,
+                               push_watermark_cb low_cb,
+                               void *opaque);
+
+/*
+ * @brief set the drop policy
+ * @param[in] latency_target_ms: when non zero, frames are also dropped while
+ *            the media queued after the oldest unsent video frame exceeds it
+ */
+void push_queue_set_drop_policy(push_queue_p queue,
+                                uint8_t drop_frame_policy,
+                                uint32_t latency_target_ms);
+
+/*
+ * @brief stamp every tag at each stage and record it in tracer once written,
+ * set before the first tag is written, NULL turns tracing off
+ */
+void push_queue_set_tracer(push_queue_p queue, tag_tracer_p tracer);
+
+/*
+ * @brief how far ahead of queued video audio and script data may be sent,
+ * 0 sends the lanes interleaved by timestamp
+ */
+void push_queue_set_video_slack(push_queue_p queue, uint32_t video_slack_ms);
+
+/*
+ * @brief reserve room for a tag of data_size bytes without blocking
+ *
+ * On PUSH_QUEUE_OK flv_tag points into the ring with data and data_size set,
+ * the caller fills in the rest and passes it to push_queue_commit or
+ * push_queue_cancel before reserving again.
+ *
+ * @param[in] read_at: tag_trace_now() once the tag header was read, before
+ * any wait for room, 0 when there was nothing to wait for
+ * @return PUSH_QUEUE_OK / PUSH_QUEUE_WOULD_BLOCK / PUSH_QUEUE_ERROR
+ */
+int push_queue_reserve(push_queue_p queue, uint32_t data_size, uint64_t read_at, flv_tag_p *flv_tag);
+
+/*
+ * @brief queue a reserved tag, the reservation is used up either way
+ * @param[out] queued_ms: media duration queued after this call, may be NULL
+ * @return PUSH_QUEUE_OK / PUSH_QUEUE_ERROR if the stream failed
+ */
+int push_queue_commit(push_queue_p queue,
+                      flv_tag_p flv_tag,
+                      push_tag_done_cb done_cb,
+                      void *opaque,
+                      uint32_t *queued_ms);
+
+/*
+ * @brief give a reserved tag back without queueing it
+ */
+void push_queue_cancel(push_queue_p queue, flv_tag_p flv_tag);
+
+/*
+ * @brief copy a tag into the queue without blocking
+ *
+ * On PUSH_QUEUE_OK flv_tag is released with flv_release_tag and done_cb gets
+ * the queued copy; otherwise the caller keeps it.
+ *
+ * @param[out] queued_ms: media duration queued after this call, may be NULL
+ * @return PUSH_QUEUE_OK / PUSH_QUEUE_WOULD_BLOCK / PUSH_QUEUE_ERROR
+ */
+int push_queue_try_write(push_queue_p queue,
+                         flv_tag_p flv_tag,
+                         push_tag_done_cb done_cb,
+                         void *opaque,
+                         uint32_t *queued_ms);
+
+/*
+ * @brief block until the reservation that last returned
+ * PUSH_QUEUE_WOULD_BLOCK fits
+ * @return PUSH_QUEUE_OK / PUSH_QUEUE_ERROR if the stream failed
+ */
+int push_queue_wait_writable(push_queue_p queue);
+
+uint32_t push_queue_queued_ms(push_queue_p queue);
+
+/*
+ * @brief stop the sender thread and free the queue
+ * @param[in] drain: send what is still queued first instead of discarding it
+ */
+void push_queue_release(push_queue_p queue, int drain);
+
+#endif // PUSH_QUEUE_H_
@@ -0,0 +1,197 @@
+//
+//  tag-trace.c
+//  camera-sdk-demo
+//
+//  Created on 26/10/18
+//  Copyright (c) Pili Engineering, Qiniu Inc. All rights reserved.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include "tag-trace.h"
+
+struct tag_tracer {
+    uint64_t    buckets[TAG_TRACE_SPAN_COUNT][TAG_TRACE_BUCKET_COUNT];
+    uint64_t    count[TAG_TRACE_SPAN_COUNT];
+    uint64_t    sum[TAG_TRACE_SPAN_COUNT];
+    uint64_t    max[TAG_TRACE_SPAN_COUNT];
+
+    FILE        *trace_file;
+    uint32_t    sample_every;
+    uint64_t    recorded;
+};
+
+static const char *span_names[] = {
+    "wait",
+    "read",
+    "queue",
+    "write",
+    "total"
+};
+
+static const int span_stages[TAG_TRACE_SPAN_COUNT][2] = {
+    {TAG_TRACE_READ, TAG_TRACE_RESERVED},
+    {TAG_TRACE_RESERVED, TAG_TRACE_ENQUEUE},
+    {TAG_TRACE_ENQUEUE, TAG_TRACE_DEQUEUE},
+    {TAG_TRACE_DEQUEUE, TAG_TRACE_WRITTEN},
+    {TAG_TRACE_READ, TAG_TRACE_WRITTEN}
+};
+
+static const char *tag_names(uint8_t tag_type) {
+    switch (tag_type) {
+        case FLV_TAG_TYPE_AUDIO:
+            return "audio";
+        case FLV_TAG_TYPE_VIDEO:
+            return "video";
+        default:
+            return "script";
+    }
+}
+
+uint64_t tag_trace_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int bucket_of(uint64_t us) {
+    int i = 0;
+
+    while (i < TAG_TRACE_BUCKET_COUNT - 1 && us >= ((uint64_t)1 << i)) {
+        i++;
+    }
+    return i;
+}
+
+tag_tracer_p tag_tracer_create(const char *trace_path, uint32_t sample_every) {
+    tag_tracer_p tracer = (tag_tracer_p)calloc(1, sizeof(tag_tracer_t));
+    int span;
+    if (!tracer) {
+        return NULL;
+    }
+
+    if (trace_path && sample_every) {
+        tracer->trace_file = fopen(trace_path, "w");
+        if (!tracer->trace_file) {
+            free(tracer);
+            return NULL;
+        }
+        // name the track of each span
+        fprintf(tracer->trace_file, "[\n");
+        for (span = 0; span < TAG_TRACE_SPAN_TOTAL; span++) {
+            fprintf(tracer->trace_file,
+                    "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                    "\"args\":{\"name\":\"%s\"}}",
+                    span ? ",\n" : "", span + 1, span_names[span]);
+        }
+    }
+    tracer->sample_every = sample_every;
+
+    return tracer;
+}
+
+/*
+ * @brief one complete event per span, each span gets its own track
+ */
+static void export_tag(tag_tracer_p tracer, flv_tag_p flv_tag, const tag_trace_t *trace) {
+    int span;
+
+    for (span = 0; span < TAG_TRACE_SPAN_TOTAL; span++) {
+        uint64_t begin = trace->at[span_stages[span][0]];
+        uint64_t end = trace->at[span_stages[span][1]];
+
+        fprintf(tracer->trace_file,
+                "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                "\"ts\":%llu,\"dur\":%llu,\"args\":{\"timestamp\":%u,\"size\":%u}}",
+                ",\n",
+                span_names[span], tag_names(flv_tag->tag_type), span + 1,
+                (unsigned long long)begin, (unsigned long long)(end - begin),
+                flv_tag->timestamp, flv_tag->data_size);
+    }
+}
+
+void tag_tracer_record(tag_tracer_p tracer, flv_tag_p flv_tag, const tag_trace_t *trace) {
+    uint64_t us;
+    int span, bucket;
+
+    assert(NULL != tracer);
+    assert(NULL != trace);
+
+    for (span = 0; span < TAG_TRACE_SPAN_COUNT; span++) {
+        us = trace->at[span_stages[span][1]] - trace->at[span_stages[span][0]];
+        bucket = bucket_of(us);
+
+        tracer->buckets[span][bucket]++;
+        tracer->count[span]++;
+        tracer->sum[span] += us;
+        if (us > tracer->max[span]) {
+            tracer->max[span] = us;
+        }
+    }
+
+    if (tracer->trace_file && 0 == tracer->recorded % tracer->sample_every) {
+        export_tag(tracer, flv_tag, trace);
+    }
+    tracer->recorded++;
+}
+
+uint64_t tag_tracer_percentile(tag_tracer_p tracer, int span, double percentile) {
+    uint64_t wanted, seen = 0;
+    int i;
+
+    assert(NULL != tracer);
+    assert(span >= 0 && span < TAG_TRACE_SPAN_COUNT);
+
+    if (!tracer->count[span]) {
+        return 0;
+    }
+
+    wanted = (uint64_t)(tracer->count[span] * percentile / 100.0);
+    for (i = 0; i < TAG_TRACE_BUCKET_COUNT; i++) {
+        seen += tracer->buckets[span][i];
+        if (seen > wanted || seen == tracer->count[span]) {
+            break;
+        }
+    }
+
+    // upper bound of the bucket, but never above what was seen
+    if (((uint64_t)1 << i) > tracer->max[span]) {
+        return tracer->max[span];
+    }
+    return (uint64_t)1 << i;
+}
+
+void tag_tracer_print(tag_tracer_p tracer, FILE *out) {
+    int span;
+
+    assert(NULL != tracer);
+
+    for (span = 0; span < TAG_TRACE_SPAN_COUNT; span++) {
+        if (!tracer->count[span]) {
+            continue;
+        }
+        fprintf(out, "  %-5s tags: %llu avg: %llu us p50: %llu us p99: %llu us max: %llu us\n",
+                span_names[span],
+                (unsigned long long)tracer->count[span],
+                (unsigned long long)(tracer->sum[span] / tracer->count[span]),
+                (unsigned long long)tag_tracer_percentile(tracer, span, 50),
+                (unsigned long long)tag_tracer_percentile(tracer, span, 99),
+                (unsigned long long)tracer->max[span]);
+    }
+}
+
+void tag_tracer_release(tag_tracer_p tracer) {
+    if (!tracer) {
+        return;
+    }
+
+    if (tracer->trace_file) {
+        fprintf(tracer->trace_file, "\n]\n");
+        fclose(tracer->trace_file);
+    }
+    free(tracer);
+}
@@ -0,0 +1,85 @@
+//
+//  tag-trace.h
+//  camera-sdk-demo
+//
+//  Created on 26/10/18
+//  Copyright (c) Pili Engineering, Qiniu Inc. All rights reserved.
+//
+
+#ifndef TAG_TRACE_H_
+#define TAG_TRACE_H_ (1)
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "pili_type.h"
+#include "flv.h"
+
+/*
+ * @brief stages a tag goes through, stamped in microseconds
+ *
+ * READ: the parser read the tag header and asks for room for the body
+ * RESERVED: the queue had room, the body is read into it from here
+ * ENQUEUE: the body is read and the tag is queued
+ * DEQUEUE: the sender took the tag and hands it to pili_write_packet
+ * WRITTEN: pili_write_packet returned
+ */
+#define TAG_TRACE_READ          (0)
+#define TAG_TRACE_RESERVED      (1)
+#define TAG_TRACE_ENQUEUE       (2)
+#define TAG_TRACE_DEQUEUE       (3)
+#define TAG_TRACE_WRITTEN       (4)
+#define TAG_TRACE_STAGE_COUNT   (5)
+
+/*
+ * @brief spans aggregated into histograms: backpressure, disk, queue, socket
+ * and end to end
+ */
+#define TAG_TRACE_SPAN_WAIT     (0)
+#define TAG_TRACE_SPAN_READ     (1)
+#define TAG_TRACE_SPAN_QUEUE    (2)
+#define TAG_TRACE_SPAN_WRITE    (3)
+#define TAG_TRACE_SPAN_TOTAL    (4)
+#define TAG_TRACE_SPAN_COUNT    (5)
+
+// bucket i counts latencies below 2^i us
+#define TAG_TRACE_BUCKET_COUNT  (32)
+
+typedef struct tag_trace {
+    uint64_t at[TAG_TRACE_STAGE_COUNT];
+} tag_trace_t;
+
+typedef struct tag_tracer tag_tracer_t;
+typedef struct tag_tracer *tag_tracer_p;
+
+/*
+ * @brief monotonic clock in microseconds
+ */
+uint64_t tag_trace_now(void);
+
+/*
+ * @brief create a tracer
+ * @param[in] trace_path: Chrome trace event JSON written here, NULL for none
+ * @param[in] sample_every: export one tag out of sample_every, 0 for none
+ */
+tag_tracer_p tag_tracer_create(const char *trace_path, uint32_t sample_every);
+
+/*
+ * @brief add a tag that went through every stage, only one thread may record
+ */
+void tag_tracer_record(tag_tracer_p tracer, flv_tag_p flv_tag, const tag_trace_t *trace);
+
+/*
+ * @brief latency below which the given share of the span falls, in us
+ * @param[in] percentile: 0 - 100
+ */
+uint64_t tag_tracer_percentile(tag_tracer_p tracer, int span, double percentile);
+
+void tag_tracer_print(tag_tracer_p tracer, FILE *out);
+
+/*
+ * @brief close the trace file and free the tracer
+ */
+void tag_tracer_release(tag_tracer_p tracer);
+
+#endif // TAG_TRACE_H_